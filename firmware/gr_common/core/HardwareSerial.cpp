@@ -42,8 +42,10 @@
 #include "rx63n/iodefine.h"
 /*NOTE USB0 is defined in iodefine.h file*/
 #define USBIO USB0
+#define PID_NAK     0
 #define PID_BUF     1
 /////////////////////////////////////////////
+extern "C" void ReadBulkOUTPacket(void);
 
 struct SciInterruptRegistersTableStruct {
   uint8_t _txier;
@@ -504,11 +506,27 @@ int HardwareSerial::read(void)
 	_rx_buffer_tail = (uint8_t)(_rx_buffer_tail + 1) % SERIAL_BUFFER_SIZE;
 #else
 	_rx_buffer_tail = (uint32_t)(_rx_buffer_tail + 1) % SERIAL_BUFFER_SIZE;
+#endif
+#if defined(GRSAKURA) && defined(HAVE_HWSERIAL0)
+    // USB: once a whole packet fits again, take the held packet and re-open the pipe
+    if (_rx_hold && _rx_room() >= BULK_OUT_PACKET_SIZE) {
+      noInterrupts();
+      ReadBulkOUTPacket();
+      interrupts();
+    }
 #endif
     return c;
   }
 }
 
+#ifdef GRSAKURA
+// free bytes in the rx ring buffer (one slot is always kept empty)
+int HardwareSerial::_rx_room(void)
+{
+  return SERIAL_BUFFER_SIZE - 1 - available();
+}
+#endif
+
 void HardwareSerial::flush()
 {
 #ifndef GRSAKURA
@@ -659,6 +677,47 @@ size_t HardwareSerial::write(uint8_t c)
 }
 
 
+#ifdef GRSAKURA
+// USB: copy a whole block into the tx ring, toggling the BRDY interrupt once per chunk
+// instead of once per byte. Waits for room instead of dropping data, but gives up
+// when the host has not taken anything for USB_TX_TIMEOUT msec or interrupts are off.
+#define USB_TX_TIMEOUT 100
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+#if defined(HAVE_HWSERIAL0)
+  if (_serial_channel == 0 && _begin) {
+    size_t n = 0;
+    unsigned long start = millis();
+    while (n < size) {
+      unsigned int room = (SERIAL_BUFFER_SIZE + _tx_buffer_tail - _tx_buffer_head - 1) % SERIAL_BUFFER_SIZE;
+      if (room == 0) {
+        // with interrupts disabled neither the ring nor millis() would move
+        if (isNoInterrupts() || (millis() - start) > USB_TX_TIMEOUT) {
+          break;
+        }
+        continue;
+      }
+      if (room > size - n) {
+        room = size - n;
+      }
+      unsigned int head = _tx_buffer_head;
+      for (unsigned int i = 0; i < room; i++) {
+        _tx_buffer[head] = buffer[n++];
+        head = (head + 1) % SERIAL_BUFFER_SIZE;
+      }
+      USB0.INTENB0.BIT.BRDYE = 0;
+      _tx_buffer_head = head;
+      USB0.INTENB0.BIT.BRDYE = 1;
+      USB0.BRDYENB.BIT.PIPE2BRDYE = 1;
+      start = millis();
+    }
+    return n;
+  }
+#endif
+  return Print::write(buffer, size);
+}
+#endif/*GRSAKURA*/
+
 #endif // whole file
 
 #ifdef GRSAKURA
@@ -676,6 +735,15 @@ void ReadBulkOUTPacket(void)
     USBIO.D1FIFOSEL.BIT.CURPIPE = PIPE_BULK_OUT;
     }while(USBIO.D1FIFOSEL.BIT.CURPIPE != PIPE_BULK_OUT);
 
+    /*If the rx buffer can not take a whole packet, leave it in the FIFO and NAK the host.
+      Serial.read() calls here again once there is room, so no data is dropped.*/
+    if(Serial._rx_room() < BULK_OUT_PACKET_SIZE){
+        USBIO.PIPE1CTR.BIT.PID = PID_NAK;
+        Serial._set_rx_hold(true);
+        return;
+    }
+    Serial._set_rx_hold(false);
+
     /*Set PID to BUF*/
     USBIO.PIPE1CTR.BIT.PID = PID_BUF;
 
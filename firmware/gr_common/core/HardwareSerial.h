@@ -94,6 +94,7 @@ class HardwareSerial : public Stream
     int8_t _serial_channel;
     volatile bool _sending;
     volatile bool _begin;
+    volatile bool _rx_hold;   // USB: rx buffer was full, a packet is held in the FIFO with the pipe NAKed
 #endif/*GRSAKURA*/
 
 #if SERIAL_BUFFER_SIZE < 256
@@ -136,6 +137,9 @@ class HardwareSerial : public Stream
     virtual int read(void);
     virtual void flush(void);
     virtual size_t write(uint8_t);
+#ifdef GRSAKURA
+    virtual size_t write(const uint8_t *buffer, size_t size);
+#endif/*GRSAKURA*/
     inline size_t write(unsigned long n) { return write((uint8_t)n); }
     inline size_t write(long n) { return write((uint8_t)n); }
     inline size_t write(unsigned int n) { return write((uint8_t)n); }
@@ -151,6 +155,8 @@ class HardwareSerial : public Stream
     inline bool _store_char(unsigned char c);
     inline unsigned char _extract_char();
     bool _buffer_available();
+    int _rx_room(void);
+    void _set_rx_hold(bool hold) { _rx_hold = hold; }
 #endif/*GRSAKURA*/
     void _tx_udr_empty_irq(void);
 };
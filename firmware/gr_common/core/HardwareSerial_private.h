@@ -106,6 +106,7 @@ HardwareSerial::HardwareSerial(
     _serial_channel(serial_channel),
     _sending(false),
     _begin(false),
+    _rx_hold(false),
     _rx_buffer_head(0), _rx_buffer_tail(0),
     _tx_buffer_head(0), _tx_buffer_tail(0)
 {
@@ -58,60 +58,86 @@ uint8_t EEPROMClass::read(int address)
 }
 
 uint8_t EEPROMClass::write(int address, uint8_t value)
+{
+    return this->write(address, &value, 1);
+}
+
+int EEPROMClass::read(int address, uint8_t *buf, int len)
+{
+#ifndef GRSAKURA
+    for (int i = 0; i < len; i++){
+        buf[i] = eeprom_read_byte((unsigned char *) (address + i));
+    }
+#else
+    // blank check once per DF_ALIGN unit, not once per byte
+    int i = 0;
+    while (i < len){
+        uint32_t w_addr = (address + i) & 0xfffffffe;
+        bool blank = (flash_datarom_blankcheck(DF_ADDRESS + w_addr) == 0);
+        for (; i < len && ((address + i) & 0xfffffffe) == w_addr; i++){
+            buf[i] = blank ? 0xff : *(volatile unsigned char *)(address + i + DF_ADDRESS);
+        }
+    }
+#endif //GRSAKURA
+    return len;
+}
+
+uint8_t EEPROMClass::write(int address, const uint8_t *buf, int len)
 {
 uint8_t result = FLASH_SUCCESS;
 #ifndef GRSAKURA
-	eeprom_write_byte((unsigned char *) address, value);
+    for (int i = 0; i < len; i++){
+        eeprom_write_byte((unsigned char *) (address + i), buf[i]);
+    }
 #else
-	uint8_t wbuf[DF_ALIGN];
-	uint8_t rbuf[DF_ERASE_BLOCK_SIZE]; // for block write
-	uint8_t bbuf[DF_ERASE_BLOCK_SIZE]; // for blank check
-	uint32_t w_addr = address & 0xfffffffe; // needed for blank check to target address
-	uint32_t b_addr = address & 0xffffffe0; // block address
-
-	for (int i = 0; i < DF_ALIGN; i++){
-	    if((address & 0x00000001) == i){
-	        wbuf[i] = value;
-	    } else {
-            wbuf[i] = this->read(w_addr + i);
-	    }
-	}
-
-	if(flash_datarom_blankcheck(DF_ADDRESS + w_addr)){
-	    // not blank
-	    for(uint8_t i = 0; i < DF_ERASE_BLOCK_SIZE; i+=DF_ALIGN){
-	        if(flash_datarom_blankcheck(DF_ADDRESS + b_addr + i)){
-                bbuf[i]   = 0;
-	            // not blank
-                if (i == (w_addr & 0x1f)){
-                    for(int j = 0 ; j < DF_ALIGN; j++){
-                        rbuf[i + j]   = wbuf[j];
-                    }
-                } else {
-                    for(int j = 0 ; j < DF_ALIGN; j++){
-                        rbuf[i + j]   = this->read(b_addr + i + j);
-                    }
-                }
-	        } else {
-                bbuf[i] = 1;
-	        }
-	    }
-	    result = flash_datarom_EraseBlock(DF_ADDRESS + (address & DF_BLOCK_MASK));
-
-	    for(int i = 0; i < DF_ERASE_BLOCK_SIZE; i+=DF_ALIGN){
-            if(bbuf[i]){ // do nothing because of blank
-
-            } else {
-                result = flash_datarom_WriteData(DF_ADDRESS + b_addr + i, &rbuf[i], DF_ALIGN);
+    // all bytes that fall in one erase block are merged into one image,
+    // so the block is erased at most once and programmed in DF_ALIGN units
+    const int units = DF_ERASE_BLOCK_SIZE / DF_ALIGN;
+    uint8_t rbuf[DF_ERASE_BLOCK_SIZE]; // block image
+    bool blank[DF_ERASE_BLOCK_SIZE / DF_ALIGN]; // unit was blank
+    bool dirty[DF_ERASE_BLOCK_SIZE / DF_ALIGN]; // unit has new data
+
+    int i = 0;
+    while (i < len && result == FLASH_SUCCESS){
+        uint32_t b_addr = (address + i) & DF_BLOCK_MASK; // block address
+
+        // read the block once. blank units read as 0xff
+        for (int u = 0; u < units; u++){
+            blank[u] = (flash_datarom_blankcheck(DF_ADDRESS + b_addr + u * DF_ALIGN) == 0);
+            dirty[u] = false;
+            for (int j = 0; j < DF_ALIGN; j++){
+                rbuf[u * DF_ALIGN + j] = blank[u] ? 0xff : *(volatile unsigned char *)(DF_ADDRESS + b_addr + u * DF_ALIGN + j);
             }
         }
 
-	} else { // blank
-	    result = flash_datarom_WriteData(DF_ADDRESS + w_addr, wbuf, DF_ALIGN);
-	}
+        // merge the new bytes. erase only if a unit that is not blank changes
+        bool erase = false;
+        for (; i < len && ((address + i) & DF_BLOCK_MASK) == b_addr; i++){
+            int pos = (address + i) - b_addr;
+            int u = pos / DF_ALIGN;
+            if (blank[u]){
+                dirty[u] = true;
+            } else if (rbuf[pos] != buf[i]){
+                dirty[u] = true;
+                erase = true;
+            }
+            rbuf[pos] = buf[i];
+        }
 
+        if (erase){
+            result = flash_datarom_EraseBlock(DF_ADDRESS + b_addr);
+        }
+        for (int u = 0; u < units && result == FLASH_SUCCESS; u++){
+            // after an erase, units that were not blank are written back too.
+            // a unit left as 0xffff stays blank
+            bool ff = (rbuf[u * DF_ALIGN] == 0xff && rbuf[u * DF_ALIGN + 1] == 0xff);
+            if ((dirty[u] || (erase && !blank[u])) && !(ff && (erase || blank[u]))){
+                result = flash_datarom_WriteData(DF_ADDRESS + b_addr + u * DF_ALIGN, &rbuf[u * DF_ALIGN], DF_ALIGN);
+            }
+        }
+    }
 #endif //GRSAKURA
-	return result;
+    return result;
 }
 
 EEPROMClass EEPROM;
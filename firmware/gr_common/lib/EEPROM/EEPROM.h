@@ -31,6 +31,8 @@ class EEPROMClass
 #endif
         uint8_t read(int);
         uint8_t write(int, uint8_t);
+        int read(int, uint8_t *, int);
+        uint8_t write(int, const uint8_t *, int);
 };
 
 extern EEPROMClass EEPROM;
@@ -13,6 +13,7 @@
 //
 // ファイルサイズ
 //  先頭セクタのファイル名に続く2バイトに入っている
+//  CRC付きのファイルは、ファイル名の後を2バイト境界に揃えて、サイズとデータのCRCを2バイトずつ置く
 //
 // データ
 //  先頭セクタのファイル名に続く2バイト以降に入っている
@@ -21,7 +22,41 @@
 //  xxxxxxxxxxxxxxxxxxx00 | 0000 | zzzzzzzzzzzzz...
 //  ファイル名　　　00終端 サイズ　生データ
 //
-// Address 0x0000～0x00FFまでは、EEPROMのPush Popに使われる
+//  xxxxxxxxxxxxxxxxxxx00(00) | 0000 | 0000 | zzzzzzzzzzzzz...  (CRC付き)
+//  ファイル名　　　00終端     サイズ  CRC    生データ
+//
+// Address 0x0000～0x00FFまでは、EEPROMのPush Popに使われていた。今はKVSに移して使わない
+//
+// KVS(キーと値の保存領域)
+//  データフラッシュの最後の2KBを1KBずつのバンク0と1に分けて、交互に使う
+//  バンクの先頭に識別値'KV'と通番と通番の反転、続けてレコード [キー長][~キー長][値の長さ2][CRC2] キー 値 を2バイト境界に揃えて並べる
+//  書き換えは使っているバンクのブランクの箇所にレコードを追記するだけで、同じキーの古いレコードは読み飛ばす
+//  バンクがいっぱいになったら、最新のレコードだけをもう一方のバンクに詰め直して、最後に識別値と通番を書き込む
+//  レコードはデータを書き込んでから先頭を書き込むので、書き込み途中で電源が切れたレコードは読み込まれない
+//  キーごとの最新のレコードのアドレスはRAMのインデックスに持つ
+//  System.push/popのデータも、32バイトずつ先頭が0x00のキーで保存している
+//  KVSの2KBの分だけファイルに使える領域が減り、ファイルに使うのはEEPENDSECTまで(512バイトセクタのときはセクタ59まで)
+//  KVSが無かった頃のフォーマットでKVSの領域(512バイトセクタのときはセクタ60～63)にあったファイルは、
+//  最初のbegin()で何も表示せずに空きセクタへ移す。移す空きセクタが足りないときは、ファイルシステムを初期化する(ファイルは消える)
+//
+// FATはA面とB面の2つを交互に書き、FATに続くイレースブロックに通番とCRCを最後に書き込む
+// 起動時はCRCが合っている面の中で通番が新しい方を使うので、FATの書き込み中に電源が切れても前のFATに戻る
+//
+// 既にあるファイルをWRITEオープンしたときは、空きセクタに新しいファイルを書き、
+// fclose()で元のファイルの削除と新しいファイルの登録を1回のFATの書き込みで行う
+// 書き込み中の新しいファイルのセクタは、FATには空きセクタとして保存される
+//
+// リングログのファイル
+//  先頭セクタの最初のイレースブロックにファイル名、2つ目のブロックからをリングにする
+//  各ブロックの先頭2バイトに通番、続けてレコード [長さ][CRCの下位バイト] データ... を2バイト境界に揃えて並べる
+//  レコードはブランクの箇所に書き込むだけで、サイズもFATも書き換えない。リングが一周したら一番古いブロックを消去する
+//  オープンしたときに通番を調べて、一番新しいブロックと一番古いブロックを探す
+//
+// 書き込みはFILEEEPが持つ書き込みバッファ(イレースブロック32バイト分)に溜めて、
+// 別のブロックへの書き込み、fseek、fcloseのタイミングでブロック単位に書き込む
+//
+// セクタサイズはeepfile.hのEEPSECTOR_SIZEで128, 256, 512バイトから選べる
+// FAT保存領域の先頭(セクタ0のFAT)にセクタサイズの識別値を入れておき、違っていたらフォーマットし直す
 //***********************************************************
 #include <Arduino.h>
 #include <EEPROM.h>
@@ -36,26 +71,155 @@
 #  define DEBUG_PRINT(m,v)    // do nothing
 #endif
 
-#define EEPSIZE			0x8000
-#define EEPSECTOR_SIZE	512
-#define EEPSECTORS		(EEPSIZE / EEPSECTOR_SIZE)
-
-#define EEPSTASECT		1
-#define EEPENDSECT		(EEPSECTORS - 1)
-
-#define EEPFAT_START	0x100	//0x100～0x13FまでをFAT保存領域として使っている
+#define EEPFAT_START	0x100	//0x100からFAT保存領域のA面とB面を並べている
+#define EEPFAT_SIZE		(EEPSECTORS * 2)	//FATのバイト数
+#define EEPFAT_BLOCKS	(EEPFAT_SIZE / DF_ERASE_BLOCK_SIZE)	//FATのイレースブロック数
+#define EEPFAT_COPY		(EEPFAT_SIZE + DF_ERASE_BLOCK_SIZE)	//FAT保存領域1面の大きさ。FATに続く1イレースブロックに通番とCRCを入れる
+#define EEPFAT_ADDR(n)	(EEPFAT_START + (n) * EEPFAT_COPY)	//A面(0)、B面(1)の先頭アドレス
+#define EEPWEAR_START	(EEPFAT_START + EEPFAT_COPY * 2)	//FATに続けてEEPSECTORS*2バイトをセクタごとの消去回数の保存領域として使っている(512バイトセクタのときは0x240～0x2BF)
+#define EEPWEAR_LIMIT	(16 * (EEPSECTOR_SIZE / DF_ERASE_BLOCK_SIZE))	//空きセクタと使用中セクタの消去回数の差がこれ(セクタを16回書き換えた分)を超えたら、使用中セクタを移動する
+
+#define EEPSTASECT		((EEPWEAR_START + EEPSECTORS * 2 + EEPSECTOR_SIZE - 1) / EEPSECTOR_SIZE)	//Push Pop、FAT、消去回数の保存領域より後ろのセクタをファイルに使う
+
+//FATが1面だった頃のフォーマット。0x100からFAT、続けて消去回数を保存していた
+#define EEPOLDWEAR_START	(EEPFAT_START + EEPFAT_SIZE)
+#define EEPOLDSTASECT		((EEPOLDWEAR_START + EEPSECTORS * 2 + EEPSECTOR_SIZE - 1) / EEPSECTOR_SIZE)
+#define EEPENDSECT		(EEPKV_START / EEPSECTOR_SIZE - 1)	//KVSより前のセクタをファイルに使う(512バイトセクタのときは59)
+
+#define EEPKV_BANK		0x400	//KVSの1バンクのバイト数
+#define EEPKV_START		(EEPSIZE - EEPKV_BANK * 2)	//KVSはデータフラッシュの最後の2バンクを使う(0x7800～0x7FFF)
+#define EEPKV_ADDR(n)	(EEPKV_START + (n) * EEPKV_BANK)	//バンク0とバンク1の先頭アドレス
+#define EEPKV_HEAD		6		//バンクの先頭の識別値'KV'、通番、通番の反転のバイト数
+#define EEPKV_RECHEAD	6		//レコードの先頭の[キー長][~キー長][値の長さ2][CRC2]のバイト数
+#define EEPKV_KEYS		40		//KVSに入れられるキーの数(Push Popの8個を含む)
+#define EEPKV_DELETE	0xFFFF	//キーを削除したレコードの値の長さ
+#define EEPKV_PUSHSEG	32		//Push Popの領域をこのバイト数ずつKVSの値にする
+
+#define EEPNEXT_MASK	0x00FF	//Sect[]の次のセクタ番号のビット
+#define EEPFORMAT_ID	(512 / EEPSECTOR_SIZE - 1)	//Sect[0]の次のセクタ番号の位置に入れておくセクタサイズの識別値。512バイトのときは0
 
 #define EEP_EMPTY	0		//未使用
 #define EEP_TOP		1		//先頭
 #define EEP_USED	2		//使用中
 
+#define EEPBLOCK_UNITS	(DF_ERASE_BLOCK_SIZE / DF_ALIGN)	//1イレースブロック内の書き込み単位数
+#define EEPIDLE_MSEC	5		//idle()の1回の処理時間の目安(ms)
+
+#define EEP_ZIP		1		//Sect[]の12ビット目。先頭セクタに立っていれば圧縮ファイル
+#define EEP_CRC		1		//Sect[]の13ビット目。先頭セクタに立っていればヘッダにデータのCRCがあるファイル
+#define EEP_NEW		1		//Sect[]の14ビット目。fclose()で元のファイルと置き換える書き込み中のセクタ。FATには空きセクタとして保存する
+#define EEP_LOG		1		//Sect[]の15ビット目。先頭セクタに立っていればリングログのファイル
+#define ISRING(sect)	((sect) >= EEPSTASECT && ((Sect[(sect)] >> 15) & 0x1) == EEP_LOG)	//リングログのファイルかどうか
+
+#define EEPZ_WINDOW	256		//圧縮で一致を探す範囲(距離は1～256)
+#define EEPZ_MINLEN	3		//一致とみなす最短の長さ
+#define EEPZ_MAXLEN	34		//一致の最長の長さ(符号化の先読みの大きさ)
+#define EEPZ_TOKENS	8		//フラグ1バイトでまとめるトークン数
+
+//圧縮ファイルの符号化・復号の状態。圧縮ファイルをオープンしている間だけmallocする
+//圧縮データは先頭2バイトに元のデータのサイズ、続けてフラグ1バイトとトークン8個の組が並ぶ
+//フラグのビットが0のトークンは生データ1バイト、1のトークンは一致で[距離-1][長さ-3]の2バイト
+struct EEPZIP {
+	unsigned char win[EEPZ_WINDOW + EEPZ_MAXLEN];	//符号化: 一致を探す範囲と先読みのデータ。復号: 一致を探す範囲のリングバッファ
+	unsigned char io[EEPZ_TOKENS * 2];	//符号化: 書き出し待ちのトークン。復号: 読み込んだ圧縮データ
+	unsigned char iolen;		//ioのバイト数
+	unsigned char iopos;		//復号: ioの読み出し位置
+	unsigned char flags;		//トークンのフラグ
+	unsigned char ntok;			//符号化: ioに溜めたトークン数。復号: flagsの残りのトークン数
+	unsigned short hist;		//符号化: winの一致を探す範囲のバイト数。復号: winの書き込み位置
+	unsigned short pend;		//符号化: winの先読みのバイト数
+	unsigned short mdist;		//復号: コピー中の一致の距離
+	unsigned short mlen;		//復号: コピー中の一致の残りの長さ
+	unsigned short usize;		//元のデータのサイズ
+	unsigned short upos;		//元のデータでの位置
+};
+
 //宣言
 EEPFILE	EEP;
 
-//Sect[]→ 0～6ビット(00～7F)が次のセクタを示す。次のセクタが自分自身を指しているときは最終セクタ。
+//Sect[]→ 0～7ビット(00～FF)が次のセクタを示す。次のセクタが自分自身を指しているときは最終セクタ。
 //　　　　　　　　　9,10ビットは、0:未使用、1:先頭、2:使用中 をあらわす。
 //					11,12ビットは、0:オープンしていない、1:READオープン、2:WRITE||APPENDオープン をあらわす。
-static unsigned short Sect[EEPSECTORS];		//512バイトを1セクタとして管理する。saveFat()のタイミングでEEPROMに保存される。
+//					13ビットは、先頭セクタのときに1であれば圧縮ファイルをあらわす。
+//					14ビットは、先頭セクタのときに1であればヘッダにCRCがあるファイルをあらわす。
+//					15ビットは、1であれば書き込み中の置き換え用のセクタをあらわす。FATには保存しない。
+//					16ビットは、先頭セクタのときに1であればリングログのファイルをあらわす。
+static unsigned short Sect[EEPSECTORS];		//EEPSECTOR_SIZEバイトを1セクタとして管理する。saveFat()のタイミングでEEPROMに保存される。
+
+//Sect[]を書き換えたFATのイレースブロックのビット。A面とB面で別々に持ち、saveFat()はビットが立っているブロックだけを書き込む
+//WearDirtyはWear[]を書き換えた消去回数の保存領域のイレースブロックのビット
+static unsigned long FatDirty[2];
+static unsigned long WearDirty;
+#define FATDIRTY(sect)	(FatDirty[0] |= 1UL << ((sect) * 2 / DF_ERASE_BLOCK_SIZE), FatDirty[1] |= 1UL << ((sect) * 2 / DF_ERASE_BLOCK_SIZE))
+#define WEARDIRTY(sect)	(WearDirty |= 1UL << ((sect) * 2 / DF_ERASE_BLOCK_SIZE))
+
+//最後に書き込んだFATの面(0:A面, 1:B面)と通番
+static int FatCopy;
+static unsigned long FatSeq;
+
+//セクタごとの消去回数(セクタ内のイレースブロックを消去した回数の合計)。eraseBlock()で数えます
+//saveFat()のタイミングでFATと一緒にEEPROMに保存される。フォーマットしても消さない。ブランク(0xFFFF)は0回とする
+static unsigned short Wear[EEPSECTORS];
+
+//データフラッシュの消去回数と書き込み回数(DF_ALIGN単位)。IdleEraseCountはidle()で消去した回数
+static unsigned long EraseCount;
+static unsigned long ProgramCount;
+static unsigned long IdleEraseCount;
+
+//ファイル名インデックス。先頭セクタごとにファイル名のハッシュ値、長さ、ファイルサイズを持つ
+//begin()で作成し、ファイルの作成・削除・クローズで更新するので、ファイル名の検索でEEPROMを走査しない
+typedef struct {
+	unsigned short hash;		//ファイル名のハッシュ値
+	unsigned short size;		//ファイルサイズ
+	unsigned char len;			//ファイル名の長さ
+} EEPINDEX;
+static EEPINDEX Index[EEPSECTORS];
+
+//イレースブロックごとに、ブランクの箇所が無いことを確認済みであれば1が立つ。確認済みのブロックはブランクチェックせずに読み出せる
+static unsigned char Programmed[EEPSIZE / DF_ERASE_BLOCK_SIZE / 8];
+
+//イレースブロックごとに、全てブランクであることが分かっていれば1が立つ。このブロックへの書き込みは消去もブランクチェックもしない
+//idle()で空きセクタを消去したときと、ブランクチェックで全てブランクだったときに立てる
+static unsigned char Erased[EEPSIZE / DF_ERASE_BLOCK_SIZE / 8];
+static int IdleBlock;		//idle()が次に調べるイレースブロック
+
+//KVSのインデックス。キーごとにキーのハッシュ値と、最新のレコードのアドレスを持つ
+typedef struct {
+	unsigned short hash;		//キーのハッシュ値
+	unsigned short addr;		//最新のレコードのアドレス
+} EEPKVINDEX;
+static EEPKVINDEX KvIndex[EEPKV_KEYS];
+static int KvCount;				//インデックスのキーの数
+static int KvBank = -1;			//使っているバンク(0か1)。-1のときは使えない
+static unsigned short KvSeq;	//使っているバンクの通番
+static unsigned short KvEnd;	//次にレコードを書き込むバンク内の位置
+static bool KvTorn;				//書き込み途中で電源が切れたレコードが末尾に残っている。次の書き込みでバンクを詰め直す
+
+//CRC-16(CCITT)を求めます。4ビットずつの表を使います
+unsigned short crc16(unsigned short crc, const unsigned char *p, int len)
+{
+	static const unsigned short tbl[16] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+		0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+	};
+	for (int i = 0; i < len; i++){
+		crc = (crc << 4) ^ tbl[(crc >> 12) ^ (p[i] >> 4)];
+		crc = (crc << 4) ^ tbl[(crc >> 12) ^ (p[i] & 0x0F)];
+	}
+	return crc;
+}
+
+//ファイル名の長さから、先頭セクタのファイルデータの開始位置を求めます
+static int dataOffset(int len, bool crc)
+{
+	return crc ? ((len + 2) & ~1) + 4 : len + 3;
+}
+
+//fcopy()のコピー元。EEPファイルからまとめて読み込みます
+static int eepSource(void *src, char *buf, int len)
+{
+	return EEP.fread((FILEEEP*)src, buf, len);
+}
 
 //******************************************************
 // FATセクターを表示します
@@ -74,6 +238,9 @@ void EEPFILE::viewFat(void)
 		}
 	}
 	Serial.println();
+
+	sprintf(az, "Erase %lu (Idle %lu), Program %lu", EraseCount, IdleEraseCount, ProgramCount);
+	Serial.println(az);
 }
 
 //******************************************************
@@ -94,8 +261,10 @@ void EEPFILE::viewSector(int sect)
 		sprintf(az, "%04X", add + 16 * i);
 		Serial.print(az);
 
+		unsigned char dat[16];
+		EEPROM.read(add + 16 * i, dat, 16);
 		for(int j=0; j<16; j++){
-			sprintf(az, " %02X", EEPROM.read(add + 16 * i + j));
+			sprintf(az, " %02X", dat[j]);
 			Serial.print(az);
 		}
 		Serial.println();
@@ -109,36 +278,151 @@ void EEPFILE::viewSector(int sect)
 //******************************************************
 void EEPFILE::begin(int clear)
 {
-	if (clear == 0 && isReady() == 1){
+	//ブランクチェックの結果は電源を入れ直すと分からなくなるので、調べ直します
+	memset(Programmed, 0, sizeof(Programmed));
+	memset(Erased, 0, sizeof(Erased));
+
+	//CRCが合っている面の中で、通番が新しい方のFATを使います
+	unsigned long seq[2];
+	int copy = -1;
+	for (int n = 0; n < 2; n++){
+		if (checkFat(EEPFAT_ADDR(n), &seq[n]) == 1 && (copy == -1 || seq[n] > seq[copy])){
+			copy = n;
+		}
+	}
+
+	//どちらの面も使えないときは、FATが1面だった頃のフォーマットかどうかを調べます
+	//セクタサイズが違うフォーマットのときは、消去回数は0回からにして、ファイルシステムを初期化します
+	//FATが1面だった頃の消去回数の保存領域はB面と重なっていて、移す途中で書き換わるので、そのときも0回からにします
+	bool old = (copy == -1 && isReady() == 1);
+	bool same = (EEPROM.read( old ? EEPFAT_START : EEPFAT_ADDR(copy == -1 ? 0 : copy) ) == EEPFORMAT_ID);
+	if (copy == -1 && !old){
+		same = false;
+	}
+
+	// EEPROMからセクタごとの消去回数を読み込みます。イレースブロック単位でまとめて読み込みます
+	unsigned char wbuf[DF_ERASE_BLOCK_SIZE];
+	for (int i=0; i<EEPSECTORS; i++){
+		if ((i * 2) % DF_ERASE_BLOCK_SIZE == 0){
+			EEPROM.read( EEPWEAR_START + i*2, wbuf, DF_ERASE_BLOCK_SIZE );
+		}
+		int p = (i * 2) % DF_ERASE_BLOCK_SIZE;
+		Wear[i] = wbuf[p] + (wbuf[p + 1]<<8);
+		if (Wear[i] == 0xFFFF || !same || old){
+			Wear[i] = 0;
+		}
+	}
+
+	//次に書き込むFATは、残っているFATより通番を新しくして、使っている面と反対の面に書きます
+	FatCopy = (copy == -1) ? 0 : copy;
+	FatSeq = (copy == -1) ? 0 : seq[copy];
+
+	if (clear == 0 && same){
 		// EEPROMからFATを読み込みます
-		for (int i=0; i<EEPSECTORS; i++){
-			Sect[i] = EEPROM.read( EEPFAT_START + i*2 ) + (EEPROM.read( EEPFAT_START + i*2 + 1 )<<8);
+		loadFat(old ? EEPFAT_START : EEPFAT_ADDR(copy));
+		FatDirty[FatCopy] = 0;
+		FatDirty[1 - FatCopy] = ~0UL;
+		WearDirty = 0;
+
+		//FATが1面だった頃やKVSが無かった頃のフォーマットのときは、増えた予約セクタのデータを移して、FATを書き込みます
+		//FATが1面だった頃からのときは、B面がセクタ1と重なっているので、B面を書いている途中で電源が切れると
+		//セクタ1のデータが壊れます。そのときは移し先にコピーし終わっているので、FATだけを付け替えて書き直します
+		int moved = -1;
+		if (old){
+			moved = moveReserved(false);
+			if (moved == -1 || fatStarted(EEPFAT_ADDR(1)) == 0){
+				loadFat(EEPFAT_START);
+				moved = -1;
+			}
+		}
+		if (moved == -1){
+			moved = moveReserved(true);
+		}
+		if (moved == -1){
+			begin(1);
+			return;
+		}
+		if (old){
+			WearDirty = ~0UL;
+		}
+		if (old || moved > 0){
+			saveFat();
+		}
+
+		// ファイル名インデックスを作成します
+		for (int i=EEPSTASECT; i<=EEPENDSECT; i++){
+			setIndex(i);
 		}
+
+		// 消去回数の偏りが大きければ、書き換えられていないセクタを1つ移動します
+		wearLevel();
 	}
 	else{
 		// ファイルシステムを初期化します
 
+		//オープン中のファイル(データフラッシュ上で実行中のmrbファイルなど)のセクタは残します
+		//オープンフラグは先頭セクタにしか立っていないことがあるので、つながっているセクタにも立てておきます
+		for (int i=EEPSTASECT; i<=EEPENDSECT; i++){
+			if (((Sect[i] >> 8) & 0x3) == EEP_TOP && ((Sect[i] >> 10) & 0x3) != EEP_CLOSE){
+				int sect = i;
+				int next;
+				while(true){
+					Sect[sect] |= Sect[i] & (3 << 10);
+					next = Sect[sect] & EEPNEXT_MASK;
+					if (sect == next){				//最終セクタには自分のセクタ番号が書いてある
+						break;
+					}
+					sect = next;
+				}
+			}
+		}
+
 		for (int i=0; i<EEPSECTORS; i++){
-			Sect[i] = (EEP_USED<<8);		//一度、全て使用中にする
+			if (((Sect[i] >> 10) & 0x3) == EEP_CLOSE){
+				Sect[i] = (EEP_USED<<8);		//一度、全て使用中にする
+			}
 		}		
+		Sect[0] = (EEP_USED<<8) | EEPFORMAT_ID;		//セクタサイズの識別値を入れておく
 
 		for (int i=EEPSTASECT; i<=EEPENDSECT; i++){
-			Sect[i] = (EEP_EMPTY<<8);		//FAT使用セクタのみ空き状態にする
+			if (((Sect[i] >> 10) & 0x3) == EEP_CLOSE){
+				Sect[i] = (EEP_EMPTY<<8);		//FAT使用セクタのみ空き状態にする
+			}
+			setIndex(i);
 		}
+		FatDirty[0] = ~0UL;
+		FatDirty[1] = ~0UL;
+		WearDirty = ~0UL;
 		saveFat();
 	}
+
+	//KVSのインデックスを作成します。KVSはファイルシステムを初期化しても消しません
+	kvLoad();
 }
 
 //******************************************************
 // ファイルをオープンします
 // mod: 0:read, 1:write新規, 2:Write追記
+//      write新規のときにEEP_COMPRESSを足すと、圧縮して保存します
+//      write新規で同じ名前のファイルがあるときは、fclose()するまで元のファイルを残しておき、fclose()で置き換えます
+//      Write追記は元のファイルにそのまま書き足します
+//      EEP_RINGを足すとリングログのファイルにします。write新規のときは作り直し、Write追記のときは無ければ作ります
+//      リングログはfputrec()とfgetrec()でレコード単位に読み書きします。Write追記はEEP_RINGを足したときだけできます
+// size: write新規のときに書き込む予定のファイルサイズ
+//       0でなければ連続したセクタを確保します。確保できないときは、いつも通り1セクタずつ確保します
+//       リングログのときは、リングの大きさ(バイト)
 // エラーの時は、-1を返す
 //******************************************************
-int EEPFILE::fopen(FILEEEP *file, const char *filename, char mode)
+int EEPFILE::fopen(FILEEEP *file, const char *filename, char mode, int size)
 {
 	int sect = 0;
 	int len = strlen(filename);
-	unsigned long add = 0;
+	bool zip = (mode & EEP_COMPRESS) != 0;
+	bool ring = (mode & EEP_RING) != 0;
+	mode &= ~(EEP_COMPRESS | EEP_RING);
+
+	file->zip = NULL;
+	file->oldsector = -1;
 
 	//既にオープンしていないどうかのチェック
 	sect = scanFilename(filename);
@@ -159,13 +443,33 @@ int EEPFILE::fopen(FILEEEP *file, const char *filename, char mode)
 			return -1;
 		}
 
+		//圧縮ファイルのときは、復号の状態を用意します
+		if (((Sect[sect] >> 12) & 0x1) == EEP_ZIP){
+			file->zip = (EEPZIP*)malloc(sizeof(EEPZIP));
+			if (file->zip == NULL){
+				return -1;
+			}
+		}
+
 		Sect[sect] |= EEP_READ << 10;			//ファイル使用中フラグ
 
-		add = sect * EEPSECTOR_SIZE;
-		file->filesize = (EEPROM.read( add + len + 1 ) & 0xFF) + ((EEPROM.read( add + len + 2 ) & 0xFF) << 8);
+		file->filesize = Index[sect].size;
 		file->stasector = sect;
-		file->offsetaddress = len + 3;
+		file->offsetaddress = dataOffset(len, ((Sect[sect] >> 13) & 0x1) == EEP_CRC);
 		file->seek = 0;
+		file->cursector = -1;
+		file->bufaddress = -1;
+
+		if (file->zip != NULL){
+			zipRewind(file);
+		}
+
+		//リングログのときは、一番古いレコードから読みます
+		if (ISRING(sect)){
+			file->filesize = Index[sect].size / DF_ERASE_BLOCK_SIZE;
+			file->offsetaddress = DF_ERASE_BLOCK_SIZE;
+			ringOpen(file, false);
+		}
 		return 0;
 	}
 	else if (mode == EEP_WRITE || sect == -1){
@@ -173,18 +477,82 @@ int EEPFILE::fopen(FILEEEP *file, const char *filename, char mode)
 		DEBUG_PRINT("mode", (int)mode);
 		DEBUG_PRINT("sect", sect);
 
-		//ファイルがあるかもしれないので、とりあえず削除しておきます。なかったら-1が返ってくるだけ
-		fdelete(filename);
+		//リングログは作ったときにFATに保存するので、元のファイルもそこで置き換えます
+		if (ring){
+			if (sect != -1){
+				Sect[sect] |= EEP_WRITE << 10;
+				file->oldsector = sect;
+			}
+			return ringCreate(file, filename, size);
+		}
+
+		//圧縮するときは、符号化の状態を用意します
+		if (zip){
+			file->zip = (EEPZIP*)malloc(sizeof(EEPZIP));
+			if (file->zip == NULL){
+				return -1;
+			}
+		}
+
+		//同じ名前のファイルがあるときは、空きセクタに新しいファイルを書き込んで、fclose()で置き換えます
+		//置き換えるまでは元のファイルが残るので、書き込み中に電源が切れても元のファイルは壊れません
+		if (sect != -1){
+			Sect[sect] |= EEP_WRITE << 10;		//置き換えるまで、元のファイルをオープンできないようにする
+			file->oldsector = sect;
+		}
+
+		//ファイルサイズが分かっているときは、連続して空いているセクタを探す
+		int need = 1;
+		sect = -1;
+		if (mode == EEP_WRITE && size > 0){
+			need = (dataOffset(len, true) + size) / EEPSECTOR_SIZE + 1;
+			if (need > 1){
+				sect = scanEmptyRun(need);
+			}
+		}
 
-		//空いているセクタを探す
-		sect = scanEmptySector((int)millis() & 0x3F);	//(int)millis()&0x3Fは、乱数の要素を含ませているセクタの平滑化利用(ウェアレベリングを考慮)
 		if (sect == -1){
-			//ファイルがいっぱいだった
-			return -1;
+			need = 1;
+
+			//空いているセクタを探す
+			sect = scanEmptySector((int)millis() % EEPSECTORS);	//(int)millis()%EEPSECTORSは、消去回数が同じセクタの中から選ぶときの乱数の要素
+			if (sect == -1 && file->oldsector != -1){
+				//空きが無いときは、元のファイルを先に削除します
+				dropOld(file);
+				sect = scanEmptySector((int)millis() % EEPSECTORS);
+			}
+			if (sect == -1){
+				//ファイルがいっぱいだった
+				free(file->zip);
+				file->zip = NULL;
+				return -1;
+			}
 		}
 
 		// ファイルポインタの書き込みを行う
 		setFile( file, filename, sect, EEP_WRITE );
+
+		//確保した連続セクタをつなげておきます。使わなかったセクタはfclose()で返します
+		for (int i = 1; i < need; i++){
+			Sect[sect + i - 1] = (Sect[sect + i - 1] & ~EEPNEXT_MASK) | (sect + i);
+			Sect[sect + i] = (sect + i) | (EEP_USED << 8) | (EEP_WRITE << 10) | (EEP_NEW << 14);
+			FATDIRTY(sect + i);
+		}
+
+		//圧縮ファイルは、元のデータのサイズを入れる2バイトをブランクのまま空けておきます。fclose()で書き込みます
+		if (file->zip != NULL){
+			Sect[sect] |= EEP_ZIP << 12;
+			file->seek = 2;
+			file->filesize = 2;
+
+			file->zip->hist = 0;
+			file->zip->pend = 0;
+			file->zip->iolen = 0;
+			file->zip->flags = 0;
+			file->zip->ntok = 0;
+			file->zip->usize = 0;
+			file->zip->upos = 0;
+		}
 		return 0;
 	}
 	else if (mode == EEP_APPEND){
@@ -192,13 +560,32 @@ int EEPFILE::fopen(FILEEEP *file, const char *filename, char mode)
 		DEBUG_PRINT("mode", (int)mode);
 		DEBUG_PRINT("sect", sect);
 
+		//圧縮ファイルには追記できません
+		if (((Sect[sect] >> 12) & 0x1) == EEP_ZIP){
+			return -1;
+		}
+
+		//リングログにするときは、リングログでないファイルには追記しません
+		//リングログのファイルは、EEP_RINGを足さないと追記できません
+		if (ring != ISRING(sect)){
+			return -1;
+		}
+
 		Sect[sect] |= EEP_WRITE << 10;			//ファイル使用中フラグ
 		
-		add = sect * EEPSECTOR_SIZE;
-		file->filesize = (EEPROM.read( add + len + 1 ) & 0xFF) + ((EEPROM.read( add + len + 2 ) & 0xFF) << 8);
+		file->filesize = Index[sect].size;
 		file->stasector = sect;
-		file->offsetaddress = len + 3;
+		file->offsetaddress = dataOffset(len, ((Sect[sect] >> 13) & 0x1) == EEP_CRC);
 		file->seek = file->filesize;
+		file->cursector = -1;
+		file->bufaddress = -1;
+
+		//リングログのときは、一番新しいレコードの後ろから書き込みます
+		if (ISRING(sect)){
+			file->filesize = Index[sect].size / DF_ERASE_BLOCK_SIZE;
+			file->offsetaddress = DF_ERASE_BLOCK_SIZE;
+			ringOpen(file, true);
+		}
 		return 0;
 	}
 	return -1;
@@ -212,6 +599,23 @@ int EEPFILE::fopen(FILEEEP *file, const char *filename, char mode)
 int EEPFILE::fseek(FILEEEP *file, int offset, int origin)
 {
 	long sk = 0;
+
+	//圧縮ファイルは元のデータの位置でシークします
+	if (file->zip != NULL){
+		return zipSeek(file, offset, origin);
+	}
+
+	//リングログはシークできません。読み込みのときは一番古いレコードに戻ります
+	if (ISRING(file->stasector)){
+		if (((Sect[file->stasector] >> 10) & 0x3) == EEP_READ){
+			ringOpen(file, false);
+		}
+		return 0;
+	}
+
+	//書き込みバッファを書き出しておく
+	bufFlush(file);
+
 	if (origin == EEP_SEEKTOP){
 		sk = 0 + offset;
 	}
@@ -234,6 +638,32 @@ int EEPFILE::fseek(FILEEEP *file, int offset, int origin)
 	return file->seek;
 }
 
+//******************************************************
+// 書き込みでオープンしているファイルを、sizeバイトに切り詰めます
+// 後ろの使わなくなったセクタは、fclose()で空きセクタに戻します
+// 圧縮ファイルとリングログは切り詰められません
+// エラーの時は、-1を返す
+//******************************************************
+int EEPFILE::ftruncate(FILEEEP *file, int size)
+{
+	int sect = file->stasector;
+	if (sect < EEPSTASECT || ((Sect[sect] >> 10) & 0x3) != EEP_WRITE || file->zip != NULL || ISRING(sect)){
+		return -1;
+	}
+	if (size < 0 || size > file->filesize){
+		return -1;
+	}
+
+	//書き込みバッファを書き出しておく
+	bufFlush(file);
+
+	file->filesize = size;
+	if (file->seek > size){
+		file->seek = size;
+	}
+	return size;
+}
+
 //******************************************************
 // ファイルをコピーします。必ず上書きします。
 // エラーの時は、-1を返す
@@ -249,59 +679,208 @@ FILEEEP *fdst = &fdstj;
 		return -1;
 	}
 
-	//ファイルがあるかもしれないので、とりあえず削除しておきます。なかったら-1が返ってくるだけ
-	fdelete(dstfilename);
+	//リングログはコピーできません
+	if (ISRING(fsrc->stasector)){
+		fclose(fsrc);
+		return -1;
+	}
 
-	if(fopen(fdst, dstfilename, EEP_WRITE) == -1){
+	//コピー先のファイルがあるときは、fclose()で置き換えます
+	if(fopen(fdst, dstfilename, EEP_WRITE, fsrc->filesize) == -1){
+		fclose(fsrc);
 		return -1;
 	}
 
-	int dat = fread(fsrc);
+	//圧縮ファイルは圧縮したままコピーするので、復号せずに読み込みます
+	EEPZIP *zip = fsrc->zip;
+	fsrc->zip = NULL;
+	fsrc->seek = 0;
+	Sect[fdst->stasector] |= Sect[fsrc->stasector] & (EEP_ZIP << 12);
 
-	while(dat >= 0){
-		fwrite(fdst, (char)dat);
-		dat = fread(fsrc);
-	}	
+	int ret = copyIn(fdst, eepSource, fsrc);
 
+	fsrc->zip = zip;
 	fclose(fdst);
 	fclose(fsrc);
-	return 0;
+	return ret;
 }
 
 //******************************************************
 // ファイルを削除します
+// オープン中のファイルは削除できません
 // エラーの時は、-1を返す
 //******************************************************
 int EEPFILE::fdelete(const char *filename)
 {
 	int sect = scanFilename(filename);
 
-	if (sect == -1){
+	if (sect == -1 || ((Sect[sect] >> 10) & 0x3) != EEP_CLOSE){
 		return -1;
 	}
 
-	int next;
-	while(true){
-		next = Sect[sect] & 0x7F;		//次のセクタ読み込み
-		Sect[sect] = EEP_EMPTY << 8;	//現セクタを空にする
-		if (sect == next){				//最終セクタには自分のセクタ番号が書いてある
+	freeSect(sect);
+
+	//FATデータをEEPROMに保存する
+	saveFat();
+
+	return 0;
+}
+
+//******************************************************
+// ファイルが連続したセクタに並ぶように、先頭から詰め直します
+// 移動先のセクタを別のファイルが使っているときは、後ろの空きセクタに逃がしてから移動します
+// 移動したセクタ数を返す
+// オープン中のファイルがあるときや、逃がす空きセクタが無いときは、-1を返す
+//******************************************************
+int EEPFILE::fdefrag(void)
+{
+	for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
+		if (((Sect[i] >> 10) & 0x3) != EEP_CLOSE){
+			return -1;
+		}
+	}
+
+	int moved = 0;
+	int pos = EEPSTASECT;		//pos より前には、詰め終わったファイルが並んでいる
+	while (true){
+		//まだ詰めていないファイルの先頭セクタを探す
+		int sect = -1;
+		for (int i = pos; i <= EEPENDSECT; i++){
+			if (((Sect[i] >> 8) & 0x3) == EEP_TOP){
+				sect = i;
+				break;
+			}
+		}
+		if (sect == -1){
 			break;
 		}
-		sect = next;
+
+		while (true){
+			if (sect != pos){
+				if (((Sect[pos] >> 8) & 0x3) != EEP_EMPTY){
+					//移動先のデータを後ろの空きセクタに逃がす
+					int tmp = -1;
+					for (int i = EEPENDSECT; i > pos; i--){
+						if (((Sect[i] >> 8) & 0x3) == EEP_EMPTY){
+							tmp = i;
+							break;
+						}
+					}
+					if (tmp == -1 || moveSector(pos, tmp) == -1){
+						return -1;
+					}
+					saveFat();
+					moved++;
+				}
+
+				if (moveSector(sect, pos) == -1){
+					return -1;
+				}
+				saveFat();
+				moved++;
+			}
+
+			int next = Sect[pos] & EEPNEXT_MASK;
+			if (next == pos){				//最終セクタには自分のセクタ番号が書いてある
+				pos++;
+				break;
+			}
+			sect = next;
+			pos++;
+		}
 	}
+	return moved;
+}
 
-	//FATデータをEEPROMに保存する
-	saveFat();
+//******************************************************
+// 空いている時間に呼び出して、空きセクタかKVSの使っていないバンクのイレースブロックを1つ消去します
+// 消去しておいたブロックは、書き込むときに消去もブランクチェックもしないので、書き込みが速くなります
+// 1回の呼び出しで消去するのは1ブロックまでです。静的ウェアレベリング(セクタの移動)はfclose()とbegin()で行います
+// 消去するかブランクを確かめたときは1を、何もしなかったときは0を返す
+//******************************************************
+int EEPFILE::idle(void)
+{
+	const int blocks = EEPSECTOR_SIZE / DF_ERASE_BLOCK_SIZE;
+
+	for (int n = 0; n < (EEPENDSECT - EEPSTASECT + 1) * blocks; n++){
+		if (IdleBlock < EEPSTASECT * blocks || IdleBlock >= (EEPENDSECT + 1) * blocks){
+			IdleBlock = EEPSTASECT * blocks;
+		}
+		int b = IdleBlock++;
+
+		if (((Sect[b / blocks] >> 8) & 0x3) != EEP_EMPTY || (Erased[b / 8] & (1 << (b & 7))) != 0){
+			continue;
+		}
+
+		//ブランクチェックして、全てブランクでなければ消去します
+		unsigned long addr = (unsigned long)b * DF_ERASE_BLOCK_SIZE;
+		if (blankMask(addr) != 0xFFFF){
+			IdleEraseCount++;
+			eraseBlock(addr);
+		}
+		return 1;
+	}
 
+	//空きセクタを消去し終わったら、KVSの使っていない方のバンクを消去しておきます
+	//詰め直すときに消去しなくて済みます
+	if (KvBank != -1){
+		unsigned long addr = EEPKV_ADDR(1 - KvBank);
+		for (int b = 0; b < EEPKV_BANK / DF_ERASE_BLOCK_SIZE; b++, addr += DF_ERASE_BLOCK_SIZE){
+			if ((Erased[addr / DF_ERASE_BLOCK_SIZE / 8] & (1 << ((addr / DF_ERASE_BLOCK_SIZE) & 7))) == 0){
+				if (blankMask(addr) != 0xFFFF){
+					IdleEraseCount++;
+					eraseBlock(addr);
+				}
+				return 1;
+			}
+		}
+	}
 	return 0;
 }
 
+//******************************************************
+// msecミリ秒待ちます
+// 待っている間に、idle()で空きセクタを消去しておきます
+//******************************************************
+void EEPFILE::wait(unsigned long msec)
+{
+	unsigned long tm = millis() + msec;
+
+	//消去が待ち時間をはみ出さないように、EEPIDLE_MSEC以上残っているときだけidle()を呼びます
+	while ((long)(tm - millis()) > EEPIDLE_MSEC){
+		if (idle() == 0){
+			break;
+		}
+	}
+
+	long rest = (long)(tm - millis());
+	if (rest > 0){
+		delay(rest);
+	}
+}
+
 //******************************************************
 // 書き込み
 // file->seek位置に指定量のデータを書き込みます
+// 圧縮ファイルでなければ、イレースブロック単位でまとめて書き込みます
 //******************************************************
 int EEPFILE::fwrite(FILEEEP *file, char *arry, int *len)
 {
+	//リングログはfputrec()で書き込みます
+	if (ISRING(file->stasector)){
+		*len = 0;
+		return -1;
+	}
+
+	if (file->zip == NULL){
+		int mlen = rawWrite(file, arry, *len);
+		if (mlen < *len){
+			*len = mlen;
+			return -1;
+		}
+		return 1;
+	}
+
 	int mlen = 0;
 	for(int i=0; i<*len; i++){
 		if (fwrite(file, arry[i])==-1){
@@ -314,104 +893,647 @@ int EEPFILE::fwrite(FILEEEP *file, char *arry, int *len)
 }
 
 //******************************************************
-// 書き込み
-// file->seek位置に書き込みます
+// sourceから読み込んだデータでファイルを作ります。必ず上書きします。
+// sourceにはsrcと読み込み先、読み込む最大バイト数が渡されます
+// sourceは読み込んだバイト数を返し、終わりのときは0以下を返します
+// size: 作るファイルのサイズ。分かっていれば連続したセクタを確保します
+// エラーの時は、-1を返す
 //******************************************************
-int EEPFILE::fwrite(FILEEEP *file, char dat)
+int EEPFILE::fimport(const char *filename, EEPSOURCE source, void *src, int size)
 {
-	int secadd = 0;
+FILEEEP fdstj;
+FILEEEP *fdst = &fdstj;
 
-	//書き込むセクタを求めます
-	int sect = getSect(file, &secadd);
-	if (sect == -1){
+	if(fopen(fdst, filename, EEP_WRITE, size) == -1){
 		return -1;
 	}
 
-	//書き込みます
-	int add = sect * EEPSECTOR_SIZE + secadd;
-	epWrite( add, dat );
-
-	//seekを1つ進めます
-	file->seek++;
+	int ret = copyIn(fdst, source, src);
+	fclose(fdst);
+	return ret;
+}
 
-	//seek位置がfileSizeを超えた場合
-	if (file->seek > file->filesize){
-		file->filesize = file->seek;
+//******************************************************
+// 書き込み
+// file->seek位置に書き込みます
+// 圧縮ファイルのときは、符号化して書き込みます
+//******************************************************
+int EEPFILE::fwrite(FILEEEP *file, char dat)
+{
+	if (ISRING(file->stasector)){
+		return -1;
 	}
-	return 1;
+	if (file->zip != NULL){
+		if (((Sect[file->stasector] >> 10) & 0x3) != EEP_WRITE){
+			return -1;
+		}
+		return zipPut(file, dat);
+	}
+	return rawWrite(file, dat);
 }
 
 //******************************************************
 // 読み込み
 // file->seek位置を読み込みます
+// 圧縮ファイルのときは、復号して読み込みます
 //******************************************************
 int EEPFILE::fread(FILEEEP *file)
 {
-	//seek位置がfileSize以上の場合
-	if (file->seek >= file->filesize){
-		file->seek = file->filesize;
+	//リングログはfgetrec()で読み込みます
+	if (ISRING(file->stasector)){
 		return -1;
 	}
+	if (file->zip != NULL){
+		if (file->zip->upos >= file->zip->usize){
+			return -1;
+		}
+		return zipGet(file);
+	}
+	return rawRead(file);
+}
+
+//******************************************************
+// まとめて読み込み
+// file->seek位置から最大lenバイトをbufに読み込みます
+// 読み込んだバイト数を返します。ファイルの終端のときは0を返します
+//******************************************************
+int EEPFILE::fread(FILEEEP *file, char *buf, int len)
+{
+	if (ISRING(file->stasector)){
+		return 0;
+	}
+	if (file->zip != NULL){
+		int cnt = 0;
+		while (cnt < len && file->zip->upos < file->zip->usize){
+			int c = zipGet(file);
+			if (c == -1){
+				break;
+			}
+			buf[cnt++] = c;
+		}
+		return cnt;
+	}
+	return rawRead(file, buf, len);
+}
 
+//*********
+// file->seek位置に1バイト書き込みます
+//*********
+int EEPFILE::rawWrite(FILEEEP *file, char dat)
+{
 	int secadd = 0;
 
-	//読み込むセクタを求めます
+	//書き込むセクタを求めます
 	int sect = getSect(file, &secadd);
-	//if (sect == -1){		//←ありえないので
-	//	return -1;
-	//}
+	if (sect == -1){
+		return -1;
+	}
 
-	//読み込みます
+	//書き込みバッファに書き込みます
 	int add = sect * EEPSECTOR_SIZE + secadd;
-	int ret = EEPROM.read( add );
+	if (bufWrite(file, add, dat) == -1){
+		return -1;
+	}
 
 	//seekを1つ進めます
 	file->seek++;
 
-	return ret;
+	//seek位置がfileSizeを超えた場合
+	if (file->seek > file->filesize){
+		file->filesize = file->seek;
+	}
+	return 1;
 }
 
-//******************************************************
-// ファイルを閉じます
-//******************************************************
-void EEPFILE::fclose(FILEEEP *file)
+//*********
+// file->seek位置にlenバイトを書き込みます
+// イレースブロックの終わりまでをまとめて書き込みバッファに入れます
+// 書き込んだバイト数を返します
+//*********
+int EEPFILE::rawWrite(FILEEEP *file, const char *arry, int len)
 {
-	DEBUG_PRINT("file->stasector", file->stasector);
-	DEBUG_PRINT("file->filesize", file->filesize);
+	int cnt = 0;
+	int secadd = 0;
+	while (cnt < len){
+		//書き込むセクタを求めます
+		int sect = getSect(file, &secadd);
+		if (sect == -1){
+			break;
+		}
+
+		//イレースブロックの終わりまでをまとめて書き込みます
+		int n = DF_ERASE_BLOCK_SIZE - (secadd & (DF_ERASE_BLOCK_SIZE - 1));
+		if (n > len - cnt){
+			n = len - cnt;
+		}
+		if (bufWrite(file, sect * EEPSECTOR_SIZE + secadd, (const unsigned char*)arry + cnt, n) == -1){
+			break;
+		}
+
+		cnt += n;
+		file->seek += n;
+		if (file->seek > file->filesize){
+			file->filesize = file->seek;
+		}
+	}
+	return cnt;
+}
+
+//*********
+// sourceから読み込んだデータをfdstに書き込みます
+// イレースブロックの大きさの作業バッファだけを使い、書き込み位置がイレースブロックの境界に揃うように読み込みます
+// エラーの時は、-1を返す
+//*********
+int EEPFILE::copyIn(FILEEEP *fdst, EEPSOURCE source, void *src)
+{
+	char buf[DF_ERASE_BLOCK_SIZE];
+
+	//最初だけ、次のイレースブロックの境界までを読み込みます
+	int n = DF_ERASE_BLOCK_SIZE - ((fdst->offsetaddress + fdst->seek) & (DF_ERASE_BLOCK_SIZE - 1));
+	int len = source(src, buf, n);
+
+	while(len > 0){
+		if (fwrite(fdst, buf, &len) == -1){
+			return -1;
+		}
+		len = source(src, buf, DF_ERASE_BLOCK_SIZE);
+	}
+	return 0;
+}
+
+//*********
+// file->seek位置の1バイトを読み込みます
+//*********
+int EEPFILE::rawRead(FILEEEP *file)
+{
+	//seek位置がfileSize以上の場合
+	if (file->seek >= file->filesize){
+		file->seek = file->filesize;
+		return -1;
+	}
+
+	int secadd = 0;
+
+	//読み込むセクタを求めます
+	int sect = getSect(file, &secadd);
+	//if (sect == -1){		//←ありえないので
+	//	return -1;
+	//}
+
+	//読み込みます。書き込みバッファにあるときはバッファから読みます
+	int add = sect * EEPSECTOR_SIZE + secadd;
+	int ret;
+	if (file->bufaddress == (add & DF_BLOCK_MASK)){
+		ret = file->buf[add & (DF_ERASE_BLOCK_SIZE - 1)];
+	}
+	else{
+		char c;
+		flashRead( add, &c, 1 );
+		ret = c & 0xFF;
+	}
+
+	//seekを1つ進めます
+	file->seek++;
+
+	return ret;
+}
+
+//*********
+// file->seek位置から最大lenバイトをbufに読み込みます
+// セクタ単位で連続している部分はまとめてコピーします
+// 読み込んだバイト数を返します。ファイルの終端のときは0を返します
+//*********
+int EEPFILE::rawRead(FILEEEP *file, char *buf, int len)
+{
+	//書き込みバッファは書き出しておく
+	bufFlush(file);
+
+	if (file->seek >= file->filesize){
+		file->seek = file->filesize;
+		return 0;
+	}
+	if (len > file->filesize - file->seek){
+		len = file->filesize - file->seek;
+	}
+
+	int cnt = 0;
+	int secadd = 0;
+	while (cnt < len){
+		//読み込むセクタを求めます
+		int sect = getSect(file, &secadd);
+
+		//セクタの終わりまでをまとめて読み込みます
+		int n = EEPSECTOR_SIZE - secadd;
+		if (n > len - cnt){
+			n = len - cnt;
+		}
+		flashRead(sect * EEPSECTOR_SIZE + secadd, buf + cnt, n);
+
+		cnt += n;
+		file->seek += n;
+	}
+	return cnt;
+}
+
+//******************************************************
+// ファイルを閉じます
+//******************************************************
+void EEPFILE::fclose(FILEEEP *file)
+{
+	closeFile(file, true);
+}
+
+//*********
+// ファイルを閉じます
+// stampがfalseのときは、書き込みオープンしたファイルのサイズとCRCを書き直しません
+//*********
+void EEPFILE::closeFile(FILEEEP *file, bool stamp)
+{
+	DEBUG_PRINT("file->stasector", file->stasector);
+	DEBUG_PRINT("file->filesize", file->filesize);
 	DEBUG_PRINT("file->offsetaddress", file->offsetaddress);
 	DEBUG_PRINT("file->seek", file->seek);
 
 	int sect = file->stasector;
 	if (sect < EEPSTASECT){	return;	}
+	bool written = ((Sect[sect] >> 10) & 0x3) == EEP_WRITE;
 
 	DEBUG_PRINT("fclose Sect[sect]", Sect[sect]);
-	if(((Sect[sect] >> 10) & 0x3) == EEP_WRITE){
+	if(stamp && ((Sect[sect] >> 10) & 0x3) == EEP_WRITE && !ISRING(sect)){
 		//ファイルサイズを書き込みます
 		DEBUG_PRINT("fclose", "EEP_WRITE");
 		int add = file->stasector * EEPSECTOR_SIZE;
-		epWrite(add + file->offsetaddress - 1, (file->filesize>>8) & 0xFF);
-		epWrite(add + file->offsetaddress - 2, file->filesize & 0xFF);
+
+		//圧縮ファイルのときは、残りを符号化してから、元のデータのサイズを書き込みます
+		if (file->zip != NULL){
+			zipFlush(file);
+			bufWrite(file, add + file->offsetaddress, file->zip->usize & 0xFF);
+			bufWrite(file, add + file->offsetaddress + 1, (file->zip->usize>>8) & 0xFF);
+		}
+
+		//CRC付きのファイルは、書き込んだデータのCRCをサイズに続けて書き込みます
+		//新しいファイルのサイズとCRCはブランクのまま空けてあるので、消去せずに書き込めます
+		if (((Sect[sect] >> 13) & 0x1) == EEP_CRC){
+			unsigned short crc = dataCrc(file);
+			bufWrite(file, add + file->offsetaddress - 4, file->filesize & 0xFF);
+			bufWrite(file, add + file->offsetaddress - 3, (file->filesize>>8) & 0xFF);
+			bufWrite(file, add + file->offsetaddress - 2, crc & 0xFF);
+			bufWrite(file, add + file->offsetaddress - 1, (crc>>8) & 0xFF);
+		}
+		else{
+			bufWrite(file, add + file->offsetaddress - 2, file->filesize & 0xFF);
+			bufWrite(file, add + file->offsetaddress - 1, (file->filesize>>8) & 0xFF);
+		}
+
+		Index[sect].size = file->filesize;
+
+		//ファイルサイズより後ろのセクタを確保していれば、空きセクタに戻します
+		trimSect(file);
 	}
 
+	//書き込みバッファに残っているデータを書き出します
+	bufFlush(file);
+
 	int next;
 	while(true){
-		Sect[sect] = (Sect[sect] & 0xF3FF) | (EEP_CLOSE << 10);	//セクタにCloseフラグセット
-		next = Sect[sect] & 0x7F;		//次のセクタ読み込み
+		//書き込み中の新しいファイルのセクタは、ここで初めてFATに保存されます
+		if (((Sect[sect] >> 14) & 0x1) == EEP_NEW){
+			FATDIRTY(sect);
+		}
+		Sect[sect] = (Sect[sect] & ~((3 << 10) | (EEP_NEW << 14))) | (EEP_CLOSE << 10);	//セクタにCloseフラグセット
+		next = Sect[sect] & EEPNEXT_MASK;		//次のセクタ読み込み
 		if (sect == next){				//最終セクタには自分のセクタ番号が書いてある
 			break;
 		}
 		sect = next;
 	}
 
+	//元のファイルを削除します。新しいファイルの登録と一緒に1回でFATに保存するので、どちらか片方だけが残ることはありません
+	if (file->oldsector != -1){
+		freeSect(file->oldsector);
+		file->oldsector = -1;
+	}
+
 	//FATデータをEEPROMに保存する
 	saveFat();
 
+	free(file->zip);
+	file->zip = NULL;
+
+	file->filesize = 0;
+	file->offsetaddress = 0;
+	file->seek = 0;
+	file->stasector = -1;
+
+	//書き込んだあとは、消去回数の偏りが大きければ、書き換えられていないセクタを1つ移します
+	//セクタの移動は消去が続くので、残り時間を見て呼ばれるidle()では行いません
+	if (written){
+		wearLevel();
+	}
+}
+
+//******************************************************
+// 書き込み中のファイルを保存せずに閉じます
+// 新しく書いたセクタは空きに戻り、同じ名前の元のファイルはそのまま残ります
+// EEP_APPENDで開いたCRC付きのファイルは、書き込んだデータは残しますが、サイズとCRCは開いたときのままにします
+// 書き換えた箇所があればCRCが合わなくなるので、fverify()で途中までしか書けていないことが分かります
+// どちらでもなければ、fclose()と同じです
+//******************************************************
+void EEPFILE::fabort(FILEEEP *file)
+{
+	int sect = file->stasector;
+	if (sect < EEPSTASECT){	return;	}
+
+	if (((Sect[sect] >> 10) & 0x3) != EEP_WRITE || ISRING(sect)){
+		fclose(file);
+		return;
+	}
+	if (((Sect[sect] >> 14) & 0x1) != EEP_NEW){
+		closeFile(file, ((Sect[sect] >> 13) & 0x1) != EEP_CRC);
+		return;
+	}
+
+	//新しいセクタはFATには空きとして保存されているので、FATは書き直さなくてよい
+	freeSect(sect);
+	if (file->oldsector != -1){
+		Sect[file->oldsector] &= ~(3 << 10);
+		file->oldsector = -1;
+	}
+
+	free(file->zip);
+	file->zip = NULL;
+
+	file->bufaddress = -1;
 	file->filesize = 0;
 	file->offsetaddress = 0;
 	file->seek = 0;
 	file->stasector = -1;
 }
 
+//******************************************************
+// ファイルが連続したセクタに入っているときは、
+// データフラッシュ上のファイルデータの先頭アドレスを返します
+// アドレスはファイルをクローズするまで有効です
+// 連続していないときは、NULLを返す
+//******************************************************
+const char *EEPFILE::fmap(FILEEEP *file)
+{
+	int sect = file->stasector;
+	if (sect < EEPSTASECT || file->zip != NULL || ISRING(sect)){
+		return NULL;
+	}
+
+	int last = (file->offsetaddress + file->filesize - 1) / EEPSECTOR_SIZE;
+	for (int i = 0; i < last; i++){
+		if ((Sect[sect] & EEPNEXT_MASK) != sect + 1){
+			return NULL;
+		}
+		sect++;
+	}
+
+	//書き込みバッファに残っているデータを書き出しておく
+	bufFlush(file);
+
+	return (const char*)(DF_ADDRESS + file->stasector * EEPSECTOR_SIZE + file->offsetaddress);
+}
+
+//******************************************************
+// ファイルのデータがfclose()のときに書き込んだCRCと合っているかを調べます
+// 圧縮ファイルは保存されているデータのまま調べます
+// 1:合っている(CRCの無いファイルも1), 0:合っていない
+//******************************************************
+int EEPFILE::fverify(FILEEEP *file)
+{
+	int sect = file->stasector;
+	if (sect < EEPSTASECT){
+		return 0;
+	}
+	if (((Sect[sect] >> 13) & 0x1) != EEP_CRC){
+		return 1;
+	}
+
+	unsigned char crc[2];
+	flashRead(sect * EEPSECTOR_SIZE + file->offsetaddress - 2, (char*)crc, 2);
+	if (dataCrc(file) != (crc[0] + (crc[1] << 8))){
+		return 0;
+	}
+	return 1;
+}
+
+//******************************************************
+// リングログにレコードを1つ追記します
+// レコードはブランクの箇所に書き込むだけなので、消去はリングのブロックが変わるときだけです
+// 書き込んだバイト数を返す
+// エラーの時は、-1を返す
+//******************************************************
+int EEPFILE::fputrec(FILEEEP *file, const char *data, int len)
+{
+	int sect = file->stasector;
+	if (!ISRING(sect) || ((Sect[sect] >> 10) & 0x3) != EEP_WRITE){
+		return -1;
+	}
+	if (len <= 0 || len > EEPRING_RECSIZE){
+		return -1;
+	}
+
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	unsigned short mask = 0;
+	int size = (2 + len + 1) & ~1;		//2バイト境界に揃えます
+
+	//ブロックに入りきらないときは、次のブロックを消去して通番を書き込みます
+	//リングが一周していれば、一番古いブロックのレコードが消えます
+	if (file->seek + size > DF_ERASE_BLOCK_SIZE){
+		file->ringblock = (file->ringblock + 1) % file->filesize;
+		file->ringseq++;
+		unsigned long add = ringAddr(file, file->ringblock);
+		if (blankMask(add) != 0xFFFF && eraseBlock(add) == -1){
+			return -1;
+		}
+		buf[0] = file->ringseq & 0xFF;
+		buf[1] = (file->ringseq >> 8) & 0xFF;
+		mask |= 1;
+		file->seek = 2;
+	}
+
+	unsigned char *p = &buf[file->seek];
+	p[0] = len;
+	p[1] = crc16(crc16(0xFFFF, p, 1), (const unsigned char*)data, len) & 0xFF;
+	memcpy(&p[2], data, len);
+	if ((len & 1) != 0){
+		p[size - 1] = 0xFF;
+	}
+	for (int i = file->seek / DF_ALIGN + 1; i < (file->seek + size) / DF_ALIGN; i++){
+		mask |= 1 << i;
+	}
+
+	//データを書き込んでから、最後にレコードの先頭(長さとCRC)を書き込みます
+	//途中で電源が切れたレコードは先頭がブランクのままなので、読み込まれません
+	unsigned long add = ringAddr(file, file->ringblock);
+	unsigned short head = 1 << (file->seek / DF_ALIGN);
+	if (unitWrite(add, buf, mask) == -1 || unitWrite(add, buf, head) == -1){
+		return -1;
+	}
+	file->seek += size;
+	return len;
+}
+
+//******************************************************
+// リングログから一番古いレコードから順に1つ読み込みます
+// bufにはEEPRING_RECSIZEバイトまで入ります
+// 読み込んだバイト数を返す。最後まで読んだときは-1を返す
+//******************************************************
+int EEPFILE::fgetrec(FILEEEP *file, char *buf, int size)
+{
+	if (!ISRING(file->stasector)){
+		return -1;
+	}
+
+	char rec[EEPRING_RECSIZE];
+	while (true){
+		int len = 0;
+		if (file->seek + 2 <= DF_ERASE_BLOCK_SIZE){
+			len = ringRecord(ringAddr(file, file->ringblock), file->seek, rec);
+		}
+
+		if (len > 0){
+			file->seek += (2 + len + 1) & ~1;
+			if (len > size){
+				len = size;
+			}
+			memcpy(buf, rec, len);
+			return len;
+		}
+
+		//ブロックの終わりか、書き込み途中で電源が切れたレコードのときは、次のブロックに進みます
+		//次のブロックの通番が続いていなければ、一番新しいブロックまで読んだので終わりです
+		int next = (file->ringblock + 1) % file->filesize;
+		int seq = ringSeq(file, next);
+		if (seq == -1 || seq != ((file->ringseq + 1) & 0xFFFF)){
+			file->seek = DF_ERASE_BLOCK_SIZE;
+			return -1;
+		}
+		file->ringblock = next;
+		file->ringseq = seq;
+		file->seek = 2;
+	}
+}
+
+//******************************************************
+// KVSにキーと値を保存します
+// key: klenバイトのキー(EEPKV_KEYSIZEバイトまで)。先頭が0x00のキーはPush Popに使うので使えません
+// val: vlenバイトの値(EEPKV_VALSIZEバイトまで)
+// 同じキーに同じ値が入っているときは、書き込みません
+// エラーの時は、-1を返す
+//******************************************************
+int EEPFILE::kvSet(const char *key, int klen, const char *val, int vlen)
+{
+	if (klen <= 0 || klen > EEPKV_KEYSIZE || key[0] == 0 || vlen < 0 || vlen > EEPKV_VALSIZE){
+		return -1;
+	}
+	return kvPut(key, klen, val, vlen);
+}
+
+//******************************************************
+// KVSからキーの値を読み込みます
+// bufにはsizeバイトまで入ります
+// 値のバイト数を返す。キーが無いときは-1を返す
+//******************************************************
+int EEPFILE::kvGet(const char *key, int klen, char *buf, int size)
+{
+	if (klen <= 0 || klen > EEPKV_KEYSIZE){
+		return -1;
+	}
+
+	int i = kvFind(key, klen);
+	if (i == -1){
+		return -1;
+	}
+
+	unsigned char hd[EEPKV_RECHEAD];
+	flashRead(KvIndex[i].addr, (char*)hd, EEPKV_RECHEAD);
+	int vlen = hd[2] + (hd[3] << 8);
+	flashRead(KvIndex[i].addr + EEPKV_RECHEAD + ((hd[0] + 1) & ~1), buf, vlen < size ? vlen : size);
+	return vlen;
+}
+
+//******************************************************
+// KVSからキーを削除します
+// エラーの時は、-1を返す
+//******************************************************
+int EEPFILE::kvDelete(const char *key, int klen)
+{
+	if (klen <= 0 || klen > EEPKV_KEYSIZE || key[0] == 0){
+		return -1;
+	}
+	return kvPut(key, klen, NULL, EEPKV_DELETE);
+}
+
+//******************************************************
+// Push Popの領域(0x00～0xFF)のaddressからlenバイトを書き込みます
+// EEPKV_PUSHSEGバイトずつ先頭が0x00のキーでKVSに保存するので、書き換えたところだけを追記します
+// エラーの時は、-1を返す
+//******************************************************
+int EEPFILE::kvPush(int address, const char *data, int len)
+{
+	if (address < 0 || address + len > EEPPUSH_SIZE){
+		return -1;
+	}
+
+	char buf[EEPKV_PUSHSEG];
+	while (len > 0){
+		char key[2] = { 0, (char)(address / EEPKV_PUSHSEG) };
+		int pos = address % EEPKV_PUSHSEG;
+		int n = EEPKV_PUSHSEG - pos;
+		if (n > len){
+			n = len;
+		}
+
+		//まだ書き込んでいないところは0xFFとします
+		if (kvGet(key, 2, buf, EEPKV_PUSHSEG) == -1){
+			memset(buf, 0xFF, EEPKV_PUSHSEG);
+		}
+		memcpy(&buf[pos], data, n);
+		if (kvPut(key, 2, buf, EEPKV_PUSHSEG) == -1){
+			return -1;
+		}
+		address += n;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+//******************************************************
+// Push Popの領域(0x00～0xFF)のaddressからlenバイトを読み込みます
+// 書き込んでいないところは0xFFです
+// エラーの時は、-1を返す
+//******************************************************
+int EEPFILE::kvPop(int address, char *buf, int len)
+{
+	if (address < 0 || address + len > EEPPUSH_SIZE){
+		return -1;
+	}
+
+	char seg[EEPKV_PUSHSEG];
+	while (len > 0){
+		char key[2] = { 0, (char)(address / EEPKV_PUSHSEG) };
+		int pos = address % EEPKV_PUSHSEG;
+		int n = EEPKV_PUSHSEG - pos;
+		if (n > len){
+			n = len;
+		}
+
+		if (kvGet(key, 2, seg, EEPKV_PUSHSEG) == -1){
+			memset(seg, 0xFF, EEPKV_PUSHSEG);
+		}
+		memcpy(buf, &seg[pos], n);
+		address += n;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
 //******************************************************
 // ファイルの存在を調べます
 // 0:無し, 1:在り
@@ -427,11 +1549,24 @@ int EEPFILE::fexist(const char *filename)
 	return 1;
 }
 
+//******************************************************
+// ヘッダにCRCがあるファイルならtrueを返します
+// CRCの無いファイル(CRCが無かった頃に書いたファイル)は、fverify()がいつも1を返します
+//******************************************************
+bool EEPFILE::fCrc(FILEEEP *file)
+{
+	int sect = file->stasector;
+	return (sect >= EEPSTASECT && ((Sect[sect] >> 13) & 0x1) == EEP_CRC)?true:false;
+}
+
 //******************************************************
 // ファイルの終端したらtrueを返します
 //******************************************************
 bool EEPFILE::fEof(FILEEEP *file)
 {
+	if (file->zip != NULL){
+		return (file->zip->upos >= file->zip->usize)?true:false;
+	}
 	return (file->seek >= file->filesize)?true:false;
 }
 
@@ -443,179 +1578,1608 @@ bool EEPFILE::fEof(FILEEEP *file)
 int EEPFILE::fdir(int sect, char *filename)
 {
 	int ret = 0;
-	//ファイル先頭セクタか
-	if(((Sect[sect] >> 8) & 0x3) == EEP_TOP){
+	//ファイル先頭セクタか。書き込み中の置き換え用のファイルは含めません
+	if(((Sect[sect] >> 8) & 0x3) == EEP_TOP && ((Sect[sect] >> 14) & 0x1) != EEP_NEW){
 		getFilename(sect, filename);
-		ret = ffilesize( filename );
+		ret = fileSize(sect);
 	}
 	else{
 		filename[0] = 0;
 	}
-	return ret;
+	return ret;
+}
+
+//******************************************************
+// ファイルサイズを返します
+// 圧縮ファイルのときは、元のデータのサイズを返します
+//******************************************************
+int EEPFILE::ffilesize(const char *filename)
+{
+	int ret = 0;
+	int sect = scanFilename(filename);
+
+	if (sect != -1){
+		ret = fileSize(sect);
+	}
+	return ret;
+}
+
+
+//***
+//  Private methods
+//***
+
+//*********
+// 先頭セクタのファイルのサイズを返します
+// 圧縮ファイルのときは、圧縮データの先頭に入っている元のデータのサイズを返します
+//*********
+int EEPFILE::fileSize(int sect)
+{
+	if (((Sect[sect] >> 12) & 0x1) != EEP_ZIP){
+		return Index[sect].size;
+	}
+
+	unsigned char sz[2];
+	flashRead(sect * EEPSECTOR_SIZE + dataOffset(Index[sect].len, ((Sect[sect] >> 13) & 0x1) == EEP_CRC), (char*)sz, 2);
+	return sz[0] + (sz[1] << 8);
+}
+
+//*********
+// ファイルのデータ(圧縮ファイルは保存されているデータ)全体のCRCを求めます
+// seek位置は元に戻します
+//*********
+unsigned short EEPFILE::dataCrc(FILEEEP *file)
+{
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	unsigned short seek = file->seek;
+	unsigned short crc = 0xFFFF;
+	int n;
+
+	file->seek = 0;
+	while ((n = rawRead(file, (char*)buf, DF_ERASE_BLOCK_SIZE)) > 0){
+		crc = crc16(crc, buf, n);
+	}
+	file->seek = seek;
+	return crc;
+}
+
+//*********
+// リングログのファイルを作ります。sizeはリングの大きさ(バイト)
+// 作ったときにFATに保存するので、fclose()しなくてもレコードは残ります
+// 置き換える元のファイルがあれば、file->oldsectorに入れておくこと
+// エラーの時は、-1を返す
+//*********
+int EEPFILE::ringCreate(FILEEEP *file, const char *filename, int size)
+{
+	const int blocks = EEPSECTOR_SIZE / DF_ERASE_BLOCK_SIZE;
+
+	//ファイル名の1ブロックと、リングの2ブロック以上が入るセクタ数にします
+	int nb = (size + DF_ERASE_BLOCK_SIZE - 1) / DF_ERASE_BLOCK_SIZE;
+	if (nb < 2){
+		nb = 2;
+	}
+	int need = (nb + 1 + blocks - 1) / blocks;
+
+	int run = (need > 1) ? scanEmptyRun(need) : -1;
+	int top = -1;
+	int last = -1;
+	for (int i = 0; i < need; i++){
+		int sect;
+		if (run != -1){
+			sect = run + i;
+		}
+		else{
+			sect = scanEmptySector((int)millis() % EEPSECTORS);	//(int)millis()%EEPSECTORSは、消去回数が同じセクタの中から選ぶときの乱数の要素
+			if (sect == -1 && file->oldsector != -1){
+				//空きが無いときは、元のファイルを先に削除します
+				dropOld(file);
+				sect = scanEmptySector((int)millis() % EEPSECTORS);
+			}
+		}
+
+		if (sect == -1){
+			//ファイルがいっぱいだった
+			if (top != -1){
+				freeSect(top);
+			}
+			if (file->oldsector != -1){
+				Sect[file->oldsector] &= ~(3 << 10);
+				file->oldsector = -1;
+			}
+			file->stasector = -1;
+			return -1;
+		}
+
+		if (top == -1){
+			setFile( file, filename, sect, EEP_WRITE );
+			top = sect;
+		}
+		else{
+			Sect[last] = (Sect[last] & ~EEPNEXT_MASK) | sect;
+			Sect[sect] = sect | (EEP_USED << 8) | (EEP_WRITE << 10) | (EEP_NEW << 14);
+			FATDIRTY(last);
+			FATDIRTY(sect);
+		}
+		last = sect;
+	}
+	Sect[top] = (Sect[top] & ~(EEP_CRC << 13)) | (EEP_LOG << 15);
+
+	//ファイル名を書き込みます
+	bufFlush(file);
+
+	//リングのブロックに前のデータが残っていると通番を読み違えるので、全て消去しておきます
+	nb = need * blocks - 1;
+	file->filesize = nb;
+	file->offsetaddress = DF_ERASE_BLOCK_SIZE;
+	for (int b = 0; b < nb; b++){
+		unsigned long add = ringAddr(file, b);
+		if (blankMask(add) != 0xFFFF && eraseBlock(add) == -1){
+			return -1;
+		}
+	}
+
+	//元のファイルの削除と一緒に、FATに保存します
+	int sect = top;
+	while (true){
+		Sect[sect] &= ~(EEP_NEW << 14);
+		FATDIRTY(sect);
+		if ((Sect[sect] & EEPNEXT_MASK) == sect){
+			break;
+		}
+		sect = Sect[sect] & EEPNEXT_MASK;
+	}
+	if (file->oldsector != -1){
+		freeSect(file->oldsector);
+		file->oldsector = -1;
+	}
+	saveFat();
+
+	Index[top].size = nb * DF_ERASE_BLOCK_SIZE;
+
+	//空のリングは、最後のブロックが一杯になっているところから始めます
+	file->ringblock = nb - 1;
+	file->ringseq = 0xFFFF;
+	file->seek = DF_ERASE_BLOCK_SIZE;
+	return 0;
+}
+
+//*********
+// リングログの通番を調べて、読み書きする位置を決めます
+// 通番が1つずつ増えている並びの最後のブロックが一番新しいブロックです
+// append: trueのときは一番新しいレコードの後ろ、falseのときは一番古いレコード
+//*********
+void EEPFILE::ringOpen(FILEEEP *file, bool append)
+{
+	int nb = file->filesize;
+
+	//通番が続いていないブロックから一周して、通番が続いている一番長い並びを探します
+	//消去の途中で電源が切れたブロックは、通番が続かないので並びから外れます
+	int start = -1;
+	for (int b = 0; b < nb; b++){
+		int seq = ringSeq(file, b);
+		if (seq != -1 && ringSeq(file, (b + nb - 1) % nb) != ((seq - 1) & 0xFFFF)){
+			start = b;
+			break;
+		}
+	}
+
+	int head = -1;
+	int best = 0;
+	int run = 0;
+	int prev = -1;
+	for (int i = 0; start != -1 && i < nb; i++){
+		int b = (start + i) % nb;
+		int seq = ringSeq(file, b);
+		if (seq == -1){
+			run = 0;
+		}
+		else if (run > 0 && seq == ((prev + 1) & 0xFFFF)){
+			run++;
+		}
+		else{
+			run = 1;
+		}
+		if (run > best){
+			best = run;
+			head = b;
+		}
+		prev = seq;
+	}
+
+	if (head == -1){
+		//空のリング
+		file->ringblock = nb - 1;
+		file->ringseq = 0xFFFF;
+		file->seek = DF_ERASE_BLOCK_SIZE;
+		return;
+	}
+
+	int seq = ringSeq(file, head);
+	if (append){
+		//一番新しいブロックのレコードの後ろを探します
+		//書き込み途中で電源が切れたレコードがあれば、そのブロックにはもう書きません
+		unsigned long add = ringAddr(file, head);
+		char rec[EEPRING_RECSIZE];
+		int pos = 2;
+		while (pos + 2 <= DF_ERASE_BLOCK_SIZE){
+			int len = ringRecord(add, pos, rec);
+			if (len == 0){
+				//レコードの先頭がブランクでも、データだけ書き込まれていることがあるので、後ろが全てブランクか確かめます
+				if ((unsigned short)(blankMask(add) | ((1 << (pos / DF_ALIGN)) - 1)) != 0xFFFF){
+					pos = DF_ERASE_BLOCK_SIZE;
+				}
+				break;
+			}
+			if (len == -1){
+				pos = DF_ERASE_BLOCK_SIZE;
+				break;
+			}
+			pos += (2 + len + 1) & ~1;
+		}
+		file->ringblock = head;
+		file->ringseq = seq;
+		file->seek = pos;
+		return;
+	}
+
+	//通番が続いているところまで遡って、一番古いブロックを探します
+	int b = head;
+	for (int i = 1; i < nb; i++){
+		int p = (b + nb - 1) % nb;
+		int ps = ringSeq(file, p);
+		if (ps == -1 || ps != ((seq - 1) & 0xFFFF)){
+			break;
+		}
+		b = p;
+		seq = ps;
+	}
+	file->ringblock = b;
+	file->ringseq = seq;
+	file->seek = 2;
+}
+
+//*********
+// リングログのblk番目のブロックのアドレスを返します
+// 先頭セクタの最初のブロックはファイル名なので、その次からを数えます
+//*********
+unsigned long EEPFILE::ringAddr(FILEEEP *file, int blk)
+{
+	const int blocks = EEPSECTOR_SIZE / DF_ERASE_BLOCK_SIZE;
+	int n = blk + 1;
+	int sect = file->stasector;
+	for (int i = 0; i < n / blocks; i++){
+		sect = Sect[sect] & EEPNEXT_MASK;
+	}
+	return (unsigned long)sect * EEPSECTOR_SIZE + (n % blocks) * DF_ERASE_BLOCK_SIZE;
+}
+
+//*********
+// リングログのblk番目のブロックの通番を返します
+// 通番が書き込まれていないときは、-1を返す
+//*********
+int EEPFILE::ringSeq(FILEEEP *file, int blk)
+{
+	unsigned long add = ringAddr(file, blk);
+	if (unitBlank(add)){
+		return -1;
+	}
+	const unsigned char *sq = (const unsigned char *)(DF_ADDRESS + add);
+	return sq[0] + (sq[1] << 8);
+}
+
+//*********
+// リングログのブロックaddrのpos位置のレコードをbufに読み込みます
+// レコードの長さを返す。ブランクのときは0、長さかCRCが合わないときは-1を返す
+//*********
+int EEPFILE::ringRecord(unsigned long addr, int pos, char *buf)
+{
+	if (unitBlank(addr + pos)){
+		return 0;
+	}
+
+	unsigned char hd[2];
+	flashRead(addr + pos, (char*)hd, 2);
+	int len = hd[0];
+	if (len == 0 || len > EEPRING_RECSIZE || pos + 2 + len > DF_ERASE_BLOCK_SIZE){
+		return -1;
+	}
+
+	flashRead(addr + pos + 2, buf, len);
+	if ((crc16(crc16(0xFFFF, hd, 1), (const unsigned char*)buf, len) & 0xFF) != hd[1]){
+		return -1;
+	}
+	return len;
+}
+
+//*********
+// addrの書き込み単位(DF_ALIGNバイト)がブランクかどうかを返します
+//*********
+bool EEPFILE::unitBlank(unsigned long addr)
+{
+	unsigned long blk = addr & DF_BLOCK_MASK;
+	unsigned char bit = 1 << ((blk / DF_ERASE_BLOCK_SIZE) & 7);
+
+	if ((Programmed[blk / DF_ERASE_BLOCK_SIZE / 8] & bit) != 0){
+		return false;
+	}
+	if ((Erased[blk / DF_ERASE_BLOCK_SIZE / 8] & bit) != 0){
+		return true;
+	}
+	return flash_datarom_blankcheck(DF_ADDRESS + (addr & ~(DF_ALIGN - 1))) == 0;
+}
+
+//*********
+// KVSのバンクを調べて、新しい方のバンクのインデックスを作成します
+// 使えるバンクが無いときは、KVSを初期化します
+//*********
+void EEPFILE::kvLoad(void)
+{
+	//識別値と通番が合っているバンクの中で、通番が新しい方を使います
+	unsigned short seq[2];
+	KvBank = -1;
+	for (int n = 0; n < 2; n++){
+		if (kvCheck(n, &seq[n]) == 1 && (KvBank == -1 || (short)(seq[n] - seq[KvBank]) > 0)){
+			KvBank = n;
+		}
+	}
+
+	if (KvBank == -1){
+		kvFormat();
+		return;
+	}
+	KvSeq = seq[KvBank];
+	kvScan();
+}
+
+//*********
+// KVSを初期化して、Push Popの領域(0x00～0xFF)のデータを移します
+// バンク0を消去してPush Popのデータを書き込み、最後に識別値と通番を書き込みます
+//*********
+void EEPFILE::kvFormat(void)
+{
+	KvCount = 0;
+	KvTorn = false;
+	KvEnd = EEPKV_HEAD;
+	if (kvErase(0) == -1){
+		return;
+	}
+	KvBank = 0;
+	KvSeq = 0;
+
+	//Push Popの領域に書き込まれているデータを、KVSに移します
+	char buf[EEPKV_PUSHSEG];
+	bool moved = false;
+	for (int seg = 0; seg < EEPPUSH_SIZE / EEPKV_PUSHSEG; seg++){
+		flashRead(seg * EEPKV_PUSHSEG, buf, EEPKV_PUSHSEG);
+		for (int i = 0; i < EEPKV_PUSHSEG; i++){
+			if (buf[i] != (char)0xFF){
+				char key[2] = { 0, (char)seg };
+				kvPut(key, 2, buf, EEPKV_PUSHSEG);
+				moved = true;
+				break;
+			}
+		}
+	}
+
+	if (kvHead(0, 0) == -1){
+		KvBank = -1;
+		return;
+	}
+
+	//移し終わったら、Push Popの領域は消去しておきます
+	if (moved){
+		for (unsigned long add = 0; add < EEPPUSH_SIZE; add += DF_ERASE_BLOCK_SIZE){
+			if (blankMask(add) != 0xFFFF){
+				eraseBlock(add);
+			}
+		}
+	}
+}
+
+//*********
+// バンクnの先頭の識別値と通番を調べます
+// 通番をseqに入れて1を返す。使えないときは0を返す
+//*********
+int EEPFILE::kvCheck(int n, unsigned short *seq)
+{
+	unsigned long add = EEPKV_ADDR(n);
+	for (int i = 0; i < EEPKV_HEAD; i += DF_ALIGN){
+		if (unitBlank(add + i)){
+			return 0;
+		}
+	}
+
+	unsigned char hd[EEPKV_HEAD];
+	flashRead(add, (char*)hd, EEPKV_HEAD);
+	*seq = hd[2] + (hd[3] << 8);
+	if (hd[0] != 'K' || hd[1] != 'V' || (unsigned short)~*seq != hd[4] + (hd[5] << 8)){
+		return 0;
+	}
+	return 1;
+}
+
+//*********
+// 使っているバンクのレコードを先頭から読んで、キーごとの最新のレコードをインデックスに入れます
+// 末尾に書き込み途中で電源が切れたレコードが残っていれば、KvTornを立てます
+//*********
+void EEPFILE::kvScan(void)
+{
+	unsigned long bank = EEPKV_ADDR(KvBank);
+	int pos = EEPKV_HEAD;
+
+	KvCount = 0;
+	KvTorn = false;
+	while (pos + EEPKV_RECHEAD <= EEPKV_BANK && !unitBlank(bank + pos)){
+		int size = kvRecSize(bank + pos, true);
+		if (size == -1){
+			KvTorn = true;
+			break;
+		}
+
+		unsigned char hd[EEPKV_RECHEAD];
+		char key[EEPKV_KEYSIZE];
+		flashRead(bank + pos, (char*)hd, EEPKV_RECHEAD);
+		flashRead(bank + pos + EEPKV_RECHEAD, key, hd[0]);
+		int i = kvFind(key, hd[0]);
+		if (hd[2] + (hd[3] << 8) == EEPKV_DELETE){
+			if (i != -1){
+				KvIndex[i] = KvIndex[--KvCount];
+			}
+		}
+		else{
+			if (i == -1 && KvCount < EEPKV_KEYS){
+				i = KvCount++;
+				KvIndex[i].hash = nameHash(key, hd[0]);
+			}
+			if (i != -1){
+				KvIndex[i].addr = bank + pos;
+			}
+		}
+		pos += size;
+	}
+	KvEnd = pos;
+
+	//最後のレコードから後ろが全てブランクでなければ、データだけ書き込まれたレコードが残っています
+	for (int p = pos; p < EEPKV_BANK && !KvTorn; p = (p & DF_BLOCK_MASK) + DF_ERASE_BLOCK_SIZE){
+		unsigned short need = 0xFFFF << ((p % DF_ERASE_BLOCK_SIZE) / DF_ALIGN);
+		if ((blankMask(bank + p) & need) != need){
+			KvTorn = true;
+		}
+	}
+}
+
+//*********
+// キーのインデックスの番号を返します
+// キーが無いときは、-1を返す
+//*********
+int EEPFILE::kvFind(const char *key, int klen)
+{
+	unsigned short hash = nameHash(key, klen);
+	char buf[EEPKV_KEYSIZE];
+
+	for (int i = 0; i < KvCount; i++){
+		if (KvIndex[i].hash != hash){
+			continue;
+		}
+		//ハッシュ値が同じときは、レコードのキーと比べます
+		unsigned char hd[EEPKV_RECHEAD];
+		flashRead(KvIndex[i].addr, (char*)hd, EEPKV_RECHEAD);
+		if (hd[0] == klen){
+			flashRead(KvIndex[i].addr + EEPKV_RECHEAD, buf, klen);
+			if (memcmp(buf, key, klen) == 0){
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+//*********
+// KVSにキーと値のレコードを追記して、インデックスを更新します
+// vlenがEEPKV_DELETEのときはキーを削除します
+// 追記する場所が無いときや、書き込み途中のレコードが残っているときは、もう一方のバンクに詰め直します
+// エラーのときは-1を返す
+//*********
+int EEPFILE::kvPut(const char *key, int klen, const char *val, int vlen)
+{
+	if (KvBank == -1){
+		return -1;
+	}
+
+	int i = kvFind(key, klen);
+	if (i == -1){
+		if (vlen == EEPKV_DELETE){
+			return 1;
+		}
+		if (KvCount >= EEPKV_KEYS){
+			return -1;
+		}
+	}
+	else if (vlen != EEPKV_DELETE && kvSame(KvIndex[i].addr, val, vlen)){
+		//同じ値が入っているときは書き込みません
+		return 1;
+	}
+
+	unsigned char hd[EEPKV_RECHEAD];
+	hd[0] = klen;
+	hd[1] = ~klen;
+	hd[2] = vlen & 0xFF;
+	hd[3] = (vlen >> 8) & 0xFF;
+	unsigned short crc = crc16(crc16(0xFFFF, hd, 4), (const unsigned char*)key, klen);
+	if (vlen != EEPKV_DELETE){
+		crc = crc16(crc, (const unsigned char*)val, vlen);
+	}
+	hd[4] = crc & 0xFF;
+	hd[5] = (crc >> 8) & 0xFF;
+
+	int size = EEPKV_RECHEAD + ((klen + 1) & ~1) + (vlen == EEPKV_DELETE ? 0 : (vlen + 1) & ~1);
+	if (KvTorn || KvEnd + size > EEPKV_BANK){
+		return kvCompact(i, hd, key, val);
+	}
+
+	unsigned long add = EEPKV_ADDR(KvBank) + KvEnd;
+	if (kvRecord(add, hd, key, val) == -1){
+		//途中まで書き込んだかもしれないので、次の書き込みで詰め直します
+		KvTorn = true;
+		return -1;
+	}
+	KvEnd += size;
+
+	if (vlen == EEPKV_DELETE){
+		KvIndex[i] = KvIndex[--KvCount];
+	}
+	else{
+		if (i == -1){
+			i = KvCount++;
+			KvIndex[i].hash = nameHash(key, klen);
+		}
+		KvIndex[i].addr = add;
+	}
+	return 1;
+}
+
+//*********
+// skip番目のキーを除いた最新のレコードと、新しいレコードをもう一方のバンクに詰め直します
+// 最後に識別値と通番を書き込むので、途中で電源が切れたときは元のバンクのままです
+// 入りきらないときやエラーのときは-1を返す
+//*********
+int EEPFILE::kvCompact(int skip, const unsigned char *hd, const char *key, const char *val)
+{
+	int vlen = hd[2] + (hd[3] << 8);
+	int need = EEPKV_HEAD;
+	if (vlen != EEPKV_DELETE){
+		need += EEPKV_RECHEAD + ((hd[0] + 1) & ~1) + ((vlen + 1) & ~1);
+	}
+	for (int i = 0; i < KvCount; i++){
+		if (i != skip){
+			need += kvRecSize(KvIndex[i].addr, false);
+		}
+	}
+	if (need > EEPKV_BANK){
+		return -1;
+	}
+
+	int n = 1 - KvBank;
+	unsigned long add = EEPKV_ADDR(n) + EEPKV_HEAD;
+	if (kvErase(n) == -1){
+		return -1;
+	}
+
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	for (int i = 0; i < KvCount; i++){
+		if (i == skip){
+			continue;
+		}
+		int size = kvRecSize(KvIndex[i].addr, false);
+		for (int p = 0; p < size; p += DF_ERASE_BLOCK_SIZE){
+			int len = (size - p < DF_ERASE_BLOCK_SIZE) ? size - p : DF_ERASE_BLOCK_SIZE;
+			flashRead(KvIndex[i].addr + p, (char*)buf, len);
+			if (kvProgram(add + p, buf, len) == -1){
+				return -1;
+			}
+		}
+		add += size;
+	}
+	if (vlen != EEPKV_DELETE && kvRecord(add, hd, key, val) == -1){
+		return -1;
+	}
+
+	if (kvHead(n, KvSeq + 1) == -1){
+		return -1;
+	}
+	KvBank = n;
+	KvSeq++;
+	kvScan();
+	return 1;
+}
+
+//*********
+// addrのレコードのバイト数を返します
+// checkがtrueのときは、レコードの先頭とCRCを調べて、合わないときは-1を返す
+//*********
+int EEPFILE::kvRecSize(unsigned long addr, bool check)
+{
+	unsigned char hd[EEPKV_RECHEAD];
+	flashRead(addr, (char*)hd, EEPKV_RECHEAD);
+	int klen = hd[0];
+	int vlen = hd[2] + (hd[3] << 8);
+	int size = EEPKV_RECHEAD + ((klen + 1) & ~1) + (vlen == EEPKV_DELETE ? 0 : (vlen + 1) & ~1);
+	if (!check){
+		return size;
+	}
+
+	if (klen == 0 || klen > EEPKV_KEYSIZE || hd[1] != (unsigned char)~klen
+		|| (vlen > EEPKV_VALSIZE && vlen != EEPKV_DELETE)
+		|| (addr - EEPKV_START) % EEPKV_BANK + size > EEPKV_BANK){
+		return -1;
+	}
+
+	//キーと値のCRCを調べます。キーの後ろの埋め草は除きます
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	unsigned short crc = crc16(0xFFFF, hd, 4);
+	unsigned long add = addr + EEPKV_RECHEAD;
+	int len = klen;
+	for (int part = 0; part < 2; part++){
+		while (len > 0){
+			int n = (len < DF_ERASE_BLOCK_SIZE) ? len : DF_ERASE_BLOCK_SIZE;
+			flashRead(add, (char*)buf, n);
+			crc = crc16(crc, buf, n);
+			add += n;
+			len -= n;
+		}
+		add = addr + EEPKV_RECHEAD + ((klen + 1) & ~1);
+		len = (vlen == EEPKV_DELETE) ? 0 : vlen;
+	}
+	if (crc != hd[4] + (hd[5] << 8)){
+		return -1;
+	}
+	return size;
+}
+
+//*********
+// addrのレコードの値が、vlenバイトのvalと同じかどうかを返します
+//*********
+bool EEPFILE::kvSame(unsigned long addr, const char *val, int vlen)
+{
+	unsigned char hd[EEPKV_RECHEAD];
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	flashRead(addr, (char*)hd, EEPKV_RECHEAD);
+	if (hd[2] + (hd[3] << 8) != vlen){
+		return false;
+	}
+
+	unsigned long add = addr + EEPKV_RECHEAD + ((hd[0] + 1) & ~1);
+	for (int p = 0; p < vlen; p += DF_ERASE_BLOCK_SIZE){
+		int n = (vlen - p < DF_ERASE_BLOCK_SIZE) ? vlen - p : DF_ERASE_BLOCK_SIZE;
+		flashRead(add + p, (char*)buf, n);
+		if (memcmp(buf, val + p, n) != 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+//*********
+// ブランクのaddrにレコードを書き込みます
+// キーと値を書き込んでから、最後にレコードの先頭を後ろから書き込みます
+// 途中で電源が切れたレコードは先頭がブランクかCRCが合わないので、読み込まれません
+// エラーのときは-1を返す
+//*********
+int EEPFILE::kvRecord(unsigned long addr, const unsigned char *hd, const char *key, const char *val)
+{
+	int klen = hd[0];
+	int vlen = hd[2] + (hd[3] << 8);
+	unsigned long add = addr + EEPKV_RECHEAD;
+
+	if (kvProgram(add, (const unsigned char*)key, klen) == -1){
+		return -1;
+	}
+	if (vlen != EEPKV_DELETE && kvProgram(add + ((klen + 1) & ~1), (const unsigned char*)val, vlen) == -1){
+		return -1;
+	}
+	if (kvProgram(addr + 2, hd + 2, EEPKV_RECHEAD - 2) == -1 || kvProgram(addr, hd, 2) == -1){
+		return -1;
+	}
+	return 1;
+}
+
+//*********
+// バンクnの先頭に識別値と通番を書き込みます。通番の反転を最後に書き込みます
+// エラーのときは-1を返す
+//*********
+int EEPFILE::kvHead(int n, unsigned short seq)
+{
+	unsigned char hd[EEPKV_HEAD];
+	hd[0] = 'K';
+	hd[1] = 'V';
+	hd[2] = seq & 0xFF;
+	hd[3] = (seq >> 8) & 0xFF;
+	hd[4] = ~seq & 0xFF;
+	hd[5] = (~seq >> 8) & 0xFF;
+	if (kvProgram(EEPKV_ADDR(n), hd, 4) == -1 || kvProgram(EEPKV_ADDR(n) + 4, hd + 4, 2) == -1){
+		return -1;
+	}
+	return 1;
+}
+
+//*********
+// バンクnのブランクでないイレースブロックを消去します
+// エラーのときは-1を返す
+//*********
+int EEPFILE::kvErase(int n)
+{
+	for (unsigned long add = EEPKV_ADDR(n); add < (unsigned long)(EEPKV_ADDR(n) + EEPKV_BANK); add += DF_ERASE_BLOCK_SIZE){
+		if (blankMask(add) != 0xFFFF && eraseBlock(add) == -1){
+			return -1;
+		}
+	}
+	return 1;
+}
+
+//*********
+// ブランクのaddrからlenバイトを書き込みます。addrはDF_ALIGN境界で、lenが奇数のときは最後を0xFFで埋めます
+// エラーのときは-1を返す
+//*********
+int EEPFILE::kvProgram(unsigned long addr, const unsigned char *data, int len)
+{
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+
+	while (len > 0){
+		unsigned long blk = addr & DF_BLOCK_MASK;
+		int pos = addr - blk;
+		int n = DF_ERASE_BLOCK_SIZE - pos;
+		if (n > len){
+			n = len;
+		}
+
+		memcpy(&buf[pos], data, n);
+		if ((n & 1) != 0){
+			buf[pos + n] = 0xFF;
+		}
+		unsigned short mask = 0;
+		for (int i = pos / DF_ALIGN; i <= (pos + n - 1) / DF_ALIGN; i++){
+			mask |= 1 << i;
+		}
+		if (unitWrite(blk, buf, mask) == -1){
+			return -1;
+		}
+		addr += n;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+//*********
+// 圧縮ファイルに1バイト書き込みます
+// 先読みがいっぱいになったら、トークンを1つ符号化します
+// エラーのときは-1を返す
+//*********
+int EEPFILE::zipPut(FILEEEP *file, char dat)
+{
+	EEPZIP *z = file->zip;
+
+	z->win[z->hist + z->pend] = dat;
+	z->pend++;
+	z->usize++;
+	z->upos++;
+
+	if (z->pend == EEPZ_MAXLEN){
+		return zipToken(file);
+	}
+	return 1;
+}
+
+//*********
+// 先読みの先頭からトークンを1つ符号化します
+// 一致を探す範囲から最長の一致を探し、EEPZ_MINLEN以上であれば一致、そうでなければ生データにします
+// エラーのときは-1を返す
+//*********
+int EEPFILE::zipToken(FILEEEP *file)
+{
+	EEPZIP *z = file->zip;
+	unsigned char *cur = &z->win[z->hist];
+
+	int blen = 0;
+	int bdist = 0;
+	for (int d = 1; d <= z->hist; d++){
+		unsigned char *p = cur - d;
+		int n = 0;
+		while (n < z->pend && p[n] == cur[n]){	//先読みの中まで重なって一致してもよい
+			n++;
+		}
+		if (n > blen){
+			blen = n;
+			bdist = d;
+			if (n == z->pend){
+				break;
+			}
+		}
+	}
+
+	int n = 1;
+	if (blen >= EEPZ_MINLEN){
+		z->flags |= 1 << z->ntok;
+		z->io[z->iolen++] = bdist - 1;
+		z->io[z->iolen++] = blen - EEPZ_MINLEN;
+		n = blen;
+	}
+	else{
+		z->io[z->iolen++] = *cur;
+	}
+	z->ntok++;
+
+	//符号化した分を一致を探す範囲に移します。範囲を超えた古いデータは捨てます
+	z->hist += n;
+	z->pend -= n;
+	if (z->hist > EEPZ_WINDOW){
+		int drop = z->hist - EEPZ_WINDOW;
+		memmove(z->win, z->win + drop, EEPZ_WINDOW + z->pend);
+		z->hist = EEPZ_WINDOW;
+	}
+
+	if (z->ntok == EEPZ_TOKENS){
+		return zipGroup(file);
+	}
+	return 1;
+}
+
+//*********
+// 溜めたトークンをフラグと一緒に書き込みます
+// エラーのときは-1を返す
+//*********
+int EEPFILE::zipGroup(FILEEEP *file)
+{
+	EEPZIP *z = file->zip;
+	int ret = rawWrite(file, z->flags);
+
+	for (int i = 0; i < z->iolen && ret != -1; i++){
+		ret = rawWrite(file, z->io[i]);
+	}
+	z->flags = 0;
+	z->ntok = 0;
+	z->iolen = 0;
+	return ret;
+}
+
+//*********
+// 先読みに残っているデータを全て符号化して書き込みます
+// エラーのときは-1を返す
+//*********
+int EEPFILE::zipFlush(FILEEEP *file)
+{
+	EEPZIP *z = file->zip;
+
+	while (z->pend > 0){
+		if (zipToken(file) == -1){
+			return -1;
+		}
+	}
+
+	if (z->ntok > 0){
+		return zipGroup(file);
+	}
+	return 1;
+}
+
+//*********
+// 圧縮ファイルから1バイト復号して読み込みます
+// 圧縮データが壊れていて読めないときは-1を返す
+//*********
+int EEPFILE::zipGet(FILEEEP *file)
+{
+	EEPZIP *z = file->zip;
+	int c;
+
+	if (z->mlen > 0){
+		//一致のコピーの続き
+		c = z->win[(z->hist - z->mdist) & (EEPZ_WINDOW - 1)];
+		z->mlen--;
+	}
+	else{
+		if (z->ntok == 0){
+			int f = zipIn(file);
+			if (f == -1){
+				return -1;
+			}
+			z->flags = f;
+			z->ntok = EEPZ_TOKENS;
+		}
+
+		if ((z->flags & 1) != 0){
+			//一致: [距離-1][長さ-3]
+			int d = zipIn(file);
+			int n = zipIn(file);
+			if (d == -1 || n == -1){
+				return -1;
+			}
+			z->mdist = d + 1;
+			z->mlen = n + EEPZ_MINLEN - 1;
+			c = z->win[(z->hist - z->mdist) & (EEPZ_WINDOW - 1)];
+		}
+		else{
+			//生データ
+			c = zipIn(file);
+			if (c == -1){
+				return -1;
+			}
+		}
+		z->flags >>= 1;
+		z->ntok--;
+	}
+
+	z->win[z->hist] = c;
+	z->hist = (z->hist + 1) & (EEPZ_WINDOW - 1);
+	z->upos++;
+	return c;
+}
+
+//*********
+// 圧縮データを1バイト読み込みます。ioに少しずつまとめて読み込んでおきます
+// 圧縮データの終わりのときは-1を返す
+//*********
+int EEPFILE::zipIn(FILEEEP *file)
+{
+	EEPZIP *z = file->zip;
+
+	if (z->iopos >= z->iolen){
+		z->iolen = rawRead(file, (char*)z->io, sizeof(z->io));
+		z->iopos = 0;
+		if (z->iolen == 0){
+			return -1;
+		}
+	}
+	return z->io[z->iopos++];
+}
+
+//*********
+// 圧縮ファイルを先頭から復号し直します
+//*********
+void EEPFILE::zipRewind(FILEEEP *file)
+{
+	EEPZIP *z = file->zip;
+	unsigned char sz[2];
+
+	file->seek = 0;
+	rawRead(file, (char*)sz, 2);
+
+	z->usize = sz[0] + (sz[1] << 8);
+	z->upos = 0;
+	z->hist = 0;
+	z->mlen = 0;
+	z->ntok = 0;
+	z->iolen = 0;
+	z->iopos = 0;
+}
+
+//*********
+// 圧縮ファイルのシーク
+// 元のデータの位置に移動します。後ろに戻るときは先頭から復号し直します
+// 書き込みのときはシークできないので、今の位置を返します
+//*********
+int EEPFILE::zipSeek(FILEEEP *file, int offset, int origin)
+{
+	EEPZIP *z = file->zip;
+	long sk = 0;
+
+	if (((Sect[file->stasector] >> 10) & 0x3) == EEP_WRITE){
+		return z->upos;
+	}
+
+	if (origin == EEP_SEEKTOP){
+		sk = 0 + offset;
+	}
+	else if (origin == EEP_SEEKCUR){
+		sk = z->upos + offset;
+	}
+	else if (origin == EEP_SEEKEND){
+		sk = z->usize + offset;
+	}
+
+	if (sk < 0){
+		sk = 0;
+	}
+	else if (sk > z->usize){
+		sk = z->usize;
+	}
+
+	if (sk < z->upos){
+		zipRewind(file);
+	}
+	while (z->upos < sk){
+		if (zipGet(file) == -1){
+			break;
+		}
+	}
+	return z->upos;
+}
+
+//*********
+// ファイル名を取得する
+// ファイル文字数(バイト)が返る。最後の0x00は数えない。
+//*********
+int EEPFILE::getFilename(int sect, char *filename)
+{
+	//DEBUG_PRINT("getFilename sect", sect);
+
+	if (sect < EEPSTASECT){ return 0; }
+
+	char fn[EEPFILENAME_SIZE];
+	flashRead(sect * EEPSECTOR_SIZE, fn, EEPFILENAME_SIZE);
+
+	for (int len = 0; len < EEPFILENAME_SIZE; len++){
+		filename[len] = fn[len];
+
+		if (filename[len] == 0){
+			//DEBUG_PRINT("getFilename filename", filename);
+			//DEBUG_PRINT("getFilename len", len);
+			return len;
+		}
+	}
+
+	//DEBUG_PRINT("getFilename filename", filename);
+	filename[0] = 0;
+	return 0;
+}
+
+//*********
+// ファイル名を探す(ファイル名は31バイトまで)
+// 見つかったセクタ番号を返す
+// 見つからないときは、-1を返す
+//
+// ファイル名インデックスでハッシュ値と長さが一致したものだけ、EEPROMのファイル名と比較します
+// 書き込み中の置き換え用のファイルは探しません
+//*********
+int EEPFILE::scanFilename(const char *filename)
+{
+	//DEBUG_PRINT("scanFilename", filename);
+
+	int flen = strlen((const char*)filename);
+	if(flen >= EEPFILENAME_SIZE){ return -1; }
+
+	unsigned short hash = nameHash(filename, flen);
+	char fn[EEPFILENAME_SIZE];
+	for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
+
+		//DEBUG_PRINT("scanFilename i", i);
+
+		if (((Sect[i]>>8) & 0x3) == EEP_TOP && ((Sect[i]>>14) & 0x1) != EEP_NEW && Index[i].len == flen && Index[i].hash == hash){
+
+			flashRead(i * EEPSECTOR_SIZE, fn, flen);
+			if (memcmp(filename, fn, flen) == 0){
+				//DEBUG_PRINT("scanFilename ret", i);
+				return i;
+			}
+		}
+	}
+
+	//DEBUG_PRINT("scanFilename ret", -1);
+	return -1;
+}
+
+//*********
+// ファイル名のハッシュ値を求めます
+//*********
+unsigned short EEPFILE::nameHash(const char *filename, int len)
+{
+	unsigned short hash = 0;
+	for (int i = 0; i < len; i++){
+		hash = hash * 31 + (unsigned char)filename[i];
+	}
+	return hash;
+}
+
+//*********
+// 先頭セクタのファイル名とファイルサイズをファイル名インデックスにセットします
+// 先頭セクタでなければ、インデックスを空にします
+//*********
+void EEPFILE::setIndex(int sect)
+{
+	Index[sect].len = 0;
+	Index[sect].size = 0;
+	Index[sect].hash = 0;
+
+	if (((Sect[sect]>>8) & 0x3) != EEP_TOP){
+		return;
+	}
+
+	char fn[EEPFILENAME_SIZE];
+	int len = getFilename(sect, fn);
+
+	//リングログは、ファイル名のブロックを除いたセクタの大きさをサイズにします
+	if (ISRING(sect)){
+		int cnt = 1;
+		for (int s = sect; (Sect[s] & EEPNEXT_MASK) != s; s = Sect[s] & EEPNEXT_MASK){
+			cnt++;
+		}
+		Index[sect].len = len;
+		Index[sect].size = cnt * EEPSECTOR_SIZE - DF_ERASE_BLOCK_SIZE;
+		Index[sect].hash = nameHash(fn, len);
+		return;
+	}
+
+	bool crc = ((Sect[sect] >> 13) & 0x1) == EEP_CRC;
+	unsigned char sz[2];
+	flashRead(sect * EEPSECTOR_SIZE + dataOffset(len, crc) - (crc ? 4 : 2), (char*)sz, 2);
+
+	Index[sect].len = len;
+	Index[sect].size = sz[0] + (sz[1] << 8);
+	Index[sect].hash = nameHash(fn, len);
+}
+
+//*********
+// 書き込まれていないセクタを探す
+// 空きセクタの中で消去回数が最も少ないセクタを選び、消去回数を1つ増やします
+// 消去回数が同じときは、startから先に見つけたセクタを選びます
+// セクタ番号を返す
+// 全て書き込まれているときは、-1を返す
+//*********
+int EEPFILE::scanEmptySector(int start)
+{
+	int s0 = EEPSTASECT;
+	if (start >= EEPSTASECT && start <= EEPENDSECT){
+		s0 = start;
+	}
+
+	int sect = -1;
+	for (int n = 0; n <= EEPENDSECT - EEPSTASECT; n++){
+		int i = s0 + n;
+		if (i > EEPENDSECT){
+			i -= EEPENDSECT - EEPSTASECT + 1;
+		}
+
+		if (((Sect[i] >> 8) & 0x3) == EEP_EMPTY && (sect == -1 || Wear[i] < Wear[sect])){
+			sect = i;
+		}
+	}
+
+	return sect;
+}
+
+//*********
+// need個連続して空いているセクタを探す
+// 候補の中で消去回数の合計が最も少ない並びを選びます
+// 先頭のセクタ番号を返す
+// 見つからないときは、-1を返す
+//*********
+int EEPFILE::scanEmptyRun(int need)
+{
+	int sect = -1;
+	long minwear = 0;
+
+	int run = 0;
+	long wear = 0;
+	for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
+		if (((Sect[i] >> 8) & 0x3) != EEP_EMPTY){
+			run = 0;
+			wear = 0;
+			continue;
+		}
+
+		run++;
+		wear += Wear[i];
+		if (run > need){
+			wear -= Wear[i - need];
+			run = need;
+		}
+
+		if (run == need && (sect == -1 || wear < minwear)){
+			sect = i - need + 1;
+			minwear = wear;
+		}
+	}
+	return sect;
+}
+
+//*********
+// ファイルサイズより後ろにつながっているセクタを空きセクタに戻します
+//*********
+void EEPFILE::trimSect(FILEEEP *file)
+{
+	int last = (file->offsetaddress + file->filesize - 1) / EEPSECTOR_SIZE;
+	int sect = file->stasector;
+	for (int i = 0; i < last; i++){
+		sect = Sect[sect] & EEPNEXT_MASK;
+	}
+
+	int next = Sect[sect] & EEPNEXT_MASK;
+	if (next == sect){
+		return;
+	}
+
+	//最終セクタにする
+	Sect[sect] = (Sect[sect] & ~EEPNEXT_MASK) | sect;
+	FATDIRTY(sect);
+
+	while(true){
+		sect = next;
+		next = Sect[sect] & EEPNEXT_MASK;		//次のセクタ読み込み
+		Sect[sect] = EEP_EMPTY << 8;	//現セクタを空にする
+		FATDIRTY(sect);
+		if (sect == next){				//最終セクタには自分のセクタ番号が書いてある
+			break;
+		}
+	}
+	file->cursector = -1;
+}
+
+//*********
+// セクタの消去回数を1つ増やします
+// 上限に近づいたら、ファイルに使うセクタの最小の回数を全てのセクタから引きます
+// ウェアレベリングは回数の差だけを見るので、引いても結果は変わりません
+//*********
+void EEPFILE::addWear(int sect)
+{
+	if (Wear[sect] >= 0xFF00){
+		unsigned short mn = 0xFFFF;
+		for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
+			if (Wear[i] < mn){
+				mn = Wear[i];
+			}
+		}
+		for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
+			Wear[i] -= mn;
+		}
+		WearDirty = ~0UL;
+	}
+
+	if (Wear[sect] < 0xFFFE){
+		Wear[sect]++;
+		WEARDIRTY(sect);
+	}
+}
+
+//*********
+// 静的ウェアレベリング
+// 空きセクタの最大の消去回数と、使用中セクタの最小の消去回数の差がEEPWEAR_LIMITを超えていれば、
+// 書き換えられていない使用中セクタのデータを、消去回数の多い空きセクタに移します
+// 1回の呼び出しで移すのは1セクタだけです。オープン中のファイルがあるときは何もしません
+// 移したときは1を返します
+//*********
+int EEPFILE::wearLevel(void)
+{
+	int src = -1;
+	int dst = -1;
+
+	for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
+		if (((Sect[i] >> 10) & 0x3) != EEP_CLOSE){
+			return 0;
+		}
+
+		if (((Sect[i] >> 8) & 0x3) == EEP_EMPTY){
+			if (dst == -1 || Wear[i] > Wear[dst]){
+				dst = i;
+			}
+		}
+		else if (src == -1 || Wear[i] < Wear[src]){
+			src = i;
+		}
+	}
+
+	if (src == -1 || dst == -1 || Wear[dst] - Wear[src] <= EEPWEAR_LIMIT){
+		return 0;
+	}
+
+	DEBUG_PRINT("wearLevel src", src);
+	DEBUG_PRINT("wearLevel dst", dst);
+
+	if (moveSector(src, dst) == -1){
+		return -1;
+	}
+	saveFat();
+	return 1;
 }
 
-//******************************************************
-// ファイルサイズを返します
-//******************************************************
-int EEPFILE::ffilesize(const char *filename)
+//*********
+// セクタsrcのデータを空きセクタdstに移して、FATのつながりを付け替えます
+// srcは空きセクタになります。FATの保存は呼び出し側で行います
+// エラーのときは-1を返す
+//*********
+int EEPFILE::moveSector(int src, int dst)
 {
-	int ret = 0;
-	int sect = scanFilename(filename);
-	int len = strlen(filename);
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
 
-	if (sect != -1){
-		int add = sect * EEPSECTOR_SIZE;
-		ret = (EEPROM.read( add + len + 1 ) & 0xFF) + ((EEPROM.read( add + len + 2 ) & 0xFF) << 8);
+	//データをイレースブロック単位でコピーします
+	for (int b = 0; b < EEPSECTOR_SIZE / DF_ERASE_BLOCK_SIZE; b++){
+		unsigned long add = dst * EEPSECTOR_SIZE + b * DF_ERASE_BLOCK_SIZE;
+		flashRead(src * EEPSECTOR_SIZE + b * DF_ERASE_BLOCK_SIZE, (char*)buf, DF_ERASE_BLOCK_SIZE);
+		if (blockWrite(add, buf, 0xFFFF, blankMask(add)) == -1){
+			return -1;
+		}
 	}
-	return ret;
+	linkSector(src, dst);
+	return 1;
 }
 
+//*********
+// FATのつながりを、セクタsrcからdstに付け替えます。データはコピーしません
+// srcは空きセクタになります。FATの保存は呼び出し側で行います
+//*********
+void EEPFILE::linkSector(int src, int dst)
+{
+	//srcを指している前のセクタを付け替えます
+	//前のフォーマットから移行するときは、予約セクタやKVSになったセクタからも指しているので、そこも探します
+	for (int i = EEPOLDSTASECT; i < EEPSECTORS; i++){
+		if (i != src && ((Sect[i] >> 8) & 0x3) != EEP_EMPTY && (Sect[i] & EEPNEXT_MASK) == src){
+			Sect[i] = (Sect[i] & ~EEPNEXT_MASK) | dst;
+			FATDIRTY(i);
+			break;
+		}
+	}
+
+	//最終セクタのときは自分自身を指すようにします
+	int next = Sect[src] & EEPNEXT_MASK;
+	Sect[dst] = (Sect[src] & ~EEPNEXT_MASK) | (next == src ? dst : next);
+	Sect[src] = EEP_EMPTY << 8;
+	FATDIRTY(src);
+	FATDIRTY(dst);
 
-//***
-//  Private methods
-//***
+	//先頭セクタのときは、ファイル名インデックスも移します
+	Index[dst] = Index[src];
+	setIndex(src);
+}
 
 //*********
-// ファイル名を取得する
-// ファイル文字数(バイト)が返る。最後の0x00は数えない。
+// ファイルポインタの書き込みを行う
+// 新しいファイルはヘッダにCRCを持ち、fclose()まではFATに空きセクタとして保存されます
 //*********
-int EEPFILE::getFilename(int sect, char *filename)
+void EEPFILE::setFile( FILEEEP *file, const char *filename, int sect, int mode)
 {
-	//DEBUG_PRINT("getFilename sect", sect);
+	int add = sect * EEPSECTOR_SIZE;
+	int len = strlen(filename);
+	//int a1;
 
-	if (sect < EEPSTASECT){ return 0; }
+	//セクタ配列をセットします(自分自身をセット)
+	Sect[sect] = sect & EEPNEXT_MASK;		//とりあえずトップセクタ番号をセットする
+	Sect[sect] |= EEP_TOP << 8;		//ファイルトップフラグ
+	Sect[sect] |= mode << 10;		//ファイル使用中フラグ
+	Sect[sect] |= (EEP_CRC << 13) | (EEP_NEW << 14);
+	FATDIRTY(sect);
 
-	unsigned long add = sect * EEPSECTOR_SIZE;
-	int len = 0;
-	for (int i = (int)add; i <= (int)add + EEPFILENAME_SIZE; i++){
-		filename[len] = (char)EEPROM.read(i);
+	file->cursector = -1;
+	file->bufaddress = -1;
+	file->filesize = 0;
+	file->stasector = sect;
+	file->offsetaddress = dataOffset(len, true);
+	file->seek = 0;
 
-		if (filename[len] == 0){
-			//DEBUG_PRINT("getFilename filename", filename);
-			//DEBUG_PRINT("getFilename len", len);
-			return len;
+	//サイズとCRC(圧縮ファイルは元のデータのサイズも)をfclose()で消去せずに書き込めるように、
+	//ヘッダのイレースブロックは先に消去しておきます
+	for (int a = 0; a < file->offsetaddress + 2; a += DF_ERASE_BLOCK_SIZE){
+		if (blankMask(add + a) != 0xFFFF){
+			eraseBlock(add + a);
 		}
-		len++;
 	}
 
-	//DEBUG_PRINT("getFilename filename", filename);
-	return 0;
+	//ファイル名を書き込む。サイズとCRCはブランクのままにしておく
+	for( int i=0; i<len; i++){
+		bufWrite( file, add + i, filename[i] );
+	}
+	bufWrite( file, add + len, 0 );
+
+	//ファイル名インデックスに登録します
+	Index[sect].len = len;
+	Index[sect].size = 0;
+	Index[sect].hash = nameHash(filename, len);
 }
 
 //*********
-// ファイル名を探す(ファイル名は31バイトまで)
-// 見つかったセクタ番号を返す
-// 見つからないときは、-1を返す
+// 先頭セクタからつながっているセクタを空きセクタにします
+// FATの保存は呼び出し側で行います
 //*********
-int EEPFILE::scanFilename(const char *filename)
+void EEPFILE::freeSect(int sect)
 {
-	//DEBUG_PRINT("scanFilename", filename);
-
-	int flen = strlen((const char*)filename);
-	if(flen >= EEPFILENAME_SIZE){ return -1; }
+	Index[sect].len = 0;
 
-	char fn[EEPFILENAME_SIZE];
-	int len = 0;
-	int ret = -1;
-	for (int i = EEPSTASECT; i <= EEPENDSECT; i++){
-
-		//DEBUG_PRINT("scanFilename i", i);
+	int next;
+	while(true){
+		next = Sect[sect] & EEPNEXT_MASK;		//次のセクタ読み込み
+		Sect[sect] = EEP_EMPTY << 8;	//現セクタを空にする
+		FATDIRTY(sect);
+		if (sect == next){				//最終セクタには自分のセクタ番号が書いてある
+			break;
+		}
+		sect = next;
+	}
+}
 
-		if (((Sect[i]>>8) & 0x3) == EEP_TOP){
+//*********
+// 置き換える予定の元のファイルを、空きが足りないので先に削除します
+// 削除した後は、書き込み中に電源が切れると元のファイルは残りません
+//*********
+void EEPFILE::dropOld(FILEEEP *file)
+{
+	if (file->oldsector == -1){
+		return;
+	}
+	freeSect(file->oldsector);
+	file->oldsector = -1;
+	saveFat();
+}
 
-			len = getFilename(i, fn);
-			if (flen == len){
-				ret = i;
-				for (int j = 0; j < len; j++){
-					if (filename[j] != fn[j]){
-						ret = -1;
-						break;
-					}
-				}
+//*********
+// FATをEEPROMに保存します
+// 古い方の面に、Sect[]を書き換えたイレースブロックだけを書き込んでから、最後に通番とCRCを書き込みます
+// 通番とCRCを書き込むまでは前の面が使われるので、途中で電源が切れても前のFATに戻ります
+// 消去回数はFATの後に保存します
+//*********
+void EEPFILE::saveFat(void)
+{	
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	unsigned short v;
+	unsigned long add;
+
+	//前回の保存からSect[]を書き換えていれば、古い方の面に書き込みます
+	if (FatDirty[FatCopy] != 0){
+		int copy = 1 - FatCopy;
+		unsigned long seq = FatSeq + 1;
+		unsigned short crc = 0xFFFF;
+
+		for( int b=0; b<EEPFAT_BLOCKS; b++){
+			fatBlock(b, buf);
+			crc = crc16(crc, buf, DF_ERASE_BLOCK_SIZE);
+
+			if ((FatDirty[copy] & (1UL << b)) != 0){
+				add = EEPFAT_ADDR(copy) + b * DF_ERASE_BLOCK_SIZE;
+				blockWrite( add, buf, 0xFFFF, blankMask(add) );
 			}
-			if (ret != -1){	break;	}
 		}
+
+		//通番とCRCを書き込みます
+		buf[0] = seq & 0xFF;
+		buf[1] = (seq >> 8) & 0xFF;
+		buf[2] = (seq >> 16) & 0xFF;
+		buf[3] = (seq >> 24) & 0xFF;
+		crc = crc16(crc, buf, 4);
+		buf[4] = crc & 0xFF;
+		buf[5] = (crc >> 8) & 0xFF;
+		add = EEPFAT_ADDR(copy) + EEPFAT_SIZE;
+		blockWrite( add, buf, 0x0007, blankMask(add) );
+
+		FatDirty[copy] = 0;
+		FatCopy = copy;
+		FatSeq = seq;
 	}
 
-	//DEBUG_PRINT("scanFilename ret", ret);
-	return ret;
+	for( int b=0; b<EEPFAT_BLOCKS; b++){
+		if ((WearDirty & (1UL << b)) == 0){
+			continue;
+		}
+		for( int j=0; j<DF_ERASE_BLOCK_SIZE / 2; j++){
+			v = Wear[b * DF_ERASE_BLOCK_SIZE / 2 + j];
+			buf[j*2] = v & 0xFF;
+			buf[j*2 + 1] = (v >> 8) & 0xFF;
+		}
+		add = EEPWEAR_START + b * DF_ERASE_BLOCK_SIZE;
+		blockWrite( add, buf, 0xFFFF, blankMask(add) );
+	}
+	WearDirty = 0;
 }
 
 //*********
-// 書き込まれていないブロックを探す
-// ブロック番号を返す
-// 全て書き込まれているときは、-1を返す
+// Sect[]のb番目のイレースブロック分を、FATに保存する形にしてbufに入れます
 //*********
-int EEPFILE::scanEmptySector(int start)
+void EEPFILE::fatBlock(int b, unsigned char *buf)
 {
-	int s0 = EEPSTASECT;
-	if (start >= EEPSTASECT && start <= EEPENDSECT){
-		s0 = start;
-	}
-
-	for (int i = s0; i <= EEPENDSECT; i++){
-		if (((Sect[i] >> 8) & 0x3) == EEP_EMPTY){
-			return i;
+	for( int j=0; j<DF_ERASE_BLOCK_SIZE / 2; j++){
+		unsigned short v = Sect[b * DF_ERASE_BLOCK_SIZE / 2 + j];
+		if (((v >> 14) & 0x1) == EEP_NEW){
+			v = EEP_EMPTY << 8;		//書き込み中の置き換え用のセクタは空きセクタとして保存する
 		}
+		v &= ~(3 << 10);			// 11,12ビット目は0にして保存する 1111 0011 1111 1111
+		buf[j*2] = v & 0xFF;
+		buf[j*2 + 1] = (v >> 8) & 0xFF;
 	}
+}
 
-	for (int i = EEPSTASECT; i < s0; i++){
-		if (((Sect[i] >> 8) & 0x3) == EEP_EMPTY){
-			return i;
+//*********
+// addrの面に、FATが1面だった頃のセクタ1より前にあるブロックが、今のSect[]と同じに書き込まれているかを調べます
+// 同じときは、その面をSect[]で書いている途中で電源が切れています。そのときは1を返す
+// 書き込みは先頭のブロックから順に行い、同じ内容のブロックは消去しないので、書き直しても同じままです
+//*********
+int EEPFILE::fatStarted(unsigned long addr)
+{
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	int cnt = 0;
+
+	for( int b=0; b<EEPFAT_BLOCKS; b++){
+		unsigned long add = addr + b * DF_ERASE_BLOCK_SIZE;
+		if (add + DF_ERASE_BLOCK_SIZE > EEPOLDSTASECT * EEPSECTOR_SIZE){
+			break;
+		}
+		fatBlock(b, buf);
+		if (blankMask(add) != 0 || memcmp(buf, (const void*)(DF_ADDRESS + add), DF_ERASE_BLOCK_SIZE) != 0){
+			return 0;
 		}
+		cnt++;
 	}
-	return -1;
+	return (cnt > 0) ? 1 : 0;
 }
 
 //*********
-// ファイルポインタの書き込みを行う
+// addrから保存されているFATの通番とCRCを調べます
+// 通番をseqに入れて、CRCが合っていれば1を返します
 //*********
-void EEPFILE::setFile( FILEEEP *file, const char *filename, int sect, int mode)
+int EEPFILE::checkFat(unsigned long addr, unsigned long *seq)
 {
-	int add = sect * EEPSECTOR_SIZE;
-	int len = strlen(filename);
-	//int a1;
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+	unsigned short crc = 0xFFFF;
 
-	//セクタ配列をセットします(自分自身をセット)
-	Sect[sect] = sect & 0x7F;		//とりあえずトップセクタ番号をセットする
-	Sect[sect] |= EEP_TOP << 8;		//ファイルトップフラグ
-	Sect[sect] |= mode << 10;		//ファイル使用中フラグ
+	//通番とCRCが書き込まれていなければ、書き込み中に電源が切れたか、使っていない面です
+	if ((blankMask(addr + EEPFAT_SIZE) & 0x0007) != 0){
+		return 0;
+	}
 
-	//ファイル名を書き込む
-	for( int i=0; i<len; i++){
-		epWrite( add + i, filename[i] );
+	for( int b=0; b<EEPFAT_BLOCKS; b++){
+		flashRead(addr + b * DF_ERASE_BLOCK_SIZE, (char*)buf, DF_ERASE_BLOCK_SIZE);
+		crc = crc16(crc, buf, DF_ERASE_BLOCK_SIZE);
 	}
-	epWrite( add + len, 0 );
 
-	//ファイルサイズ 0 セット
-	epWrite( add + len + 1, 0 );
-	epWrite( add + len + 2, 0 );
+	flashRead(addr + EEPFAT_SIZE, (char*)buf, 6);
+	crc = crc16(crc, buf, 4);
+	*seq = buf[0] + (buf[1] << 8) + ((unsigned long)buf[2] << 16) + ((unsigned long)buf[3] << 24);
 
-	file->filesize = 0;
-	file->stasector = sect;
-	file->offsetaddress = len + 3;
-	file->seek = 0;
+	return (crc == buf[4] + (buf[5] << 8)) ? 1 : 0;
 }
 
 //*********
-// FATをEEPROMに保存します
+// addrから保存されているFATをSect[]に読み込みます
 //*********
-void EEPFILE::saveFat(void)
-{	
-	//int a1, a2;
-	for( int i=0; i<EEPSECTORS; i++){
-		// 11,12ビット目は0にして保存する 1111 0011 1111 1111
-		//a1 = (Sect[i] & (~(3 << 10))) & 0xFF;
-		//a2 = ((Sect[i] & (~(3 << 10)))>>8) & 0xFF;
-		epWrite( EEPFAT_START + i*2, (Sect[i] & (~(3 << 10))) & 0xFF);
-		epWrite( EEPFAT_START + i*2 + 1, ((Sect[i] & (~(3 << 10)))>>8) & 0xFF);
+void EEPFILE::loadFat(unsigned long addr)
+{
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];
+
+	for( int b=0; b<EEPFAT_BLOCKS; b++){
+		flashRead(addr + b * DF_ERASE_BLOCK_SIZE, (char*)buf, DF_ERASE_BLOCK_SIZE);
+		for( int j=0; j<DF_ERASE_BLOCK_SIZE / 2; j++){
+			Sect[b * DF_ERASE_BLOCK_SIZE / 2 + j] = buf[j*2] + (buf[j*2 + 1] << 8);
+		}
+	}
+}
+
+//*********
+// FATが1面だった頃や、KVSが無かった頃のフォーマットから移行します
+// FATを2面にして予約セクタになったセクタと、KVSのセクタのデータを空きセクタに移します。FATの保存は呼び出し側で行います
+// 予約セクタはFATに次のセクタ0の使用中として入っているので、それ以外になっているセクタを移します
+// copyがfalseのときは、データをコピーせずにFATだけを付け替えます。移し先は消去回数と今のFATだけで決まります
+// 書き換えたセクタの数を返す。移す空きセクタが無いときは、-1を返す
+//*********
+int EEPFILE::moveReserved(bool copy)
+{
+	int cnt = 0;
+	for (int i = EEPOLDSTASECT; i < EEPSECTORS; i++){
+		if (i == EEPSTASECT){
+			i = EEPENDSECT + 1;
+		}
+		if (Sect[i] == (EEP_USED << 8)){
+			continue;
+		}
+		if (((Sect[i] >> 8) & 0x3) != EEP_EMPTY){
+			int dst = scanEmptySector(EEPSTASECT);
+			if (dst == -1){
+				return -1;
+			}
+			if (!copy){
+				linkSector(i, dst);
+			}
+			else if (moveSector(i, dst) == -1){
+				return -1;
+			}
+		}
+		Sect[i] = EEP_USED << 8;
+		FATDIRTY(i);
+		cnt++;
 	}
+	return cnt;
 }
 
 //*********
 // file->seekが示す場所のセクタを求めます
 // そのセクタのアドレスもaddに入れて返します
 // 全て書き込まれているときは、-1を返す
+//
+// 前回のセクタ(file->cursector)から先に進むときは、そこから追いかけるので
+// 先頭から順に読み書きするときは、セクタを辿るのは1回で済みます
 //*********
 int EEPFILE::getSect(FILEEEP *file, int *add)
 {
@@ -627,7 +3191,13 @@ int EEPFILE::getSect(FILEEEP *file, int *add)
 	int n = (file->offsetaddress + file->seek) / EEPSECTOR_SIZE;
 	*add = (file->offsetaddress + file->seek) % EEPSECTOR_SIZE;
 
-	int sect = file->stasector;
+	//前回のセクタより前に戻るときは、先頭セクタから追いかけ直す
+	if(file->cursector < EEPSTASECT || n < file->curindex){
+		file->cursector = file->stasector;
+		file->curindex = 0;
+	}
+
+	int sect = file->cursector;
 
 	//DEBUG_PRINT("getSect n", n);
 	//DEBUG_PRINT("getSect add", *add);
@@ -635,69 +3205,290 @@ int EEPFILE::getSect(FILEEEP *file, int *add)
 	//DEBUG_PRINT("getSect file->seek", file->seek);
 
 	//セクタを追っかける
-	for(int i=0; i<n; i++){
-		sect = Sect[sect] & 0x7F;
+	int next;
+	while(file->curindex < n){
+		next = Sect[sect] & EEPNEXT_MASK;
+		if (sect == next){				//最終セクタには自分のセクタ番号が書いてある
+			break;
+		}
+		sect = next;
+		file->curindex++;
 	}
+	file->cursector = sect;
 	//DEBUG_PRINT("getSect sect 1", sect);
 	//DEBUG_PRINT("getSect EEP_WRITE", (Sect[file->stasector] >> 10) & 0x3);
 
 	//書き込みオープンのとき
 	if(((Sect[file->stasector] >> 10) & 0x3) == EEP_WRITE){
-		//割り切れているときは、
-		if(*add == 0){
+		//最終セクタまで来ても、まだ先のセクタが必要なときは、
+		if(file->curindex < n){
 
 			//DEBUG_PRINT("getSect file->stasector", file->stasector);
 			//DEBUG_PRINT("getSect file->filesize", file->filesize);
 			//DEBUG_PRINT("getSect file->offsetaddress", file->offsetaddress);
 			//DEBUG_PRINT("getSect file->seek", file->seek);
 
-			//割り切れているのに、Sect[sect]にある次のセクタ番号が自分自身であったら、
-			if (file->seek >= file->filesize){
-				//新規セクタを用意する
-				int newsect = scanEmptySector((int)millis() & 0x3F);	//(int)millis()&0x3Fは、乱数の要素を含ませているセクタの平滑化利用(ウェアレベリングを考慮)
-				if (newsect == -1){
-					//ファイルがいっぱいだった
-					return -1;
-				}
-				//次のセクタを入れる
-				Sect[sect] = (Sect[sect] & 0xFF80) | newsect;
+			//新規セクタを用意する
+			int newsect = scanEmptySector((int)millis() % EEPSECTORS);	//(int)millis()%EEPSECTORSは、消去回数が同じセクタの中から選ぶときの乱数の要素
+			if (newsect == -1 && file->oldsector != -1){
+				//空きが無いときは、置き換える予定の元のファイルを先に削除します
+				dropOld(file);
+				newsect = scanEmptySector((int)millis() % EEPSECTORS);
+			}
+			if (newsect == -1){
+				//ファイルがいっぱいだった
+				return -1;
+			}
+			//次のセクタを入れる
+			Sect[sect] = (Sect[sect] & ~EEPNEXT_MASK) | newsect;
+
+			DEBUG_PRINT("getSect newsect", newsect);
+
+			//セクタ配列をセットします
+			Sect[newsect] = newsect & EEPNEXT_MASK;			//最後尾なので自分自身をセット
+			Sect[newsect] |= EEP_USED << 8;			//ファイルユーズフラグ
+			Sect[newsect] |= EEP_WRITE << 10;		//ファイル使用中フラグ
+			Sect[newsect] |= Sect[file->stasector] & (EEP_NEW << 14);	//置き換え用のファイルのセクタ
+			FATDIRTY(sect);
+			FATDIRTY(newsect);
+			sect = newsect;
+
+			file->cursector = sect;
+			file->curindex++;
+		}
+	}
+	return sect;
+}
+
+//*********
+// 書き込みバッファに1バイト書き込みます
+// エラーのときは-1を返す
+//*********
+int EEPFILE::bufWrite(FILEEEP *file, unsigned long addr, unsigned char data)
+{
+	return bufWrite(file, addr, &data, 1);
+}
 
-				DEBUG_PRINT("getSect newsect", newsect);
+//*********
+// 書き込みバッファにlenバイト書き込みます。addrからlenバイトは同じイレースブロックに入っていること
+// addrが書き込みバッファのブロック外であれば、バッファを書き出してから読み込み直します
+// エラーのときは-1を返す
+//*********
+int EEPFILE::bufWrite(FILEEEP *file, unsigned long addr, const unsigned char *data, int len)
+{
+	long blk = addr & DF_BLOCK_MASK;
 
-				//セクタ配列をセットします
-				Sect[newsect] = newsect & 0x7F;			//最後尾なので自分自身をセット
-				Sect[newsect] |= EEP_USED << 8;			//ファイルユーズフラグ
-				Sect[newsect] |= EEP_WRITE << 10;		//ファイル使用中フラグ
-				sect = newsect;
+	if (file->bufaddress != blk){
+		if (bufFlush(file) == -1){
+			return -1;
+		}
+
+		//ブロックの現在の内容を読み込みます。ブランクの箇所は0xFFとします
+		file->bufblank = blankMask(blk);
+		for (int i = 0; i < EEPBLOCK_UNITS; i++){
+			if ((file->bufblank & (1 << i)) != 0){
+				memset(&file->buf[i * DF_ALIGN], 0xFF, DF_ALIGN);
+			}
+			else{
+				memcpy(&file->buf[i * DF_ALIGN], (const void*)(DF_ADDRESS + blk + i * DF_ALIGN), DF_ALIGN);
 			}
 		}
+		file->bufaddress = blk;
+		file->bufmask = 0;
 	}
-	return sect;
+
+	int pos = addr & (DF_ERASE_BLOCK_SIZE - 1);
+	memcpy(&file->buf[pos], data, len);
+	for (int i = pos / DF_ALIGN; i <= (pos + len - 1) / DF_ALIGN; i++){
+		file->bufmask |= 1 << i;
+	}
+	return 1;
+}
+
+//*********
+// 書き込みバッファをEEPROMに書き出します
+// エラーのときは-1を返す
+//*********
+int EEPFILE::bufFlush(FILEEEP *file)
+{
+	int ret = 1;
+
+	if (file->bufaddress >= 0 && file->bufmask != 0){
+		ret = blockWrite(file->bufaddress, file->buf, file->bufmask, file->bufblank);
+	}
+	file->bufaddress = -1;
+	file->bufmask = 0;
+	return ret;
+}
+
+//*********
+// 1イレースブロック分のデータを書き込みます
+// mask: 書き換えた箇所, blank: ブランクだった箇所 (どちらもDF_ALIGN単位のビット)
+// 書き換えた箇所が全てブランクであれば消去せずに書き込み、
+// そうでなければ1回だけ消去して、ブロック全体を書き直します
+// エラーのときは-1を返す
+//*********
+int EEPFILE::blockWrite(unsigned long addr, unsigned char *buf, unsigned short mask, unsigned short blank)
+{
+	bool erase = false;
+
+	for (int i = 0; i < EEPBLOCK_UNITS; i++){
+		if ((mask & ~blank & (1 << i)) != 0
+			&& memcmp(&buf[i * DF_ALIGN], (const void*)(DF_ADDRESS + addr + i * DF_ALIGN), DF_ALIGN) != 0){
+			erase = true;
+			break;
+		}
+	}
+
+	if (erase){
+		if (eraseBlock(addr) == -1){
+			return -1;
+		}
+	}
+
+	//消去したときはブランクでなかった箇所も書き戻す
+	unsigned short prog = erase ? (mask | ~blank) : (mask & blank);
+	if (prog != 0){
+		Erased[addr / DF_ERASE_BLOCK_SIZE / 8] &= ~(1 << ((addr / DF_ERASE_BLOCK_SIZE) & 7));
+	}
+	for (int i = 0; i < EEPBLOCK_UNITS; i++){
+		if ((prog & (1 << i)) != 0){
+			ProgramCount++;
+			if (flash_datarom_WriteData(DF_ADDRESS + addr + i * DF_ALIGN, &buf[i * DF_ALIGN], DF_ALIGN) != FLASH_SUCCESS){
+				return -1;
+			}
+		}
+	}
+
+	//ブロックにブランクの箇所が残っていなければ、確認済みにする
+	if ((unsigned short)(erase ? prog : (~blank | prog)) == 0xFFFF){
+		Programmed[addr / DF_ERASE_BLOCK_SIZE / 8] |= 1 << ((addr / DF_ERASE_BLOCK_SIZE) & 7);
+	}
+	return 1;
+}
+
+//*********
+// ブランクと分かっている書き込み単位に、maskのビットの箇所だけbufから書き込みます。消去はしません
+// リングログやKVSのように、ブランクの箇所に追記するときに使います
+// ブロックの他の箇所がブランクかどうかは分からないので、確認済みにはしません
+// エラーのときは-1を返す
+//*********
+int EEPFILE::unitWrite(unsigned long addr, const unsigned char *buf, unsigned short mask)
+{
+	Erased[addr / DF_ERASE_BLOCK_SIZE / 8] &= ~(1 << ((addr / DF_ERASE_BLOCK_SIZE) & 7));
+	for (int i = 0; i < EEPBLOCK_UNITS; i++){
+		if ((mask & (1 << i)) != 0){
+			ProgramCount++;
+			if (flash_datarom_WriteData(DF_ADDRESS + addr + i * DF_ALIGN, (void*)&buf[i * DF_ALIGN], DF_ALIGN) != FLASH_SUCCESS){
+				return -1;
+			}
+		}
+	}
+	return 1;
 }
 
 //*********
-// EEPROMに書き込みます
+// 1イレースブロックを消去します
 // エラーのときは-1を返す
 //*********
-int EEPFILE::epWrite(unsigned long addr,unsigned char data)
+int EEPFILE::eraseBlock(unsigned long addr)
 {
-	if (data != EEPROM.read(addr)){
-		return (EEPROM.write(addr, data) == FLASH_SUCCESS ? 1 : -1);
+	Programmed[addr / DF_ERASE_BLOCK_SIZE / 8] &= ~(1 << ((addr / DF_ERASE_BLOCK_SIZE) & 7));
+	EraseCount++;
+	if (flash_datarom_EraseBlock(DF_ADDRESS + addr) != FLASH_SUCCESS){
+		return -1;
+	}
+	Erased[addr / DF_ERASE_BLOCK_SIZE / 8] |= 1 << ((addr / DF_ERASE_BLOCK_SIZE) & 7);
+
+	//ファイルに使うセクタの消去回数を数えます
+	int sect = addr / EEPSECTOR_SIZE;
+	if (sect >= EEPSTASECT && sect <= EEPENDSECT){
+		addWear(sect);
 	}
 	return 1;
 }
 
+//*********
+// addrを含むイレースブロックのブランクの箇所を調べます
+// ブランクの箇所をDF_ALIGN単位のビットで返します
+// ブランクの箇所が無ければ確認済みにして、以後はブランクチェックしません
+//*********
+unsigned short EEPFILE::blankMask(unsigned long addr)
+{
+	unsigned long blk = addr & DF_BLOCK_MASK;
+	unsigned char bit = 1 << ((blk / DF_ERASE_BLOCK_SIZE) & 7);
+
+	if ((Programmed[blk / DF_ERASE_BLOCK_SIZE / 8] & bit) != 0){
+		return 0;
+	}
+	if ((Erased[blk / DF_ERASE_BLOCK_SIZE / 8] & bit) != 0){
+		return 0xFFFF;
+	}
+
+	unsigned short blank = 0;
+	for (int i = 0; i < EEPBLOCK_UNITS; i++){
+		if (flash_datarom_blankcheck(DF_ADDRESS + blk + i * DF_ALIGN) == 0){
+			blank |= 1 << i;
+		}
+	}
+
+	if (blank == 0){
+		Programmed[blk / DF_ERASE_BLOCK_SIZE / 8] |= bit;
+	}
+	else if (blank == 0xFFFF){
+		Erased[blk / DF_ERASE_BLOCK_SIZE / 8] |= bit;
+	}
+	return blank;
+}
+
+//*********
+// EEPROMからlenバイトをbufに読み込みます
+// データフラッシュのメモリから直接コピーし、ブランクの箇所は0xFFとします
+//*********
+int EEPFILE::flashRead(unsigned long addr, char *buf, int len)
+{
+	int cnt = 0;
+	while (cnt < len){
+		unsigned long blk = addr & DF_BLOCK_MASK;
+		int pos = addr - blk;
+		int n = DF_ERASE_BLOCK_SIZE - pos;
+		if (n > len - cnt){
+			n = len - cnt;
+		}
+
+		unsigned short blank = blankMask(blk);
+		if (blank == 0){
+			memcpy(buf + cnt, (const void*)(DF_ADDRESS + addr), n);
+		}
+		else{
+			for (int i = 0; i < n; i++){
+				if ((blank & (1 << ((pos + i) / DF_ALIGN))) != 0){
+					buf[cnt + i] = 0xFF;
+				}
+				else{
+					buf[cnt + i] = *(volatile char *)(DF_ADDRESS + addr + i);
+				}
+			}
+		}
+		cnt += n;
+		addr += n;
+	}
+	return cnt;
+}
+
 //*********
 // EEPROMが初期化状態(FFFFで埋まっている)であれば、0を返します
 //*********
 int EEPFILE::isReady()
 {
-unsigned short sect;
+unsigned char buf[DF_ERASE_BLOCK_SIZE];
 
-	for (int i=0; i<EEPSECTORS; i++){
-		sect = EEPROM.read( EEPFAT_START + i*2 ) + (EEPROM.read( EEPFAT_START + i*2 + 1 )<<8);
-		
-		if(sect != 0xFFFF){ return 1; }
+	for (int add=0; add<EEPFAT_SIZE; add+=DF_ERASE_BLOCK_SIZE){
+		EEPROM.read( EEPFAT_START + add, buf, DF_ERASE_BLOCK_SIZE );
+
+		for (int i=0; i<DF_ERASE_BLOCK_SIZE; i++){
+			if(buf[i] != 0xFF){ return 1; }
+		}
 	}
 	return 0;
 }
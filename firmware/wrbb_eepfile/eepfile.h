@@ -11,13 +11,38 @@
 #define _EEPFILE_H_ 1
 
 #include <Arduino.h>
+#include "EEPROM/utility/r_flash_api_rx600.h"
 
 #define EEPFILENAME_SIZE	32
 
+#define EEPSIZE			0x8000
+#ifndef EEPSECTOR_SIZE
+#define EEPSECTOR_SIZE	512		//セクタサイズ。128, 256, 512のどれか。小さいファイルが多いときは小さくする
+#endif
+#define EEPSECTORS		(EEPSIZE / EEPSECTOR_SIZE)
+
+#if EEPSECTOR_SIZE != 128 && EEPSECTOR_SIZE != 256 && EEPSECTOR_SIZE != 512
+#error "EEPSECTOR_SIZE must be 128, 256 or 512"
+#endif
+
 #define EEP_CLOSE	0		//オープンしていない
 #define EEP_READ	1		//READオープン
 #define EEP_WRITE	2		//WRITEオープン
 #define EEP_APPEND	3		//APPENDオープン
+#define EEP_COMPRESS	0x10	//EEP_WRITEに足すと圧縮して保存する
+#define EEP_RING	0x20	//EEP_WRITE(新規)かEEP_APPEND(無ければ作る)に足すとリングログのファイルにする
+
+#define EEPRING_RECSIZE	28	//リングログの1レコードの最大バイト数
+
+#define EEPKV_KEYSIZE	16		//KVSのキーの最大バイト数
+#define EEPKV_VALSIZE	256		//KVSの値の最大バイト数
+#define EEPPUSH_SIZE	0x100	//System.push/popの領域のバイト数
+
+//圧縮ファイルの符号化・復号の状態
+typedef struct EEPZIP EEPZIP;
+
+//fimport()のコピー元から、bufに最大lenバイト読み込む関数。読み込んだバイト数を返し、終わりのときは0以下を返す
+typedef int (*EEPSOURCE)(void *src, char *buf, int len);
 
 //EEPファイル構造体
 typedef struct {
@@ -25,6 +50,16 @@ typedef struct {
 	unsigned short filesize;
 	unsigned short offsetaddress;
 	unsigned short seek;
+	short cursector;						//前回アクセスしたセクタ番号。-1のときは未確定
+	unsigned short curindex;				//cursectorがファイルの何セクタ目か
+	long bufaddress;						//書き込みバッファに保持しているイレースブロックのアドレス。-1のときは空
+	unsigned short bufmask;					//書き込みバッファで書き換えた箇所(DF_ALIGN単位のビット)
+	unsigned short bufblank;				//書き込みバッファを読み込んだときにブランクだった箇所(DF_ALIGN単位のビット)
+	unsigned char buf[DF_ERASE_BLOCK_SIZE];	//書き込みバッファ
+	EEPZIP *zip;							//圧縮ファイルの符号化・復号の状態。圧縮ファイルでなければNULL
+	short oldsector;						//fclose()で置き換える元のファイルの先頭セクタ。-1のときは無し
+	unsigned short ringblock;				//リングログの今読み書きしているブロック。リングログのときはfilesizeがブロック数、seekがブロック内の位置
+	unsigned short ringseq;					//リングログの今のブロックの通番
 } FILEEEP;
 
 enum EEPFILE_seek { EEP_SEEKTOP, EEP_SEEKCUR, EEP_SEEKEND };
@@ -35,33 +70,111 @@ class EEPFILE
 	void begin(void){	begin(0);	}
 	void format(void){	begin(1);	}
 	void begin(int clear);
-	int fopen(FILEEEP *file, const char *filename, char mode);
+	int fopen(FILEEEP *file, const char *filename, char mode){	return fopen(file, filename, mode, 0);	}
+	int fopen(FILEEEP *file, const char *filename, char mode, int size);
 	int fdelete(const char *filename);
+	int fdefrag(void);
 	int fcopy(const char *srcfilename, const char *dstfilename);
+	int fimport(const char *filename, EEPSOURCE source, void *src, int size);
 	int ffilesize(const char *filename);
 	int fseek(FILEEEP *file, int offset, int origin);
+	int ftruncate(FILEEEP *file, int size);
 	int fwrite(FILEEEP *file, char dat);
 	int fwrite(FILEEEP *file, char *arry, int *len);
 	int fread(FILEEEP *file);
+	int fread(FILEEEP *file, char *buf, int len);
 	void fclose(FILEEEP *file);
+	void fabort(FILEEEP *file);
+	const char *fmap(FILEEEP *file);
+	int fverify(FILEEEP *file);
+	int fputrec(FILEEEP *file, const char *data, int len);
+	int fgetrec(FILEEEP *file, char *buf, int size);
+	int kvSet(const char *key, int klen, const char *val, int vlen);
+	int kvGet(const char *key, int klen, char *buf, int size);
+	int kvDelete(const char *key, int klen);
+	int kvPush(int address, const char *data, int len);
+	int kvPop(int address, char *buf, int len);
 	int fexist(const char *filename);
 	bool fEof(FILEEEP *file);
+	bool fCrc(FILEEEP *file);
 	int fdir(int sect, char *filename);
 	void viewFat(void);
 	void viewSector(int sect);
+	int wearLevel(void);
+	int idle(void);
+	void wait(unsigned long msec);
 
   private:
+	void closeFile(FILEEEP *file, bool stamp);
+	int rawWrite(FILEEEP *file, char dat);
+	int rawWrite(FILEEEP *file, const char *arry, int len);
+	int copyIn(FILEEEP *fdst, EEPSOURCE source, void *src);
+	int rawRead(FILEEEP *file);
+	int rawRead(FILEEEP *file, char *buf, int len);
+	int fileSize(int sect);
+	unsigned short dataCrc(FILEEEP *file);
+	int ringCreate(FILEEEP *file, const char *filename, int size);
+	void ringOpen(FILEEEP *file, bool append);
+	unsigned long ringAddr(FILEEEP *file, int blk);
+	int ringSeq(FILEEEP *file, int blk);
+	int ringRecord(unsigned long addr, int pos, char *buf);
+	bool unitBlank(unsigned long addr);
+	void kvLoad(void);
+	void kvFormat(void);
+	int kvCheck(int n, unsigned short *seq);
+	void kvScan(void);
+	int kvFind(const char *key, int klen);
+	int kvPut(const char *key, int klen, const char *val, int vlen);
+	int kvCompact(int skip, const unsigned char *hd, const char *key, const char *val);
+	int kvRecSize(unsigned long addr, bool check);
+	bool kvSame(unsigned long addr, const char *val, int vlen);
+	int kvRecord(unsigned long addr, const unsigned char *hd, const char *key, const char *val);
+	int kvHead(int n, unsigned short seq);
+	int kvErase(int n);
+	int kvProgram(unsigned long addr, const unsigned char *data, int len);
+	int zipPut(FILEEEP *file, char dat);
+	int zipToken(FILEEEP *file);
+	int zipGroup(FILEEEP *file);
+	int zipFlush(FILEEEP *file);
+	int zipGet(FILEEEP *file);
+	int zipIn(FILEEEP *file);
+	void zipRewind(FILEEEP *file);
+	int zipSeek(FILEEEP *file, int offset, int origin);
 	int getFilename(int sect, char *filename);
 	int scanFilename(const char *filename);
+	unsigned short nameHash(const char *filename, int len);
+	void setIndex(int sect);
 	int scanEmptySector(int start);
+	int scanEmptyRun(int need);
+	void trimSect(FILEEEP *file);
+	void addWear(int sect);
+	int moveSector(int src, int dst);
+	void linkSector(int src, int dst);
 	void setFile( FILEEEP *file, const char *filename, int sect, int mode);
+	void freeSect(int sect);
+	void dropOld(FILEEEP *file);
 	void saveFat(void);
+	void fatBlock(int b, unsigned char *buf);
+	int fatStarted(unsigned long addr);
+	int checkFat(unsigned long addr, unsigned long *seq);
+	void loadFat(unsigned long addr);
+	int moveReserved(bool copy);
 	int getSect(FILEEEP *file, int *add);
-	int epWrite(unsigned long addr,unsigned char data);
+	int flashRead(unsigned long addr, char *buf, int len);
+	unsigned short blankMask(unsigned long addr);
+	int bufWrite(FILEEEP *file, unsigned long addr, unsigned char data);
+	int bufWrite(FILEEEP *file, unsigned long addr, const unsigned char *data, int len);
+	int bufFlush(FILEEEP *file);
+	int blockWrite(unsigned long addr, unsigned char *buf, unsigned short mask, unsigned short blank);
+	int unitWrite(unsigned long addr, const unsigned char *buf, unsigned short mask);
+	int eraseBlock(unsigned long addr);
 	int isReady();
 };
 
 extern EEPFILE	EEP;
 
+//CRC-16(CCITT)を求めます。最初はcrcに0xFFFFを渡します
+unsigned short crc16(unsigned short crc, const unsigned char *p, int len);
+
 #endif // _EEPFILE_H_
 
@@ -21,13 +21,56 @@
 #include "../wrbb.h"
 
 #define COMMAND_LENGTH	32
+#define UPLOAD_BUF_SIZE	256		//ファイル受信のバッファ1面のバイト数。2面使う
+
+//Bコマンドのフレーム転送で使う制御コード
+#define FRAME_STX	0x02		//フレームの先頭
+#define FRAME_ENQ	0x05		//受信の準備ができた
+#define FRAME_ACK	0x06		//続く通番までのフレームを受け取った
+#define FRAME_NAK	0x15		//続く通番から送り直してほしい
+#define FRAME_CAN	0x18		//転送を中止した
+#define FRAME_TIMEOUT	5000	//フレームを待つ最大時間(msec)
+#define FRAME_IDLE		100		//フレームの途中やNAKのあとで、これだけ止まったらNAKを送り直す(msec)
+
+//フレームで受け取ったデータを順に受け取る関数。続けられないエラーのときは-1を返す
+typedef int (*FRAMESINK)(void *ctx, char *buf, int len);
+
+#define MANIFEST_LINE	64		//マニフェストの1行の最大バイト数
+#define MANIFEST_REPORT	512		//マニフェストの結果の最大バイト数
+
+//Pコマンドでマニフェストを実行している状態
+typedef struct {
+	int state;						//0:行を読む, 1:ファイルのデータを書く, 2:ファイルのデータを読み飛ばす
+	char line[MANIFEST_LINE];		//読んでいる行
+	int len;						//読んでいる行のバイト数
+	FILEEEP fp;						//書いているファイル
+	char name[EEPFILENAME_SIZE];	//書いているファイルの名前
+	int rest;						//ファイルのデータの残りのバイト数
+	unsigned short crc;				//受け取ったファイルのデータのCRC
+	unsigned short want;			//マニフェストに書いてあるCRC
+	int ok;							//成功した行の数
+	int ng;							//失敗した行の数
+	char run[EEPFILENAME_SIZE + 4];	//最後に実行するファイル。無ければ空
+	char report[MANIFEST_REPORT];	//結果
+	int rlen;						//結果のバイト数
+} MANIFEST;
+
+#define DELTA_BLOCK	512		//Iコマンドでハッシュを求め、Jコマンドで書き換えるブロックのバイト数
+
+//Jコマンドで変わったブロックを書き換えている状態
+typedef struct {
+	FILEEEP fp;			//書き換えているファイル
+	int size;			//新しいファイルサイズ
+	int hdr;			//受け取ったブロック番号のバイト数
+	int blk;			//ブロック番号
+	int rest;			//ブロックのデータの残りのバイト数。0のときはブロック番号を待っている
+} DELTA;
 
 extern char RubyFilename[];
-extern uint8_t RubyCode[];
 
-
-char *WriteData = (char*)RubyCode;
 char CommandData[COMMAND_LENGTH];
+char UploadBuf[2][UPLOAD_BUF_SIZE];	//ファイル受信のバッファ
+MANIFEST Manifest;
 bool StopFlg = false;				//強制終了フラグ
 bool AutoPrintSwitchFlg = true;		//'>'の自動送信フラグ
 
@@ -43,13 +86,16 @@ HardwareSerial *USB_Serial = &Serial;
 
 //**************************************************
 // ライン入力
+// USBの受信は割り込みで受信バッファに入るので、ここでは待ち時間を入れずに読みます
+// 入力が無い間はEEP.idle()で空きセクタを1ブロックずつ消去します。idle()は1回に1ブロックの
+// ブランクチェックと消去しかしないので、入力が来てから処理するまでの遅れはその1回分までです
+// セクタを移す静的ウェアレベリングは、消去が続くのでidle()では行いません(fclose()で行います)
 //**************************************************
 void lineinput(char *arry)
 {
 	int len = 0; 
 	int k = 0;
 	arry[len] = 0;
-	int loopCnt = 0;
 
 	k = USB_Serial->read();
 	DEBUG_PRINT("0:USB_Serial->read", k);
@@ -58,9 +104,9 @@ void lineinput(char *arry)
 		arry[len] = 0x0D;
 	}
 
+	//前のコマンドの間に届いていた入力を捨てます
 	while(k >= 0){
 		k = USB_Serial->read();
-		delay(4);
 		DEBUG_PRINT("1:USB_Serial->read", k);
 	}
 
@@ -69,17 +115,20 @@ void lineinput(char *arry)
 		return;
 	}
 
-	int cnt = 0;
+	bool idle = true;						//消去する空きセクタが残っているかもしれない
+	unsigned long tm = millis() + 1000;		//次に'>'を送る時刻
 	while(true){
-		k = 0;
-		while(k <= 0 ){
-			k = USB_Serial->read();
-			delay(8);
-			if (cnt >= 125 && AutoPrintSwitchFlg == true){
+		k = USB_Serial->read();
+		while(k <= 0){
+			//入力を待っている間に、空きセクタを消去しておきます
+			if(idle){
+				idle = (EEP.idle() != 0);
+			}
+			if (AutoPrintSwitchFlg == true && (long)(millis() - tm) >= 0){
 				USB_Serial->print(">");
-				cnt = 0;
+				tm = millis() + 1000;
 			}
-			cnt++;
+			k = USB_Serial->read();
 		}
 		DEBUG_PRINT("2:USB_Serial->read", k);
 
@@ -164,8 +213,15 @@ int HexText2Int(char t0, char t1)
 //   V:テキスト読みこみ(mrbファイルがテキスト化されて送られてくるとみなす) '0A' '0B' ...
 //
 //   X,Vは読み込み後、実行される
+//   X,VでRUBY_CODE_SIZEより大きいファイルは、データフラッシュ上で実行できる(圧縮せず、セクタが連続している)ときだけ実行する
+// compress
+//   trueのときは圧縮して保存する
+//
+// 受信したデータは2面のバッファに交互に溜めて、溜まった面をイレースブロック分ずつ書き込みます
+// 1ブロック書き込むごとに受信を進めるので、書き込み中に届いたデータで次の面を埋められます
+// ファイル全体をRAMに置かないので、ファイルサイズはヒープの空きに制限されません
 //**************************************************
-bool writefile(const char *fname, int size, char code, char *readData)
+bool writefile(const char *fname, int size, char code, bool compress)
 {
 	FILEEEP fpj;
 	FILEEEP *fp = &fpj;
@@ -181,7 +237,9 @@ bool writefile(const char *fname, int size, char code, char *readData)
 
 	if(binsize <= 0){ return result; }
 
-	if(binsize>=RUBY_CODE_SIZE && (code == 'X' || code == 'V')){
+	//圧縮したファイルは必ずRubyCodeに展開して実行するので、RUBY_CODE_SIZEより大きいと実行できません
+	bool run = (code == 'X' || code == 'V');
+	if(run && compress && binsize > RUBY_CODE_SIZE){
 		return result;
 	}
 
@@ -195,69 +253,733 @@ bool writefile(const char *fname, int size, char code, char *readData)
 	}
 	USB_Serial->println();
 
-	int cnt = 0;
+	USB_Serial->print(fname);
+	USB_Serial->print("(");
+	USB_Serial->print(binsize);
+	USB_Serial->print(") Saving");
+
+	if(EEP.fopen(fp, fname, compress ? (EEP_WRITE | EEP_COMPRESS) : EEP_WRITE, binsize) == -1){
+		USB_Serial->println("..File Open Error!");
+		return result;
+	}
+
+	int fill = 0;		//受信中の面
+	int pos = 0;		//受信中の面に溜めたバイト数
+	int wface = -1;		//書き込み中の面。-1のときは無し
+	int wlen = 0;		//書き込み中の面のバイト数
+	int wpos = 0;		//書き込み中の面の書き込んだバイト数
+	int cnt = 0;		//受信したバイト数(テキストのときは変換後のバイト数)
+	int saved = 0;		//書き込んだバイト数
+	int hi = -1;		//テキストのときの上位の文字。-1のときは無し
+	bool timeout = false;
 	int len;
-	char c;
-	tm = millis() + 2000;
 
-	while(cnt < size){
+	result = true;
+	tm = millis() + 2000;
+	while(saved < binsize){
+		//****受信
 		len = USB_Serial->available();
-		if (len > 0){
-			for(int i=0; i<len; i++){
-				readData[cnt + i] = (char)USB_Serial->read();
-			}
-			cnt += len;
+		if(len > 0){
 			tm = millis() + 2000;
 		}
-		if(tm < millis()){	break;	}
+		while(len > 0 && cnt < binsize && pos < UPLOAD_BUF_SIZE){
+			int c = USB_Serial->read();
+			len--;
+
+			//b2aFlgが 0 のときはバイナリ、1 のときはバイナリが2バイトテキストで送られてくる
+			if(b2aFlg == 0){
+				//****バイナリ
+				UploadBuf[fill][pos++] = (char)c;
+				cnt++;
+			}
+			else if(hi == -1){
+				hi = c;
+			}
+			else{
+				//****テキスト
+				UploadBuf[fill][pos++] = (char)HexText2Int((char)hi, (char)c);
+				hi = -1;
+				cnt++;
+			}
+		}
+
+		//受信中の面が埋まったら、書き込む面に回します
+		if(wface == -1 && pos > 0 && (pos == UPLOAD_BUF_SIZE || cnt == binsize)){
+			wface = fill;
+			wlen = pos;
+			wpos = 0;
+			fill ^= 1;
+			pos = 0;
+		}
+
+		//****イレースブロック分を書き込む
+		if(wface != -1){
+			len = wlen - wpos;
+			if(len > DF_ERASE_BLOCK_SIZE){
+				len = DF_ERASE_BLOCK_SIZE;
+			}
+			if(EEP.fwrite(fp, &UploadBuf[wface][wpos], &len) == -1){
+				USB_Serial->println("..Save Error!");
+				result = false;
+				break;
+			}
+			if(((saved + len) / 256) != (saved / 256)){
+				USB_Serial->print(".");
+			}
+			wpos += len;
+			saved += len;
+			if(wpos >= wlen){
+				wface = -1;
+			}
+			continue;
+		}
+
+		if(tm < millis()){
+			timeout = true;
+			break;
+		}
 	}
 
-	if(tm < millis()){
-		USB_Serial->println("..Read Error!");
+	//途中で受信が止まったときは、受信できた部分を保存します
+	if(timeout){
+		if(pos > 0){
+			EEP.fwrite(fp, UploadBuf[fill], &pos);
+		}
+		result = false;
+		USB_Serial->print("..Read Error! Saved the reading part");
 	}
+	EEP.fclose(fp);
 
-	USB_Serial->print(fname);
-	USB_Serial->print("(");
-	USB_Serial->print(binsize);
+	//RUBY_CODE_SIZEより大きいファイルは、セクタが連続していてデータフラッシュ上で実行できるときだけ実行します
+	if(result && run && binsize > RUBY_CODE_SIZE){
+		if(EEP.fopen(fp, fname, EEP_READ) == -1){
+			result = false;
+		}
+		else{
+			result = (EEP.fmap(fp) != NULL);
+			EEP.fclose(fp);
+		}
+		if(!result){
+			USB_Serial->print("..Too large to run from fragmented sectors");
+		}
+	}
 
-	if(tm < millis()){
-		USB_Serial->print(") Saving the reading part");
+	USB_Serial->println(".");
+	
+	return result;
+}
+
+//**************************************************
+// フレームの受信結果を送ります
+//**************************************************
+void framereply(char code, int seq)
+{
+	USB_Serial->write((unsigned char)code);
+	USB_Serial->write((unsigned char)seq);
+	USB_Serial->flush();
+}
+
+//**************************************************
+// フレームを受信して、受け取ったデータを順にsinkに渡します
+// ENQを送ってから受信を始めます
+//
+// フレーム: STX 通番(1) 長さ(2) データ(長さ分) CRC16(2)
+//   長さとCRCは下位バイトから。CRCは通番からデータの終わりまでのCRC-16(CCITT)
+//   データは最大UPLOAD_BUF_SIZEバイト。長さ0のフレームがデータの終わり
+// 応答:
+//   ACK 通番   その通番までを受け取った
+//   NAK 通番   CRCの誤りか抜けがあったので、その通番から送り直してほしい
+//   CAN コード 中止した(1:オープン, 2:書き込み, 3:タイムアウト, 4:サイズ違い)
+//
+// 送る側は、ACKを待たずにいくつかのフレームを続けて送れます(Go-Back-N)
+// 受け取ったフレームは2面のバッファに交互に入れて、sinkに渡している間に次のフレームを受信します
+//
+// 終わりのフレームにはACKを返さずに、受け取ったバイト数を返し、その通番を*eofseqに入れます
+// 呼び出し側で後始末が済んでから、ACKを送ってください
+// sinkが-1を返したときとタイムアウトのときは、CANを送って-1を返します
+//**************************************************
+int framereceive(FRAMESINK sink, void *ctx, int *eofseq)
+{
+	unsigned long tm;
+	unsigned long idle;
+
+	USB_Serial->write((unsigned char)FRAME_ENQ);
+	USB_Serial->flush();
+
+	int fill = 0;			//受信中の面
+	int state = 0;			//0:STX待ち, 1:通番, 2,3:長さ, 4:データ, 5,6:CRC
+	int seq = 0;			//受信中のフレームの通番
+	int flen = 0;			//受信中のフレームの長さ
+	int pos = 0;			//受信中のフレームのデータのバイト数
+	unsigned short crc = 0;	//受信中のフレームのCRC
+	bool ready = false;		//受信中の面に正しいフレームがそろった
+	int expect = 0;			//次に受け取る通番
+	bool naked = false;		//NAKを送って、送り直しを待っている
+	bool eof = false;		//終わりのフレームを受け取った
+	int wface = -1;			//sinkに渡している面。-1のときは無し
+	int wlen = 0;			//sinkに渡している面のバイト数
+	int wpos = 0;			//sinkに渡し終わったバイト数
+	int total = 0;			//受け取ったバイト数
+	int len;
+
+	tm = millis() + FRAME_TIMEOUT;
+	idle = millis() + FRAME_IDLE;
+	while(true){
+		//****受信。そろったフレームをsinkに回すまでは、次を読みません
+		while(!ready && USB_Serial->available() > 0){
+			unsigned char c = (unsigned char)USB_Serial->read();
+			tm = millis() + FRAME_TIMEOUT;
+			idle = millis() + FRAME_IDLE;
+
+			switch(state){
+			case 0:
+				if(c == FRAME_STX){ state = 1; }
+				break;
+			case 1:
+				seq = c;
+				crc = crc16(0xFFFF, &c, 1);
+				state = 2;
+				break;
+			case 2:
+				flen = c;
+				crc = crc16(crc, &c, 1);
+				state = 3;
+				break;
+			case 3:
+				flen += c << 8;
+				crc = crc16(crc, &c, 1);
+				pos = 0;
+				state = (flen == 0) ? 5 : 4;
+				if(flen > UPLOAD_BUF_SIZE){
+					//長さが壊れている
+					state = 0;
+					if(!naked){
+						framereply(FRAME_NAK, expect & 0xFF);
+						naked = true;
+					}
+				}
+				break;
+			case 4:
+				UploadBuf[fill][pos++] = (char)c;
+				crc = crc16(crc, &c, 1);
+				if(pos >= flen){ state = 5; }
+				break;
+			case 5:
+				crc ^= c;
+				state = 6;
+				break;
+			default:
+				crc ^= c << 8;
+				state = 0;
+				if(crc != 0 || seq != (expect & 0xFF)){
+					//CRCの誤りか、抜けがあった。送り直しの頭が届くまで、NAKは1回だけ送ります
+					if(crc == 0 && ((expect - seq) & 0xFF) <= 0x80){
+						framereply(FRAME_ACK, (expect - 1) & 0xFF);	//受け取り済みのフレームが再送された
+					}
+					else if(!naked){
+						framereply(FRAME_NAK, expect & 0xFF);
+						naked = true;
+					}
+				}
+				else{
+					ready = true;
+					naked = false;
+				}
+				break;
+			}
+		}
+
+		//****そろったフレームをsinkに渡す面に回して、ACKを返します
+		if(ready && wface == -1){
+			ready = false;
+			if(flen == 0){
+				eof = true;
+			}
+			else{
+				wface = fill;
+				wlen = flen;
+				wpos = 0;
+				total += flen;
+				fill ^= 1;
+				framereply(FRAME_ACK, expect & 0xFF);
+				expect++;
+			}
+		}
+
+		//****イレースブロック分ずつsinkに渡す
+		if(wface != -1){
+			len = wlen - wpos;
+			if(len > DF_ERASE_BLOCK_SIZE){
+				len = DF_ERASE_BLOCK_SIZE;
+			}
+			if(sink(ctx, &UploadBuf[wface][wpos], len) == -1){
+				framereply(FRAME_CAN, 2);
+				return -1;
+			}
+			wpos += len;
+			if(wpos >= wlen){
+				wface = -1;
+			}
+			continue;
+		}
+
+		//****すべてsinkに渡し終わった
+		if(eof){
+			*eofseq = expect & 0xFF;
+			return total;
+		}
+
+		if(tm < millis()){
+			framereply(FRAME_CAN, 3);
+			return -1;
+		}
+
+		//長さが壊れてフレームの途中で止まったときや、送り直しの頭が壊れたときは、もう一度NAKを送ります
+		if((state != 0 || naked) && idle < millis()){
+			state = 0;
+			framereply(FRAME_NAK, expect & 0xFF);
+			naked = true;
+			idle = millis() + FRAME_IDLE;
+		}
+	}
+}
+
+//**************************************************
+// ファイルに書き込むsink
+//**************************************************
+int filesink(void *ctx, char *buf, int len)
+{
+	return EEP.fwrite((FILEEEP*)ctx, buf, &len);
+}
+
+//**************************************************
+// フレーム転送でファイルを保存します
+// B Filename Size [Z] のあとに、ENQを送ってフレームを待ちます
+// 終わりのフレームへのACKはファイルを閉じてから送ります
+// 失敗したときは元のファイルがそのまま残ります
+//**************************************************
+bool framefile(const char *fname, int size, bool compress)
+{
+	FILEEEP fpj;
+	FILEEEP *fp = &fpj;
+	int seq;
+
+	USB_Serial->println();
+
+	//シリアルバッファ消去
+	while(USB_Serial->available()){ USB_Serial->read();	}
+
+	if(EEP.fopen(fp, fname, compress ? (EEP_WRITE | EEP_COMPRESS) : EEP_WRITE, size) == -1){
+		framereply(FRAME_CAN, 1);
+		return false;
+	}
+
+	int total = framereceive(filesink, fp, &seq);
+	if(total == -1){
+		EEP.fabort(fp);
+		return false;
+	}
+	if(total != size){
+		EEP.fabort(fp);
+		framereply(FRAME_CAN, 4);
+		return false;
+	}
+	EEP.fclose(fp);
+	framereply(FRAME_ACK, seq);
+	return true;
+}
+
+//**************************************************
+// マニフェストの結果を1行追加します
+//**************************************************
+void manifestReport(MANIFEST *m, bool ok, char op, const char *name, const char *why)
+{
+	char line[MANIFEST_LINE];
+	int len = snprintf(line, sizeof(line), "%s %c %s%s%s\r\n", ok ? "OK" : "NG", op, name, why[0] != 0 ? " " : "", why);
+
+	if(ok){
+		m->ok++;
 	}
 	else{
-		USB_Serial->print(") Saving");
+		m->ng++;
+	}
+	if(len > 0 && m->rlen + len < MANIFEST_REPORT){
+		memcpy(&m->report[m->rlen], line, len);
+		m->rlen += len;
 	}
+}
 
-	if(EEP.fopen(fp, fname, EEP_WRITE) == -1){
-		USB_Serial->println("..File Open Error!");
-		return result;
+//**************************************************
+// 受け取り終わったファイルを、CRCが合っていれば保存します
+// 合っていなければ元のファイルを残します
+//**************************************************
+void manifestClose(MANIFEST *m)
+{
+	if(m->crc == m->want){
+		EEP.fclose(&m->fp);
+		manifestReport(m, true, 'W', m->name, "");
+	}
+	else{
+		EEP.fabort(&m->fp);
+		manifestReport(m, false, 'W', m->name, "CRC");
 	}
+}
 
-	result = true;
-	for(int i=0; i<binsize; i++){
-		//b2aFlgが 0 のときはバイナリ、1 のときはバイナリが2バイトテキストで送られてくる
-		if(b2aFlg == 0){
-			//****バイナリ
-			c = readData[i];
+//**************************************************
+// マニフェストの1行を実行します
+//   D Filename                   ファイルを削除する
+//   W Filename Size CRC16 [Z]    続くSizeバイトをファイルに保存する。CRC16は16進数
+//   R Filename                   全部成功したら、最後にこのファイルを実行する
+//   #で始まる行と空の行は読み飛ばす
+//**************************************************
+void manifestLine(MANIFEST *m)
+{
+	char *fs[5];
+	int j = 0;
+
+	//スペースを0に変えて、ポインタを取得
+	char *p = m->line;
+	while(*p != 0 && j < 5){
+		while(*p == ' '){	*p++ = 0;	}
+		if(*p == 0){	break;	}
+		fs[j++] = p;
+		while(*p != ' ' && *p != 0){	p++;	}
+	}
+	if(j == 0 || fs[0][0] == '#'){
+		return;
+	}
+
+	char op = fs[0][0];
+	if(j < 2 || fs[0][1] != 0 || strlen(fs[1]) >= EEPFILENAME_SIZE){
+		manifestReport(m, false, op, j < 2 ? "" : fs[1], "SYNTAX");
+		return;
+	}
+
+	if(op == 'D'){
+		EEP.fdelete(fs[1]);
+		manifestReport(m, !EEP.fexist(fs[1]), op, fs[1], "");
+	}
+	else if(op == 'W' && j >= 4){
+		strcpy(m->name, fs[1]);
+		m->rest = atoi(fs[2]);
+		m->want = (unsigned short)strtoul(fs[3], NULL, 16);
+		m->crc = 0xFFFF;
+		bool compress = (j > 4 && fs[4][0] == 'Z');
+
+		if(EEP.fopen(&m->fp, m->name, compress ? (EEP_WRITE | EEP_COMPRESS) : EEP_WRITE, m->rest) == -1){
+			manifestReport(m, false, op, m->name, "OPEN");
+			m->state = 2;
 		}
 		else{
-			//****テキスト
-			c = (char)HexText2Int(readData[2*i], readData[2*i + 1]);
+			m->state = 1;
+		}
+		if(m->rest <= 0){
+			if(m->state == 1){
+				manifestClose(m);
+			}
+			m->state = 0;
 		}
+	}
+	else if(op == 'R'){
+		strcpy(m->run, fs[1]);
 
-		if(EEP.fwrite(fp, c) == -1){
-			USB_Serial->println("..Save Error!");
-			result = false;
-			break;
+		int len = strlen(m->run);
+		if(len < 4 || m->run[len-4] != '.'
+			|| m->run[len-3] != 'm'
+			|| m->run[len-2] != 'r'
+			|| m->run[len-1] != 'b'){
+
+			strcat(m->run, ".mrb");
 		}
-		if((i % 256) == 0){
-			USB_Serial->print(".");
+		manifestReport(m, true, op, m->run, "");
+	}
+	else{
+		manifestReport(m, false, op, fs[1], "SYNTAX");
+	}
+}
+
+//**************************************************
+// マニフェストを受け取るsink
+// 行を読み、Wの行のあとはSizeバイトをファイルのデータとして扱います
+//**************************************************
+int manifestsink(void *ctx, char *buf, int len)
+{
+	MANIFEST *m = (MANIFEST*)ctx;
+	int i = 0;
+
+	while(i < len){
+		if(m->state == 0){
+			//****行
+			char c = buf[i++];
+			if(c == '\n'){
+				m->line[m->len] = 0;
+				m->len = 0;
+				manifestLine(m);
+			}
+			else if(c != '\r' && m->len < MANIFEST_LINE - 1){
+				m->line[m->len++] = c;
+			}
+			continue;
+		}
+
+		//****ファイルのデータ
+		int n = len - i;
+		if(n > m->rest){
+			n = m->rest;
+		}
+		if(m->state == 1){
+			m->crc = crc16(m->crc, (const unsigned char*)&buf[i], n);
+			int w = n;
+			if(EEP.fwrite(&m->fp, &buf[i], &w) == -1){
+				EEP.fabort(&m->fp);
+				manifestReport(m, false, 'W', m->name, "WRITE");
+				m->state = 2;
+			}
+		}
+		i += n;
+		m->rest -= n;
+		if(m->rest == 0){
+			if(m->state == 1){
+				manifestClose(m);
+			}
+			m->state = 0;
 		}
 	}
+	return 0;
+}
+
+//**************************************************
+// マニフェストを実行します
+// P のあとに、ENQを送ってマニフェストをフレームで受け取ります(フレームはframereceive()を参照)
+// 受け取りながら1行ずつ実行して、終わりのフレームへのACKのあとに結果を送ります
+//   OK|NG 操作 ファイル名 [理由]   1行ごとの結果。理由はOPEN, WRITE, CRC, SHORT, SYNTAX
+//   END 成功の数 失敗の数
+// 戻り値: Rで実行するファイルがあり、全部成功したらtrue
+//**************************************************
+bool manifest(void)
+{
+	MANIFEST *m = &Manifest;
+	int seq;
+
+	USB_Serial->println();
+
+	//シリアルバッファ消去
+	while(USB_Serial->available()){ USB_Serial->read();	}
+
+	m->state = 0;
+	m->len = 0;
+	m->ok = 0;
+	m->ng = 0;
+	m->run[0] = 0;
+	m->rlen = 0;
+
+	int total = framereceive(manifestsink, m, &seq);
+	if(m->state == 1){
+		//ファイルのデータが途中で終わった
+		EEP.fabort(&m->fp);
+		if(total != -1){
+			manifestReport(m, false, 'W', m->name, "SHORT");
+		}
+	}
+	if(total == -1){
+		return false;
+	}
+
+	//最後の行に改行が無いとき
+	if(m->state == 0 && m->len > 0){
+		m->line[m->len] = 0;
+		manifestLine(m);
+		if(m->state == 1){
+			EEP.fabort(&m->fp);
+			manifestReport(m, false, 'W', m->name, "SHORT");
+		}
+	}
+	framereply(FRAME_ACK, seq);
+
+	USB_Serial->write((const uint8_t*)m->report, m->rlen);
+	USB_Serial->print("END ");
+	USB_Serial->print(m->ok);
+	USB_Serial->print(" ");
+	USB_Serial->println(m->ng);
+
+	return (m->run[0] != 0 && m->ng == 0);
+}
+
+//**************************************************
+// ファイルをDELTA_BLOCKバイトのブロックに分けて、ブロックごとのCRC16を送ります
+//   BLOCKS ファイルサイズ      無いファイルのときは-1
+//   ブロックごとのCRC16を4桁の16進数で続けた1行
+// 圧縮ファイルは元のデータのCRC16を送ります
+// fread()で読めないリングログは、サイズを0にしてCRC16を送りません
+// Jコマンドで、変わったブロックだけを送るために使います
+//**************************************************
+void blockhash(const char *fname)
+{
+	FILEEEP fpj;
+	FILEEEP *fp = &fpj;
+
+	USB_Serial->println();
+	USB_Serial->print("BLOCKS ");
+
+	if(EEP.fopen(fp, fname, EEP_READ) == -1){
+		USB_Serial->println(-1);
+		return;
+	}
+
+	//UPLOAD_BUF_SIZEずつ読んで、DELTA_BLOCKごとにCRC16を送ります
+	char *buf = UploadBuf[0];
+	char *hex = UploadBuf[1];
+	unsigned short crc = 0xFFFF;
+	int pos = 0;
+	int len = EEP.fread(fp, buf, UPLOAD_BUF_SIZE);
+	USB_Serial->println((len > 0) ? EEP.ffilesize(fname) : 0);
+	for(; len > 0; len = EEP.fread(fp, buf, UPLOAD_BUF_SIZE)){
+		crc = crc16(crc, (const unsigned char*)buf, len);
+		pos += len;
+		if(pos % DELTA_BLOCK == 0){
+			for(int i=0; i<4; i++){
+				hex[i] = "0123456789ABCDEF"[(crc >> (12 - 4 * i)) & 0x0F];
+			}
+			USB_Serial->write((const uint8_t*)hex, 4);
+			crc = 0xFFFF;
+		}
+	}
+	if(pos % DELTA_BLOCK != 0){
+		for(int i=0; i<4; i++){
+			hex[i] = "0123456789ABCDEF"[(crc >> (12 - 4 * i)) & 0x0F];
+		}
+		USB_Serial->write((const uint8_t*)hex, 4);
+	}
+	USB_Serial->println();
 	EEP.fclose(fp);
+}
 
-	USB_Serial->println(".");
-	
-	return result;
+//**************************************************
+// Jコマンドで受け取ったブロックを書き込むsink
+// ブロック番号のところへシークして、ブロックのデータを上書きします
+//**************************************************
+int deltasink(void *ctx, char *buf, int len)
+{
+	DELTA *d = (DELTA*)ctx;
+	int i = 0;
+
+	while(i < len){
+		if(d->rest == 0){
+			//****ブロック番号
+			d->blk |= (buf[i++] & 0xFF) << (8 * d->hdr);
+			if(++d->hdr < 2){
+				continue;
+			}
+
+			int pos = d->blk * DELTA_BLOCK;
+			d->rest = d->size - pos;
+			if(d->rest > DELTA_BLOCK){
+				d->rest = DELTA_BLOCK;
+			}
+			d->hdr = 0;
+			d->blk = 0;
+
+			//ファイルの後ろより先にはシークできないので、伸ばすときは後ろのブロックを順に送ってもらいます
+			if(d->rest <= 0 || EEP.fseek(&d->fp, pos, EEP_SEEKTOP) != pos){
+				return -1;
+			}
+			continue;
+		}
+
+		//****ブロックのデータ
+		int n = len - i;
+		if(n > d->rest){
+			n = d->rest;
+		}
+		if(EEP.fwrite(&d->fp, &buf[i], &n) == -1){
+			return -1;
+		}
+		i += n;
+		d->rest -= n;
+	}
+	return 0;
+}
+
+//**************************************************
+// 開いているファイルの先頭から最後までのCRC16を求めます
+//**************************************************
+unsigned short filecrc(FILEEEP *fp)
+{
+	unsigned short crc = 0xFFFF;
+	int len;
+
+	EEP.fseek(fp, 0, EEP_SEEKTOP);
+	while((len = EEP.fread(fp, UploadBuf[0], UPLOAD_BUF_SIZE)) > 0){
+		crc = crc16(crc, (const unsigned char*)UploadBuf[0], len);
+	}
+	return crc;
+}
+
+//**************************************************
+// 変わったブロックだけを受け取って、ファイルをその場で書き換えます
+// J Filename Size CRC16 のあとに、ENQを送ってフレームを待ちます(フレームはframereceive()を参照)
+//   データ: ブロック番号(2バイト、下位から) ブロックのデータ(DELTA_BLOCKバイト。最後のブロックは残りの分) の繰り返し
+//   ファイルを伸ばすときは、元のファイルサイズより後ろのブロックを全部送ってください
+// 書き換えたファイル全体のCRC16がCRC16(16進数)と合えば、終わりのフレームにACKを返します
+// CANのコードはframefile()と同じで、ほかに5:CRC違い
+//
+// 同じ内容のイレースブロックは書き込まないので、送られてこなかったブロックは消去しません
+// 元のファイルを残さずに書き換えます。途中で止まったときやサイズ、CRCが違うときは、
+// ヘッダのサイズとCRCを書き直さずに閉じるので、書き換えたファイルはfverify()で弾かれて実行されません
+// そのときは、Bコマンドでファイルを全部送り直してください
+// 圧縮ファイル、リングログ、CRCの無いファイルは書き換えられません(CAN 1)
+// CRCの無いファイルは、途中で止まってもfverify()で弾けないので、書き換えずに断ります
+//**************************************************
+bool deltafile(const char *fname, int size, unsigned short crc)
+{
+	DELTA dl;
+	DELTA *d = &dl;
+	int seq;
+
+	USB_Serial->println();
+
+	//シリアルバッファ消去
+	while(USB_Serial->available()){ USB_Serial->read();	}
+
+	//無いファイルはEEP_APPENDで作られてしまうので、先に確かめます
+	if(!EEP.fexist(fname) || EEP.fopen(&d->fp, fname, EEP_APPEND) == -1){
+		framereply(FRAME_CAN, 1);
+		return false;
+	}
+	if(!EEP.fCrc(&d->fp)){
+		EEP.fabort(&d->fp);
+		framereply(FRAME_CAN, 1);
+		return false;
+	}
+	d->size = size;
+	d->hdr = 0;
+	d->blk = 0;
+	d->rest = 0;
+
+	if(framereceive(deltasink, d, &seq) == -1){
+		EEP.fabort(&d->fp);
+		return false;
+	}
+
+	//小さくなったときは切り詰めます
+	if(d->fp.filesize > size){
+		EEP.ftruncate(&d->fp, size);
+	}
+
+	//サイズとCRCを確かめてから、ヘッダのサイズとCRCを書き直します
+	if(d->fp.filesize != size){
+		EEP.fabort(&d->fp);
+		framereply(FRAME_CAN, 4);
+		return false;
+	}
+	if(filecrc(&d->fp) != crc){
+		EEP.fabort(&d->fp);
+		framereply(FRAME_CAN, 5);
+		return false;
+	}
+	EEP.fclose(&d->fp);
+	framereply(FRAME_ACK, seq);
+	return true;
 }
 
 //**************************************************
@@ -311,18 +1033,31 @@ void readfile(const char *fname, char code)
 		return;
 	}
 
-	for(int i=0; i<binsize; i++){
-
+	//受信用のバッファに何ブロックか読み出して、まとめてUSBの送信バッファに渡します
+	//送信バッファのデータを割り込みでパケットにして送っている間に、次のブロックを読み出します
+	char *buf = UploadBuf[0];
+	char *hex = UploadBuf[1];
+	int len = EEP.fread(fp, buf, UPLOAD_BUF_SIZE);
+	while(len > 0){
 		if(code == 'G'){
-			USB_Serial->write((unsigned char)EEP.fread(fp));
+			USB_Serial->write((const uint8_t*)buf, len);
 		}
 		else{
-			int bin = EEP.fread(fp);
-			if(bin < 0x10){
-				USB_Serial->print("0");
+			//****テキスト。1バイトを2文字にするので、半分ずつ送ります
+			for(int i=0; i<len; i+=UPLOAD_BUF_SIZE/2){
+				int n = len - i;
+				if(n > UPLOAD_BUF_SIZE/2){
+					n = UPLOAD_BUF_SIZE/2;
+				}
+				for(int j=0; j<n; j++){
+					int bin = buf[i + j] & 0xFF;
+					hex[2*j] = "0123456789ABCDEF"[bin >> 4];
+					hex[2*j + 1] = "0123456789ABCDEF"[bin & 0x0F];
+				}
+				USB_Serial->write((const uint8_t*)hex, 2*n);
 			}
-			USB_Serial->print(bin, 16);
 		}
+		len = EEP.fread(fp, buf, UPLOAD_BUF_SIZE);
 	}
 	EEP.fclose(fp);
 }
@@ -463,21 +1198,87 @@ int fileloader(const char* str0, const char* str1)
 				}
 				strcpy(fname, fs[0]);
 				size = atoi(fs[1]);
+				bool compress = (j > 2 && fs[2][0] == 'Z');	//3つ目にZがあれば圧縮して保存する
+
+				//ファイルを保存します
+				writefile(fname, size, CommandData[0], compress);
 
-				//ヒープメモリの確保
-				char *readData = (char*)malloc(size);
-				if(readData == NULL){
-					USB_Serial->println("..Out of Memory!");
+				for(int i=0; i<j; i++){ *(fs[i] - 1) = ' '; }
+			}
+		}
+		else if(CommandData[0] == 'B'){
+			if(strlen(CommandData) > 3){
+				//スペースを0に変えて、ポインタを取得
+				int j = 0;
+				int len = strlen(CommandData);
+				for(int i=0; i<len; i++){
+					if(CommandData[i] == ' '){
+						CommandData[i] = 0;
+						fs[j] = &CommandData[i+1];
+						j++;
+						if(j>2){	break;	}
+					}
 				}
-				else{
-					//ファイルを保存します
-					writefile(fname, size, CommandData[0], readData);
-					free( readData );
+				strcpy(fname, fs[0]);
+				size = atoi(fs[1]);
+				bool compress = (j > 2 && fs[2][0] == 'Z');	//3つ目にZがあれば圧縮して保存する
+
+				//フレーム転送でファイルを保存します
+				framefile(fname, size, compress);
+
+				for(int i=0; i<j; i++){ *(fs[i] - 1) = ' '; }
+			}
+		}
+		else if(CommandData[0] == 'I'){
+			if(strlen(CommandData) > 2){
+
+				//ファイル名を取得
+				int len = strlen(CommandData);
+				for(int i=0; i<len; i++){
+					if(CommandData[i] == ' '){
+						fs[0] = &CommandData[i+1];
+						break;
+					}
+				}
+				strcpy(fname, fs[0]);
+
+				blockhash(fname);
+			}
+		}
+		else if(CommandData[0] == 'J'){
+			if(strlen(CommandData) > 3){
+				//スペースを0に変えて、ポインタを取得
+				int j = 0;
+				int len = strlen(CommandData);
+				for(int i=0; i<len; i++){
+					if(CommandData[i] == ' '){
+						CommandData[i] = 0;
+						fs[j] = &CommandData[i+1];
+						j++;
+						if(j>2){	break;	}
+					}
+				}
+				if(j > 2){
+					strcpy(fname, fs[0]);
+					size = atoi(fs[1]);
+
+					//変わったブロックだけを書き換えます
+					deltafile(fname, size, (unsigned short)strtoul(fs[2], NULL, 16));
 				}
 
 				for(int i=0; i<j; i++){ *(fs[i] - 1) = ' '; }
 			}
 		}
+		else if(CommandData[0] == 'P'){
+			//マニフェストを実行します。Rで指定したファイルがあり、全部成功したら実行します
+			if(manifest() == true){
+				strcpy(RubyFilename, Manifest.run);
+
+				//強制終了フラグを立てる
+				StopFlg = true;
+				break;
+			}
+		}
 		else if(CommandData[0] == 'X' || CommandData[0] == 'V'){
 			if(strlen(CommandData) > 3){
 				//スペースを0に変えて、ポインタを取得
@@ -493,6 +1294,7 @@ int fileloader(const char* str0, const char* str1)
 				}
 				strcpy(fname, fs[0]);
 				size = atoi(fs[1]);
+				bool compress = (j > 2 && fs[2][0] == 'Z');	//3つ目にZがあれば圧縮して保存する
 
 				strcpy( (char*)RubyFilename, fname );
 
@@ -505,16 +1307,8 @@ int fileloader(const char* str0, const char* str1)
 					strcat(RubyFilename, ".mrb");				
 				}
 
-				//ヒープメモリの確保
-				char *readData = (char*)malloc(size);
-				if(readData == NULL){
-					USB_Serial->println("..Out of Memory!");
-				}
-				else{
-					//ファイルを保存します。保存に成功すれば、強制終了フラグが立ちます
-					StopFlg = writefile(RubyFilename, size, CommandData[0], readData);
-					free( readData );
-				}
+				//ファイルを保存します。保存に成功すれば、強制終了フラグが立ちます
+				StopFlg = writefile(RubyFilename, size, CommandData[0], compress);
 
 				for(int i=0; i<j; i++){ *(fs[i] - 1) = ' '; }
 				break;
@@ -530,7 +1324,7 @@ int fileloader(const char* str0, const char* str1)
 		}
 		else if (CommandData[0] == 'L'){
 			USB_Serial->println();
-			for(int i=0; i<64; i++){
+			for(int i=0; i<EEPSECTORS; i++){
 					
 				size = EEP.fdir( i, fname );
 					
@@ -546,6 +1340,18 @@ int fileloader(const char* str0, const char* str1)
 		else if(CommandData[0] == 'A'){
 			EEP.viewFat();
 		}
+		else if(CommandData[0] == 'O'){
+			int moved = EEP.fdefrag();
+			USB_Serial->println();
+			if(moved == -1){
+				USB_Serial->println("Defragment Error!");
+			}
+			else{
+				USB_Serial->print(" ");
+				USB_Serial->print(moved);
+				USB_Serial->println(" sectors moved");
+			}
+		}
 		else if(CommandData[0] == 'S'){
 			if(strlen(CommandData) > 2){
 
@@ -577,20 +1383,25 @@ int fileloader(const char* str0, const char* str1)
 			USB_Serial->println("EEPROM FileWriter Ver. 1.76.v2");
 			USB_Serial->println(" Command List");
 			USB_Serial->println(" L:List Filename..........>L [ENTER]");
-			USB_Serial->println(" W:Write File.............>W Filename Size [ENTER]");
+			USB_Serial->println(" W:Write File.............>W Filename Size [Z] [ENTER]");
 			USB_Serial->println(" G:Get File...............>G Filename [ENTER]");
 			USB_Serial->println(" F:Get File B2A...........>F Filename [ENTER]");
 			USB_Serial->println(" D:Delete File............>D Filename [ENTER]");
 			USB_Serial->println(" Z:Delete All Files.......>Z [ENTER]");
 			USB_Serial->println(" A:List FAT...............>A [ENTER]");
+			USB_Serial->println(" O:Defragment Files.......>O [ENTER]");
 			USB_Serial->println(" R:Run File...............>R Filename [ENTER]");
-			USB_Serial->println(" X:Execute File...........>X Filename Size [ENTER]");
+			USB_Serial->println(" X:Execute File...........>X Filename Size [Z] [ENTER]");
 			USB_Serial->println(" S:List Sector............>S Number [ENTER]");
 			USB_Serial->println(" .:Repeat.................>. [ENTER]");
 			USB_Serial->println(" Q:Quit...................>Q [ENTER]");
 			USB_Serial->println(" E:System Reset...........>E [ENTER]");
 			USB_Serial->println(" M:Drive Mount............>M [ENTER]");
-			USB_Serial->println(" U:Write File B2A.........>U Filename Size [ENTER]");
+			USB_Serial->println(" U:Write File B2A.........>U Filename Size [Z] [ENTER]");
+			USB_Serial->println(" B:Write File Framed......>B Filename Size [Z] [ENTER]");
+			USB_Serial->println(" P:Run Manifest...........>P [ENTER]");
+			USB_Serial->println(" I:Block CRCs.............>I Filename [ENTER]");
+			USB_Serial->println(" J:Write Changed Blocks...>J Filename Size CRC16 [ENTER]");
 			USB_Serial->println(" T:'>'Auto Print Switch...>T [ENTER]");
 			//USB_Serial->println(" V:Execute File B2A.......>V Filename Size [ENTER]");
 			USB_Serial->println(" C:License................>C [ENTER]");
@@ -9,6 +9,10 @@
  */
 
 void lineinput(char *arry);
-bool writefile(const char *fname, int size, char code, char *readData);
+bool writefile(const char *fname, int size, char code, bool compress);
+bool framefile(const char *fname, int size, bool compress);
+bool manifest(void);
+void blockhash(const char *fname);
+bool deltafile(const char *fname, int size, unsigned short crc);
 void readfile(const char *fname, char code);
 int fileloader(const char* str0, const char* str1);
@@ -0,0 +1,67 @@
+/*
+ * データフラッシュエミュレータ用のArduino.hの代わり
+ * EEPROMClassとEEPFILEをLinuxでコンパイルするのに必要なものだけを用意しています
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_ 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+//時間はエミュレータの仮想時計で、フラッシュの操作とdelay()の分だけ進みます
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+#ifdef __cplusplus
+}
+
+//Serialはfdが-1のときは標準出力に出して、入力は無しにします
+//fdを設定すると、そのファイル(ptyなど)と読み書きします
+class HardwareSerial
+{
+  public:
+	int fd = -1;
+	size_t print(const char *s){	return write((const uint8_t*)s, strlen(s));	}
+	size_t print(char c){	return write((uint8_t)c);	}
+	size_t print(int v, int base = 10){	return printNum(base == 16 ? "%X" : "%d", v);	}
+	size_t print(unsigned int v, int base = 10){	return printNum(base == 16 ? "%X" : "%u", v);	}
+	size_t print(long v, int base = 10){	return printNum(base == 16 ? "%lX" : "%ld", v);	}
+	size_t print(unsigned long v, int base = 10){	return printNum(base == 16 ? "%lX" : "%lu", v);	}
+	size_t println(void){	return print("\r\n");	}
+	template<class T> size_t println(T v){	size_t n = print(v);	return n + println();	}
+	template<class T> size_t println(T v, int base){	size_t n = print(v, base);	return n + println();	}
+	size_t write(uint8_t c){	return write(&c, 1);	}
+	size_t write(const uint8_t *buf, size_t len);
+	int available(void);
+	int read(void);
+	void flush(void){}
+
+  private:
+	int peek = -1;
+	template<class T> size_t printNum(const char *fmt, T v){	char s[24];	snprintf(s, sizeof(s), fmt, v);	return print(s);	}
+};
+extern HardwareSerial Serial;
+
+//ローダーが使うピンの操作は何もしません
+#define HIGH	1
+#define LOW		0
+#define INPUT	0
+#define OUTPUT	1
+inline int digitalRead(int){	return LOW;	}
+inline void digitalWrite(int, int){}
+inline void pinMode(int, int){}
+#endif
+
+#endif // _HOST_ARDUINO_H_
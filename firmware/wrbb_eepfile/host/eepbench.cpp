@@ -0,0 +1,618 @@
+/*
+ * EEPFILEのベンチマーク
+ * データフラッシュのエミュレータの上で、操作ごとの時間とフラッシュの操作回数を表示します
+ *
+ *  make eepbench で作成して実行します
+ *  flash us/opは、flashsim.hの操作ごとの時間を足した仮想時計の値で、フラッシュの操作の時間だけを数えます
+ *  host us/opは、std::chronoで測ったこのPCでの実際の時間です。ボードのCPUの時間ではありませんが、
+ *  フラッシュの操作が無い処理(fopen(READ)など)の重さを比べるのに使えます
+ *
+ *  eepbench [ファイル...]
+ *    引数のファイルを圧縮して保存し、読み直しとシーク、コピーを確かめて、拡張子ごとの圧縮率を表示します
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#include <chrono>
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "eepfile.h"
+#include "flashsim.h"
+
+#define BENCH_FILES		8		//作成するファイルの数
+#define BENCH_SIZE		1024	//1ファイルのバイト数
+#define BENCH_REPEAT	20		//繰り返す回数
+#define BENCH_RECORD	16		//追記やKVS、リングログの1回のバイト数
+#define BENCH_BIG		6000	//セクタをたどる回数やまとめて読む時間を調べるファイルのバイト数
+#define BENCH_CONFIG_MIN	40		//いっぱいになるまで書く設定ファイルのバイト数の最小
+#define BENCH_CONFIG_MAX	200		//同じく最大
+#define BENCH_ZIP_MAX	0x6000	//圧縮を調べるファイルの最大バイト数
+
+//1年分の書き換えの再現。10分ごとにログへ追記、1時間ごとに設定ファイルを置き換え、
+//1日ごとにログを消して電源を入れ直します。プログラムのファイルは最初に書いたまま変えません
+#define YEAR_DAYS		365
+#define YEAR_STATIC		10		//書き換えないファイルの数
+#define YEAR_STATIC_SIZE	1536	//書き換えないファイルの1つのバイト数
+#define YEAR_CONFIG_SIZE	200		//設定ファイルのバイト数
+#define YEAR_IDLE		4		//書き換えの合間にidle()を呼ぶ回数
+
+//ファイルに使う領域(eepfile.cppのEEPSTASECTからEEPENDSECTまで)
+#define YEAR_FILE_START	(((0x100 + (EEPSECTORS * 2 + DF_ERASE_BLOCK_SIZE) * 2 + EEPSECTORS * 2 + EEPSECTOR_SIZE - 1) / EEPSECTOR_SIZE) * EEPSECTOR_SIZE)
+#define YEAR_FILE_END	(EEPSIZE - 0x400 * 2)
+
+//操作ごとの合計
+typedef struct {
+	const char *name;
+	unsigned long count;
+	unsigned long us;
+	double hostus;
+	unsigned long erase;
+	unsigned long program;
+	unsigned long blank;
+} BENCHOP;
+
+enum {
+	OP_OPEN_NEW, OP_WRITE, OP_CLOSE_NEW,
+	OP_OPEN_REPLACE, OP_CLOSE_REPLACE,
+	OP_OPEN_READ, OP_READ, OP_CLOSE_READ,
+	OP_APPEND, OP_DIR, OP_DELETE,
+	OP_KVSET, OP_KVGET, OP_PUTREC, OP_EEPROM,
+	OP_MAX
+};
+
+static BENCHOP Op[OP_MAX] = {
+	{ "fopen(WRITE) new", 0, 0, 0, 0, 0, 0 },
+	{ "fwrite 1KB", 0, 0, 0, 0, 0, 0 },
+	{ "fclose new", 0, 0, 0, 0, 0, 0 },
+	{ "fopen(WRITE) replace", 0, 0, 0, 0, 0, 0 },
+	{ "fclose replace", 0, 0, 0, 0, 0, 0 },
+	{ "fopen(READ)", 0, 0, 0, 0, 0, 0 },
+	{ "fread 1KB", 0, 0, 0, 0, 0, 0 },
+	{ "fclose read", 0, 0, 0, 0, 0, 0 },
+	{ "append 16B (open/write/close)", 0, 0, 0, 0, 0, 0 },
+	{ "directory listing", 0, 0, 0, 0, 0, 0 },
+	{ "fdelete", 0, 0, 0, 0, 0, 0 },
+	{ "kvSet 16B", 0, 0, 0, 0, 0, 0 },
+	{ "kvGet 16B", 0, 0, 0, 0, 0, 0 },
+	{ "fputrec 16B", 0, 0, 0, 0, 0, 0 },
+	{ "EEPROM.write 16B", 0, 0, 0, 0, 0, 0 },
+};
+
+static unsigned long StaTime;
+static std::chrono::steady_clock::time_point StaHost;
+static FLASHSIM_STAT StaStat;
+
+//計測を始めます
+static void start(void)
+{
+	StaTime = micros();
+	StaStat = FlashSim;
+	StaHost = std::chrono::steady_clock::now();
+}
+
+//計測を終えて、opに足します
+static void stop(int op)
+{
+	std::chrono::duration<double, std::micro> host = std::chrono::steady_clock::now() - StaHost;
+	Op[op].count++;
+	Op[op].us += micros() - StaTime;
+	Op[op].hostus += host.count();
+	Op[op].erase += FlashSim.erase - StaStat.erase;
+	Op[op].program += FlashSim.program - StaStat.program;
+	Op[op].blank += FlashSim.blank - StaStat.blank;
+}
+
+//ファイルを作るか置き換えます
+static void putFile(const char *name, const char *buf, bool replace)
+{
+	FILEEEP fp;
+	int len = BENCH_SIZE;
+
+	start();
+	EEP.fopen(&fp, name, EEP_WRITE);
+	stop(replace ? OP_OPEN_REPLACE : OP_OPEN_NEW);
+
+	start();
+	EEP.fwrite(&fp, (char*)buf, &len);
+	stop(OP_WRITE);
+
+	start();
+	EEP.fclose(&fp);
+	stop(replace ? OP_CLOSE_REPLACE : OP_CLOSE_NEW);
+}
+
+//******************************************************
+// 1年分の書き換えを再現して、ファイルに使う領域のイレースブロックの消去回数の最大と平均を表示します
+// 読み直した内容が違ったときは、その数を返します
+//******************************************************
+static int yearReplay(void)
+{
+	static char buf[YEAR_STATIC_SIZE];
+	static char rbuf[YEAR_STATIC_SIZE];
+	char name[EEPFILENAME_SIZE];
+	char rec[BENCH_RECORD];
+	FILEEEP fp;
+	int fails = 0;
+
+	flashsim_clear();
+	EEP.format();
+
+	for (int f = 0; f < YEAR_STATIC; f++){
+		for (int i = 0; i < YEAR_STATIC_SIZE; i++){
+			buf[i] = (char)(i * 3 + f);
+		}
+		sprintf(name, "lib%d.mrb", f);
+		int len = YEAR_STATIC_SIZE;
+		EEP.fopen(&fp, name, EEP_WRITE);
+		EEP.fwrite(&fp, buf, &len);
+		EEP.fclose(&fp);
+	}
+	flashsim_reset_stat();
+
+	for (int d = 0; d < YEAR_DAYS; d++){
+		for (int m = 0; m < 24 * 6; m++){
+			memset(rec, 'a' + (m % 26), BENCH_RECORD);
+			int len = BENCH_RECORD;
+			EEP.fopen(&fp, "log.txt", EEP_APPEND);
+			EEP.fwrite(&fp, rec, &len);
+			EEP.fclose(&fp);
+
+			if (m % 6 == 0){
+				memset(buf, m + d, YEAR_CONFIG_SIZE);
+				len = YEAR_CONFIG_SIZE;
+				EEP.fopen(&fp, "config.txt", EEP_WRITE);
+				EEP.fwrite(&fp, buf, &len);
+				EEP.fclose(&fp);
+			}
+
+			for (int i = 0; i < YEAR_IDLE; i++){
+				EEP.idle();
+			}
+		}
+		EEP.fdelete("log.txt");
+		EEP.begin();
+	}
+
+	//書き換えないファイルが移されても壊れていないことを確かめます
+	for (int f = 0; f < YEAR_STATIC; f++){
+		for (int i = 0; i < YEAR_STATIC_SIZE; i++){
+			buf[i] = (char)(i * 3 + f);
+		}
+		sprintf(name, "lib%d.mrb", f);
+		EEP.fopen(&fp, name, EEP_READ);
+		int len = EEP.fread(&fp, rbuf, YEAR_STATIC_SIZE);
+		EEP.fclose(&fp);
+		if (len != YEAR_STATIC_SIZE || memcmp(buf, rbuf, YEAR_STATIC_SIZE) != 0){
+			fails++;
+		}
+	}
+
+	//イレースブロックごとと、セクタごと(ウェアレベリングが揃える単位)の合計の最大と平均
+	//ウェアレベリングはセクタ単位なので、セクタの中のブロックの偏りは揃いません
+	//APPENDで開いたファイルは、閉じるたびに先頭セクタのサイズを書き換えるので、その先頭ブロックが一番多く消去されます
+	unsigned long bmax = 0;
+	unsigned long baddr = 0;
+	unsigned long smax = 0;
+	unsigned long sum = 0;
+	int sects = 0;
+	for (unsigned long a = YEAR_FILE_START; a < YEAR_FILE_END; a += EEPSECTOR_SIZE){
+		unsigned long ssum = 0;
+		for (int b = 0; b < EEPSECTOR_SIZE; b += DF_ERASE_BLOCK_SIZE){
+			unsigned long n = flashsim_block_erase(a + b);
+			if (n > bmax){
+				bmax = n;
+				baddr = a + b;
+			}
+			ssum += n;
+		}
+		if (ssum > smax){
+			smax = ssum;
+		}
+		sum += ssum;
+		sects++;
+	}
+	double bmean = (double)sum / (sects * (EEPSECTOR_SIZE / DF_ERASE_BLOCK_SIZE));
+	double smean = (double)sum / sects;
+	printf("one year replay (%d static files of %d bytes), file area erase count:\n", YEAR_STATIC, YEAR_STATIC_SIZE);
+	printf("  per erase block: max %lu, mean %.1f (max/mean %.2f), hottest at offset %lu of its sector\n", bmax, bmean, bmean > 0 ? bmax / bmean : 0.0, baddr % EEPSECTOR_SIZE);
+	printf("  per sector     : max %lu, mean %.1f (max/mean %.2f)\n", smax, smean, smean > 0 ? smax / smean : 0.0);
+	return fails;
+}
+
+//******************************************************
+// 書き込みバッファの確認。空のデータフラッシュに1KBのファイルを、まとめてと1バイトずつfwriteして、
+// 消去と書き込みの回数が同じになることを確かめます
+// 比べるために、バッファを使わずにEEPROM.write()で1バイトずつ書いたときの回数も表示します
+//******************************************************
+static int writeBuffer(void)
+{
+	static char buf[BENCH_SIZE];
+	FILEEEP fp;
+	int fails = 0;
+
+	for (int i = 0; i < BENCH_SIZE; i++){
+		buf[i] = (char)(i * 11 + 3);
+	}
+
+	flashsim_clear();
+	EEP.format();
+	FLASHSIM_STAT sta = FlashSim;
+	int len = BENCH_SIZE;
+	EEP.fopen(&fp, "whole.bin", EEP_WRITE);
+	EEP.fwrite(&fp, buf, &len);
+	EEP.fclose(&fp);
+	unsigned long we = FlashSim.erase - sta.erase;
+	unsigned long wp = FlashSim.program - sta.program;
+
+	flashsim_clear();
+	EEP.format();
+	sta = FlashSim;
+	EEP.fopen(&fp, "byte.bin", EEP_WRITE);
+	for (int i = 0; i < BENCH_SIZE; i++){
+		EEP.fwrite(&fp, buf[i]);
+	}
+	EEP.fclose(&fp);
+	unsigned long be = FlashSim.erase - sta.erase;
+	unsigned long bp = FlashSim.program - sta.program;
+
+	flashsim_clear();
+	EEP.format();
+	sta = FlashSim;
+	for (int i = 0; i < BENCH_SIZE; i++){
+		EEPROM.write(YEAR_FILE_START + i, (uint8_t)buf[i]);
+	}
+	unsigned long ee = FlashSim.erase - sta.erase;
+	unsigned long ep = FlashSim.program - sta.program;
+	EEP.format();
+
+	printf("write %d bytes to blank flash (erase / program):\n", BENCH_SIZE);
+	printf("  %-28s %5lu / %5lu\n", "fwrite all at once", we, wp);
+	printf("  %-28s %5lu / %5lu\n", "fwrite 1 byte at a time", be, bp);
+	printf("  %-28s %5lu / %5lu (no write buffer)\n", "EEPROM.write 1 byte at a time", ee, ep);
+
+	//1バイトずつ書いても、バッファでまとめるので回数は増えないはず
+	if (be > we || bp > wp){
+		printf("  fwrite 1 byte costs more than fwrite at once\n");
+		fails++;
+	}
+	return fails;
+}
+
+//******************************************************
+// BENCH_BIGバイトのファイルを1バイトずつ読んで、たどったSect[]のリンクの数を数えます
+// curindexが増えた分をたどった数とし、減ったときは先頭からたどり直したとします
+// 比べるために、1バイトごとに先頭からたどったときの数も表示します
+//******************************************************
+static int traversal(void)
+{
+	static char buf[BENCH_BIG];
+	FILEEEP fp;
+	int fails = 0;
+
+	for (int i = 0; i < BENCH_BIG; i++){
+		buf[i] = (char)(i * 5 + 1);
+	}
+
+	flashsim_clear();
+	EEP.format();
+	int len = BENCH_BIG;
+	EEP.fopen(&fp, "big.mrb", EEP_WRITE);
+	EEP.fwrite(&fp, buf, &len);
+	EEP.fclose(&fp);
+
+	unsigned long links = 0;
+	unsigned long top = 0;
+	EEP.fopen(&fp, "big.mrb", EEP_READ);
+	int sectors = (fp.offsetaddress + BENCH_BIG + EEPSECTOR_SIZE - 1) / EEPSECTOR_SIZE;
+	for (int i = 0; i < BENCH_BIG; i++){
+		int before = (fp.cursector < 0) ? 0 : fp.curindex;
+		if (EEP.fread(&fp) != (unsigned char)buf[i]){
+			fails++;
+		}
+		int after = fp.curindex;
+		links += (after >= before) ? after - before : after;
+		top += (fp.offsetaddress + i) / EEPSECTOR_SIZE;
+	}
+	EEP.fclose(&fp);
+
+	printf("read %d bytes one at a time (%d sectors), Sect[] links followed:\n", BENCH_BIG, sectors);
+	printf("  %-28s %6lu\n", "from the cached sector", links);
+	printf("  %-28s %6lu (no cache)\n", "from the top every byte", top);
+
+	//順に読むときは、セクタの境目ごとに1回だけたどるはず
+	if (links != (unsigned long)(sectors - 1)){
+		printf("  expected %d links\n", sectors - 1);
+		fails++;
+	}
+	return fails;
+}
+
+//******************************************************
+// プログラムのファイル(6000, 2500, 1800バイト)を書いたあとに、
+// 40～200バイトの設定ファイルをいっぱいになるまで書いて、書けた数を表示します
+// 6000バイトのファイルをまとめて読む時間も表示します
+//******************************************************
+static int fillSmall(void)
+{
+	static char buf[BENCH_BIG];
+	static char rbuf[BENCH_BIG];
+	static const int Prog[] = { BENCH_BIG, 2500, 1800 };
+	char name[EEPFILENAME_SIZE];
+	FILEEEP fp;
+	int fails = 0;
+
+	for (int i = 0; i < BENCH_BIG; i++){
+		buf[i] = (char)(i * 7 + 5);
+	}
+
+	flashsim_clear();
+	EEP.format();
+	for (unsigned int f = 0; f < sizeof(Prog) / sizeof(Prog[0]); f++){
+		sprintf(name, "prog%d.mrb", f);
+		int len = Prog[f];
+		if (EEP.fopen(&fp, name, EEP_WRITE) == -1){
+			fails++;
+			continue;
+		}
+		EEP.fwrite(&fp, buf, &len);
+		EEP.fclose(&fp);
+	}
+
+	//サイズは40から200まで37ずつずらして決めます
+	int count = 0;
+	while (true){
+		int size = BENCH_CONFIG_MIN + (count * 37) % (BENCH_CONFIG_MAX - BENCH_CONFIG_MIN + 1);
+		sprintf(name, "cfg%d.txt", count);
+		if (EEP.fopen(&fp, name, EEP_WRITE) == -1){
+			break;
+		}
+		int len = size;
+		EEP.fwrite(&fp, buf, &len);
+		EEP.fclose(&fp);
+		if (len != size || EEP.ffilesize(name) != size){
+			EEP.fdelete(name);
+			break;
+		}
+		count++;
+	}
+
+	unsigned long us = micros();
+	EEP.fopen(&fp, "prog0.mrb", EEP_READ);
+	int len = EEP.fread(&fp, rbuf, BENCH_BIG);
+	EEP.fclose(&fp);
+	us = micros() - us;
+	if (len != BENCH_BIG || memcmp(buf, rbuf, BENCH_BIG) != 0){
+		fails++;
+	}
+
+	printf("programs of %d, %d and %d bytes, then %d-%d byte files until full:\n",
+		Prog[0], Prog[1], Prog[2], BENCH_CONFIG_MIN, BENCH_CONFIG_MAX);
+	printf("  %-28s %6d\n", "small files written", count);
+	printf("  %-28s %6lu us\n", "read the 6000 byte file", us);
+	return fails;
+}
+
+//拡張子ごとの圧縮の合計
+typedef struct {
+	const char *ext;
+	int files;
+	long size;
+	long stored;
+} BENCHZIP;
+
+//圧縮ファイルnameが、dataと同じかを調べます。storedに保存したバイト数を入れます
+static bool zipCheck(const char *name, const char *data, int size, int *stored)
+{
+	static char rbuf[BENCH_ZIP_MAX];
+	FILEEEP fp;
+
+	if (EEP.fopen(&fp, name, EEP_READ) == -1){
+		return false;
+	}
+	*stored = fp.filesize;
+	bool ok = EEP.fread(&fp, rbuf, size) == size && memcmp(data, rbuf, size) == 0 && EEP.fEof(&fp);
+
+	//前へのシークと、巻き戻すシーク
+	EEP.fseek(&fp, size / 4, EEP_SEEKTOP);
+	ok = ok && EEP.fread(&fp) == (unsigned char)data[size / 4];
+	EEP.fseek(&fp, size * 3 / 4, EEP_SEEKTOP);
+	ok = ok && EEP.fread(&fp) == (unsigned char)data[size * 3 / 4];
+	EEP.fseek(&fp, size / 2, EEP_SEEKTOP);
+	ok = ok && EEP.fread(&fp) == (unsigned char)data[size / 2];
+	EEP.fclose(&fp);
+	return ok;
+}
+
+//******************************************************
+// 引数のファイルを1つずつ圧縮して書き、電源を入れ直したあとに読み直して、シークとコピーを確かめます
+// 拡張子ごとに、元のバイト数と保存したバイト数を表示します
+//******************************************************
+static int zipFiles(int argc, char **argv)
+{
+	static char data[BENCH_ZIP_MAX];
+	static BENCHZIP Zip[] = { { ".mrb", 0, 0, 0 }, { ".rb", 0, 0, 0 }, { "other", 0, 0, 0 } };
+	const int zips = sizeof(Zip) / sizeof(Zip[0]);
+	FILEEEP fp;
+	int fails = 0;
+
+	if (argc < 2){
+		return 0;
+	}
+
+	for (int a = 1; a < argc; a++){
+		FILE *in = ::fopen(argv[a], "rb");
+		if (in == NULL){
+			perror(argv[a]);
+			fails++;
+			continue;
+		}
+		int size = ::fread(data, 1, sizeof(data), in);
+		::fclose(in);
+		if (size <= 0 || size >= BENCH_ZIP_MAX){
+			printf("  %s: skipped (%d bytes)\n", argv[a], size);
+			continue;
+		}
+
+		flashsim_clear();
+		EEP.format();
+		int len = size;
+		EEP.fopen(&fp, "zip.mrb", EEP_WRITE | EEP_COMPRESS);
+		EEP.fwrite(&fp, data, &len);
+		EEP.fclose(&fp);
+
+		//電源を入れ直して読み直し、コピーも読み直します
+		EEP.begin();
+		int stored = 0;
+		int cstored = 0;
+		bool ok = len == size && EEP.ffilesize("zip.mrb") == size && zipCheck("zip.mrb", data, size, &stored);
+		ok = ok && EEP.fcopy("zip.mrb", "copy.mrb") != -1 && zipCheck("copy.mrb", data, size, &cstored) && cstored == stored;
+		if (!ok){
+			printf("  %s: round trip failed\n", argv[a]);
+			fails++;
+			continue;
+		}
+
+		const char *ext = strrchr(argv[a], '.');
+		int z = 0;
+		while (z < zips - 1 && (ext == NULL || strcmp(ext, Zip[z].ext) != 0)){
+			z++;
+		}
+		Zip[z].files++;
+		Zip[z].size += size;
+		Zip[z].stored += stored;
+	}
+
+	printf("compressed files (written, remounted, read back, seeked and copied):\n");
+	for (int z = 0; z < zips; z++){
+		if (Zip[z].files > 0){
+			printf("  %-6s %3d files: %6ld bytes stored as %6ld (%.1f%%)\n", Zip[z].ext,
+				Zip[z].files, Zip[z].size, Zip[z].stored, 100.0 * Zip[z].stored / Zip[z].size);
+		}
+	}
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[BENCH_SIZE];
+	static char rbuf[BENCH_SIZE];
+	char name[EEPFILENAME_SIZE];
+	char rec[BENCH_RECORD];
+	FILEEEP fp;
+	FILEEEP ring;
+	int fails = 0;
+
+	EEP.format();
+	flashsim_reset_stat();
+
+	for (int r = 0; r < BENCH_REPEAT; r++){
+		for (int i = 0; i < BENCH_SIZE; i++){
+			buf[i] = (char)(i * 7 + r);
+		}
+
+		//作成、置き換え、読み込み
+		for (int f = 0; f < BENCH_FILES; f++){
+			sprintf(name, "file%d.txt", f);
+			putFile(name, buf, false);
+			putFile(name, buf, true);
+
+			start();
+			EEP.fopen(&fp, name, EEP_READ);
+			stop(OP_OPEN_READ);
+
+			start();
+			int len = EEP.fread(&fp, rbuf, BENCH_SIZE);
+			stop(OP_READ);
+
+			start();
+			EEP.fclose(&fp);
+			stop(OP_CLOSE_READ);
+
+			if (len != BENCH_SIZE || memcmp(buf, rbuf, BENCH_SIZE) != 0){
+				fails++;
+			}
+		}
+
+		//追記
+		memset(rec, 'a' + r, BENCH_RECORD);
+		for (int n = 0; n < BENCH_FILES; n++){
+			int len = BENCH_RECORD;
+			start();
+			EEP.fopen(&fp, "log.txt", EEP_APPEND);
+			EEP.fwrite(&fp, rec, &len);
+			EEP.fclose(&fp);
+			stop(OP_APPEND);
+		}
+
+		//ディレクトリの一覧(ローダーのLコマンドと同じ)
+		start();
+		for (int i = 0; i < EEPSECTORS; i++){
+			EEP.fdir(i, name);
+		}
+		stop(OP_DIR);
+
+		//KVS
+		for (int n = 0; n < BENCH_FILES; n++){
+			rec[0] = (char)n;
+			start();
+			EEP.kvSet("counter", 7, rec, BENCH_RECORD);
+			stop(OP_KVSET);
+
+			start();
+			EEP.kvGet("counter", 7, rbuf, BENCH_RECORD);
+			stop(OP_KVGET);
+		}
+
+		//リングログ
+		EEP.fopen(&ring, "ring.log", EEP_APPEND | EEP_RING, 2048);
+		for (int n = 0; n < BENCH_FILES; n++){
+			start();
+			EEP.fputrec(&ring, rec, BENCH_RECORD);
+			stop(OP_PUTREC);
+		}
+		EEP.fclose(&ring);
+
+		//EEPROMClassのまとめ書き
+		for (int n = 0; n < BENCH_FILES; n++){
+			rec[0] = (char)n;
+			start();
+			EEPROM.write(0x10, (const uint8_t*)rec, BENCH_RECORD);
+			stop(OP_EEPROM);
+		}
+
+		//削除
+		for (int f = 0; f < BENCH_FILES; f++){
+			sprintf(name, "file%d.txt", f);
+			start();
+			EEP.fdelete(name);
+			stop(OP_DELETE);
+		}
+		EEP.fdelete("log.txt");
+	}
+
+	printf("EEPSECTOR_SIZE %d: erase %d us, program %d us, blank check %d us\n",
+		EEPSECTOR_SIZE, FLASHSIM_ERASE_US, FLASHSIM_PROGRAM_US, FLASHSIM_BLANK_US);
+	printf("%-30s %13s %12s %8s %9s %9s\n", "operation", "flash us/op", "host us/op", "erase", "program", "blank");
+	for (int i = 0; i < OP_MAX; i++){
+		double n = Op[i].count ? Op[i].count : 1;
+		printf("%-30s %13.1f %12.2f %8.2f %9.1f %9.1f\n", Op[i].name,
+			Op[i].us / n, Op[i].hostus / n, Op[i].erase / n, Op[i].program / n, Op[i].blank / n);
+	}
+	printf("total: erase %lu (hottest block %lu), program %lu, blank check %lu\n",
+		FlashSim.erase, flashsim_hottest(), FlashSim.program, FlashSim.blank);
+
+	fails += yearReplay();
+	fails += writeBuffer();
+	fails += traversal();
+	fails += fillSmall();
+	fails += zipFiles(argc, argv);
+
+	if (fails != 0 || FlashSim.error != 0){
+		printf("FAILED: %d bad reads, %lu flash errors\n", fails, FlashSim.error);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * EEPFILEの電源断テスト
+ * データフラッシュのエミュレータの上で、操作の途中の全ての消去・書き込みの箇所で電源を切り、
+ * 電源を入れ直したあとのファイルが元のままか新しい内容になっていて、fverify()が通るかを調べます
+ *
+ *  make eepfault で作成して実行します
+ *  EEP_APPENDでその場で書き換えるファイルは、元にも新しい内容にもならないことがあります
+ *  そのときはfverify()で弾かれるか、ファイルが見つからなければよいとします
+ *
+ *  512バイトセクタのときは、元のファームウェアのフォーマットから移行するbegin()も調べます
+ *  予約セクタになったセクタ1と、KVSになったセクタ60～63にあったファイルが、移したあとも元のままでなければいけません
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "eepfile.h"
+#include "flashsim.h"
+
+#define FAULT_SIZE	4096	//テストするファイルの最大バイト数
+#define FAULT_KVSECT	((EEPSIZE - 0x400 * 2) / EEPSECTOR_SIZE)	//KVSになったセクタの先頭(eepfile.cppのEEPKV_START)
+
+//電源を入れ直したあとのファイルの状態
+enum { ST_OLD, ST_NEW, ST_TORN, ST_BAD, ST_MAX };
+
+//テストする操作
+typedef struct {
+	const char *name;
+	void (*setup)(void);	//元のファイルを作ります
+	void (*run)(void);		//電源を切る操作
+	const char *file;		//調べるファイル
+	bool inplace;			//その場で書き換えるので、fverify()で弾かれてもよい
+} FAULTCASE;
+
+static char OldData[FAULT_SIZE];
+static char NewData[FAULT_SIZE];
+static int OldSize;				//-1のときは元のファイルが無い
+static int NewSize;				//-1のときは操作のあとにファイルが無い
+
+//ファイルを作ります
+static void putFile(const char *name, const char *data, int size, int mode)
+{
+	FILEEEP fp;
+	int len = size;
+	EEP.fopen(&fp, name, mode);
+	EEP.fwrite(&fp, (char*)data, &len);
+	EEP.fclose(&fp);
+}
+
+//****元のファイルを作る
+static void setupNone(void)
+{
+	OldSize = -1;
+}
+
+static void setupOld(void)
+{
+	OldSize = 1500;
+	putFile("test.mrb", OldData, OldSize, EEP_WRITE);
+}
+
+static void setupOldZip(void)
+{
+	OldSize = 1500;
+	putFile("test.mrb", OldData, OldSize, EEP_WRITE | EEP_COMPRESS);
+}
+
+#if EEPSECTOR_SIZE == 512
+//元のファームウェアのフォーマットで、移すセクタにファイルを置きます
+static void setupLegacy(void)
+{
+	OldSize = 1500;
+	flashsim_oldformat();
+	flashsim_oldfile(1, "other.txt", NewData, 700);
+	flashsim_oldfile(FAULT_KVSECT, "test.mrb", OldData, OldSize);
+}
+#endif
+
+//****電源を切る操作
+static void runCreate(void)
+{
+	NewSize = 2000;
+	putFile("test.mrb", NewData, NewSize, EEP_WRITE);
+}
+
+static void runReplace(void)
+{
+	NewSize = 2000;
+	putFile("test.mrb", NewData, NewSize, EEP_WRITE);
+}
+
+static void runReplaceZip(void)
+{
+	NewSize = 2000;
+	putFile("test.mrb", NewData, NewSize, EEP_WRITE | EEP_COMPRESS);
+}
+
+static void runDelete(void)
+{
+	NewSize = -1;
+	EEP.fdelete("test.mrb");
+}
+
+//ローダーのJコマンドと同じように、途中のブロックをその場で書き換えます
+static void patch(bool abort)
+{
+	FILEEEP fp;
+	int len = 600;
+
+	memcpy(NewData, OldData, OldSize);
+	memset(NewData + 512, 'P', len);
+	NewSize = OldSize;
+
+	EEP.fopen(&fp, "test.mrb", EEP_APPEND);
+	EEP.fseek(&fp, 512, EEP_SEEKTOP);
+	EEP.fwrite(&fp, NewData + 512, &len);
+	if (abort){
+		EEP.fabort(&fp);
+	}
+	else{
+		EEP.fclose(&fp);
+	}
+}
+
+static void runPatch(void)
+{
+	patch(false);
+}
+
+//途中で止めたJコマンドは、書き換えたファイルが弾かれなければいけません
+static void runPatchAbort(void)
+{
+	patch(true);
+	NewSize = -2;
+}
+
+#if EEPSECTOR_SIZE == 512
+//最初のbegin()で予約セクタのファイルを移します。ファイルは元のままでなければいけません
+static void runMigrate(void)
+{
+	EEP.begin();
+	NewSize = -2;
+}
+#endif
+
+static const FAULTCASE Cases[] = {
+	{ "create",           setupNone,   runCreate,     "test.mrb", false },
+	{ "replace",          setupOld,    runReplace,    "test.mrb", false },
+	{ "replace (zip)",    setupOldZip, runReplaceZip, "test.mrb", false },
+	{ "delete",           setupOld,    runDelete,     "test.mrb", false },
+	{ "patch in place",   setupOld,    runPatch,      "test.mrb", true },
+	{ "patch and abort",  setupOld,    runPatchAbort, "test.mrb", true },
+#if EEPSECTOR_SIZE == 512
+	{ "migrate old format", setupLegacy, runMigrate,  "test.mrb", false },
+#endif
+};
+
+//ファイルを読み込みます。無いときは-1を返します。verifyにfverify()の結果を入れます
+static int getFile(const char *name, char *buf, int *verify)
+{
+	FILEEEP fp;
+	if (!EEP.fexist(name) || EEP.fopen(&fp, name, EEP_READ) == -1){
+		return -1;
+	}
+	*verify = EEP.fverify(&fp);
+	int len = EEP.fread(&fp, buf, FAULT_SIZE);
+	EEP.fclose(&fp);
+	return len;
+}
+
+//電源を入れ直したあとのファイルの状態を調べます
+static int check(const FAULTCASE *c)
+{
+	static char buf[FAULT_SIZE];
+	int verify = 0;
+	int len = getFile(c->file, buf, &verify);
+
+	if (len == -1){
+		if (OldSize == -1){
+			return ST_OLD;
+		}
+		if (NewSize == -1){
+			return ST_NEW;
+		}
+		return c->inplace ? ST_TORN : ST_BAD;
+	}
+	if (verify == 1 && len == OldSize && memcmp(buf, OldData, len) == 0){
+		return ST_OLD;
+	}
+	if (verify == 1 && len == NewSize && memcmp(buf, NewData, len) == 0){
+		return ST_NEW;
+	}
+	return (c->inplace && verify == 0) ? ST_TORN : ST_BAD;
+}
+
+//ほかのファイルが壊れていなくて、新しくファイルとKVSを書けるかを調べます
+static bool healthy(void)
+{
+	static char buf[FAULT_SIZE];
+	int verify = 0;
+
+	if (EEP.kvSet("after", 5, OldData, 16) == -1 || EEP.kvGet("after", 5, buf, 16) != 16 || memcmp(buf, OldData, 16) != 0){
+		return false;
+	}
+
+	if (getFile("other.txt", buf, &verify) != 700 || verify != 1 || memcmp(buf, NewData, 700) != 0){
+		return false;
+	}
+
+	putFile("after.txt", OldData, 300, EEP_WRITE);
+	if (getFile("after.txt", buf, &verify) != 300 || verify != 1 || memcmp(buf, OldData, 300) != 0){
+		return false;
+	}
+	return true;
+}
+
+//ファイルを作り直して、cの操作を始めます
+static void prepare(const FAULTCASE *c)
+{
+	flashsim_clear();
+	EEP.format();
+	putFile("other.txt", NewData, 700, EEP_WRITE);
+	c->setup();
+}
+
+//操作の消去と書き込みの回数を返します
+static long countOps(const FAULTCASE *c)
+{
+	prepare(c);
+	unsigned long n = FlashSim.erase + FlashSim.program;
+	c->run();
+	return FlashSim.erase + FlashSim.program - n;
+}
+
+int main(void)
+{
+	int fails = 0;
+
+	for (int i = 0; i < FAULT_SIZE; i++){
+		OldData[i] = (char)(i * 13 + 1);
+		NewData[i] = (char)(i * 29 + 7);
+	}
+
+	printf("EEPSECTOR_SIZE %d: power cut at every erase and program in each operation\n", EEPSECTOR_SIZE);
+	printf("%-18s %6s %6s %6s %9s %6s\n", "operation", "cuts", "old", "new", "rejected", "BAD");
+
+	for (unsigned int k = 0; k < sizeof(Cases) / sizeof(Cases[0]); k++){
+		const FAULTCASE *c = &Cases[k];
+		int count[ST_MAX] = { 0 };
+		long ops = countOps(c);
+
+		for (long n = 0; n <= ops; n++){
+			prepare(c);
+			flashsim_cut(n);
+			c->run();
+			flashsim_cut(-1);
+
+			//電源を入れ直します
+			EEP.begin();
+			int st = check(c);
+			if (st != ST_BAD && !healthy()){
+				st = ST_BAD;
+			}
+			if (st == ST_BAD && count[ST_BAD] == 0){
+				printf("  %s: cut at %ld of %ld is BAD\n", c->name, n, ops);
+			}
+			count[st]++;
+		}
+
+		printf("%-18s %6ld %6d %6d %9d %6d\n", c->name, ops + 1,
+			count[ST_OLD], count[ST_NEW], count[ST_TORN], count[ST_BAD]);
+		fails += count[ST_BAD];
+	}
+
+	if (fails != 0){
+		printf("FAILED: %d\n", fails);
+		return 1;
+	}
+	return 0;
+}
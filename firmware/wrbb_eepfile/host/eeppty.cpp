@@ -0,0 +1,392 @@
+/*
+ * ローダーとeepsendを疑似端末(pty)でつないだテスト
+ * データフラッシュのエミュレータの上でローダーのfileloader()を動かし、
+ * 子プロセスでeepsendを実行して、ファイルの送信と受け取りを一通り行います
+ *
+ *  make eeppty で作成して実行します
+ *  eeppty [eepsendのパス]
+ *
+ *  -e でCRCを壊したフレームを送り、ボードがNAKを返して送り直したこと(resentが0でない)を確かめます
+ *  Jコマンドで書き換えられないリングログとCRCの無いファイルは、CAN 1で断られて、Bコマンドで送り直されることを確かめます
+ *  最後にQでローダーを終わらせて、ボードに残ったファイルの中身とfverify()を調べます
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#include <fcntl.h>
+#include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <Arduino.h>
+#include <reboot.h>
+#include <EEPROM.h>
+#include "eepfile.h"
+#include "eeploader.h"
+#include "flashsim.h"
+#include "../../wrbb.h"
+
+#define PTY_TIMEOUT	300		//テスト全体の最大時間(秒)
+#define PTY_FILE	0x4000	//ボードのファイルの最大バイト数
+
+//ローダーが使うもので、テストでは使わないもの
+char RubyFilename[RUBY_FILENAME_SIZE];
+
+void system_reboot(reboot_mode)
+{
+	fprintf(stderr, "system_reboot\n");
+	exit(1);
+}
+
+//eepsendの実行
+typedef struct {
+	const char *name;
+	const char *args[6];	//ポートの前に付けるオプション。NULLで終わる
+	const char *file;		//送るファイル(作業ディレクトリの中)
+	const char *dest;		//ボードでの名前。NULLのときはfileと同じ
+	bool resend;			//送り直しがあるはず
+	const char *want;		//eepsendの出力にあるはずの文字列。NULLのときは調べない
+	bool legacy;			//元のファームウェアのフォーマットから移行したときだけ行う
+} PTYSTEP;
+
+#define PTY_REFUSED	"did not accept the file (1)"	//CAN 1で断られたときのeepsendの出力
+
+static const PTYSTEP Steps[] = {
+	{ "B",                 { NULL },                   "a.mrb",   NULL,    false, NULL, false },
+	{ "B corrupt 1/3",     { "-e", "3", NULL },        "b.txt",   NULL,    true,  NULL, false },
+	{ "B window 1",        { "-w", "1", "-e", "2", NULL }, "b.txt", "w.txt", true, NULL, false },
+	{ "B zip corrupt 1/2", { "-z", "-e", "2", NULL },  "b.txt",   "c.txt", true,  NULL, false },
+	{ "delta corrupt",     { "-d", "-e", "1", NULL },  "a2.mrb",  "a.mrb", true,  NULL, false },
+	{ "manifest corrupt",  { "-p", "-e", "3", NULL },  "man.txt", NULL,    true,  NULL, false },
+	{ "delta ring",        { "-d", NULL },             "b.txt",   "ring.log", false, PTY_REFUSED, false },
+	{ "delta no CRC",      { "-d", NULL },             "a2.mrb",  "old.mrb",  false, PTY_REFUSED, true },
+};
+
+//最後にボードにあるはずのファイル。fileがNULLのときは無いはず
+typedef struct {
+	const char *name;
+	const char *file;
+} PTYEXPECT;
+
+static const PTYEXPECT Expect[] = {
+	{ "a.mrb", "a2.mrb" },
+	{ "b.txt", "b.txt" },
+	{ "w.txt", "b.txt" },
+	{ "c.txt", NULL },
+	{ "m.txt", "m.mrb" },
+	{ "ring.log", "b.txt" },
+#if EEPSECTOR_SIZE == 512
+	{ "old.mrb", "a2.mrb" },
+#endif
+};
+
+static char Dir[] = "/tmp/eepptyXXXXXX";
+
+//作業ディレクトリのファイルのパスを返します
+static const char *path(const char *name)
+{
+	static char buf[4][64];
+	static int n;
+	n = (n + 1) % 4;
+	snprintf(buf[n], sizeof(buf[n]), "%s/%s", Dir, name);
+	return buf[n];
+}
+
+static void putHost(const char *name, const char *data, int size)
+{
+	FILE *fp = fopen(path(name), "wb");
+	fwrite(data, 1, size, fp);
+	fclose(fp);
+}
+
+//ホストのファイルを読み込みます。無いときは-1を返します
+static int getHost(const char *name, char *buf, int size)
+{
+	FILE *fp = fopen(path(name), "rb");
+	if (fp == NULL){
+		return -1;
+	}
+	int len = fread(buf, 1, size, fp);
+	fclose(fp);
+	return len;
+}
+
+//送るファイルを作ります
+static void makeFiles(void)
+{
+	static char a[5000];
+	static char b[3000];
+
+	srand(1);
+	for (unsigned int i = 0; i < sizeof(a); i++){
+		a[i] = rand();
+	}
+	putHost("a.mrb", a, sizeof(a));
+
+	//2つ目のブロックだけを変えます
+	memset(a + 600, 'J', 100);
+	putHost("a2.mrb", a, sizeof(a));
+	putHost("m.mrb", a, 1200);
+	putHost("old.mrb", a, 2000);
+
+	int len = 0;
+	for (int i = 0; len < (int)sizeof(b) - 40; i++){
+		len += snprintf(b + len, sizeof(b) - len, "line %d: Wakayama.rb Ruby Board\n", i);
+	}
+	putHost("b.txt", b, len);
+
+	char man[256];
+	len = snprintf(man, sizeof(man), "# eeppty\nD c.txt\nW %s m.txt\n", path("m.mrb"));
+	putHost("man.txt", man, len);
+}
+
+//eepsendを実行して、終了コードを返します。送り直したフレームの数をresentに入れます
+//wantがあるときは、出力に無ければfoundをfalseにします
+static int runSend(const char *send, const char *port, const PTYSTEP *s, int *resent, bool *found)
+{
+	const char *argv[12];
+	int n = 0;
+	argv[n++] = send;
+	for (int i = 0; s->args[i] != NULL; i++){
+		argv[n++] = s->args[i];
+	}
+	argv[n++] = port;
+	argv[n++] = path(s->file);
+	if (s->dest != NULL){
+		argv[n++] = s->dest;
+	}
+	argv[n] = NULL;
+
+	int fds[2];
+	if (pipe(fds) == -1){
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0){
+		dup2(fds[1], 1);
+		dup2(fds[1], 2);
+		close(fds[0]);
+		execv(send, (char* const*)argv);
+		perror(send);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	//出力の"N resent"を探します
+	char out[1024];
+	int len = 0;
+	int r;
+	while ((r = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0){
+		len += r;
+	}
+	out[len] = 0;
+	close(fds[0]);
+	printf("%s", out);
+
+	*found = (s->want == NULL || strstr(out, s->want) != NULL);
+	*resent = 0;
+	for (char *p = strstr(out, " resent"); p != NULL; p = strstr(p + 1, " resent")){
+		char *q = p;
+		while (q > out && q[-1] >= '0' && q[-1] <= '9'){
+			q--;
+		}
+		*resent += atoi(q);
+	}
+
+	int st;
+	waitpid(pid, &st, 0);
+	return WIFEXITED(st) ? WEXITSTATUS(st) : -1;
+}
+
+//Gコマンドで受け取ったファイルが、送ったファイルと同じかを調べます
+static bool getBack(const char *send, const char *port, const char *name, const char *file)
+{
+	static char want[PTY_FILE];
+	static char got[PTY_FILE];
+	const char *argv[] = { send, "-g", port, name, path("got.bin"), NULL };
+
+	unlink(path("got.bin"));
+	pid_t pid = fork();
+	if (pid == 0){
+		execv(send, (char* const*)argv);
+		_exit(127);
+	}
+	int st;
+	waitpid(pid, &st, 0);
+
+	int wlen = getHost(file, want, sizeof(want));
+	int glen = getHost("got.bin", got, sizeof(got));
+	return WIFEXITED(st) && WEXITSTATUS(st) == 0 && wlen == glen && memcmp(want, got, wlen) == 0;
+}
+
+//eepsendと同じように、コマンド待ちの'>'のあとで出力が止まるのを待ってから、Qを送ります
+//lineinput()は入る前に届いていた入力を捨てるので、すぐに送ると届きません
+static int quit(int slave)
+{
+	if (write(slave, "\r", 1) != 1){
+		return -1;
+	}
+	long left = 3000 / 20;
+	int last = -1;
+	while (true){
+		struct pollfd p = { slave, POLLIN, 0 };
+		unsigned char c;
+		if (poll(&p, 1, 20) > 0 && read(slave, &c, 1) == 1){
+			last = c;
+		}
+		else if (last == '>'){
+			break;
+		}
+		else if (--left < 0){
+			return -1;
+		}
+	}
+	return (write(slave, "Q\r", 2) == 2) ? 0 : -1;
+}
+
+//子プロセスでeepsendを順に実行して、最後にQでローダーを終わらせます。失敗した数を返します
+static int sender(const char *send, const char *port, int slave)
+{
+	int fails = 0;
+
+	for (unsigned int k = 0; k < sizeof(Steps) / sizeof(Steps[0]); k++){
+		const PTYSTEP *s = &Steps[k];
+		int resent = 0;
+		bool found = false;
+
+		if (s->legacy && EEPSECTOR_SIZE != 512){
+			continue;
+		}
+		tcflush(slave, TCIFLUSH);
+		int r = runSend(send, port, s, &resent, &found);
+		bool ok = (r == 0) && (!s->resend || resent > 0) && found;
+		printf("%-18s exit %d, resent %d: %s\n", s->name, r, resent, ok ? "OK" : "NG");
+		if (!ok){
+			fails++;
+		}
+	}
+
+	//Gコマンドで受け取って比べます
+	tcflush(slave, TCIFLUSH);
+	bool ok = getBack(send, port, "a.mrb", "a2.mrb") && getBack(send, port, "c.txt", "b.txt") == false;
+	printf("%-18s %s\n", "G", ok ? "OK" : "NG");
+	if (!ok){
+		fails++;
+	}
+
+	if (quit(slave) == -1){
+		fails++;
+	}
+	return fails;
+}
+
+//ボードに残ったファイルを調べます。失敗した数を返します
+static int checkBoard(void)
+{
+	static char want[PTY_FILE];
+	static char got[PTY_FILE];
+	int fails = 0;
+
+	for (unsigned int k = 0; k < sizeof(Expect) / sizeof(Expect[0]); k++){
+		const PTYEXPECT *e = &Expect[k];
+		bool ok;
+
+		if (e->file == NULL){
+			ok = !EEP.fexist(e->name);
+		}
+		else{
+			FILEEEP fp;
+			int wlen = getHost(e->file, want, sizeof(want));
+			ok = EEP.fexist(e->name) && EEP.fopen(&fp, e->name, EEP_READ) != -1;
+			if (ok){
+				int verify = EEP.fverify(&fp);
+				int glen = EEP.fread(&fp, got, sizeof(got));
+				EEP.fclose(&fp);
+				ok = verify == 1 && glen == wlen && memcmp(want, got, wlen) == 0;
+			}
+		}
+		printf("board %-12s %s\n", e->name, ok ? "OK" : "NG");
+		if (!ok){
+			fails++;
+		}
+	}
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	const char *send = (argc > 1) ? argv[1] : "./gr_build/eepsend";
+
+	if (mkdtemp(Dir) == NULL){
+		perror(Dir);
+		return 1;
+	}
+	makeFiles();
+
+	//ボード側をptyのマスターにします。スレーブは生のモードにして、最後まで開いておきます
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1){
+		perror("posix_openpt");
+		return 1;
+	}
+	char port[64];
+	snprintf(port, sizeof(port), "%s", ptsname(master));
+	int slave = open(port, O_RDWR | O_NOCTTY);
+	struct termios tio;
+	if (slave == -1 || tcgetattr(slave, &tio) == -1){
+		perror(port);
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	//元のファームウェアで書いたCRCの無いファイルを置いてから、移行させます
+	//セクタサイズが違うときは移行できずにフォーマットし直されるので、CRCの無いファイルは作れません
+	flashsim_oldformat();
+	if (EEPSECTOR_SIZE == 512){
+		static char old[2000];
+		getHost("old.mrb", old, sizeof(old));
+		flashsim_oldfile(10, "old.mrb", old, sizeof(old));
+	}
+	EEP.begin();
+
+	//Jコマンドで書き換えられないリングログを作っておきます
+	FILEEEP ring;
+	EEP.fopen(&ring, "ring.log", EEP_APPEND | EEP_RING, 1024);
+	EEP.fputrec(&ring, "eeppty", 6);
+	EEP.fclose(&ring);
+	flashsim_realtime(true);
+	Serial.fd = master;
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	pid_t pid = fork();
+	if (pid == 0){
+		alarm(PTY_TIMEOUT);
+		_exit(sender(send, port, slave) == 0 ? 0 : 1);
+	}
+
+	//Pコマンドで実行するファイルがあるときはfileloader()から戻るので、Qまで続けます
+	alarm(PTY_TIMEOUT);
+	while (fileloader("eeppty", "") != 0){
+	}
+
+	int st;
+	waitpid(pid, &st, 0);
+	int fails = (WIFEXITED(st) && WEXITSTATUS(st) == 0) ? 0 : 1;
+	fails += checkBoard();
+
+	static const char *Files[] = { "a.mrb", "a2.mrb", "m.mrb", "old.mrb", "b.txt", "man.txt", "got.bin" };
+	for (unsigned int k = 0; k < sizeof(Files) / sizeof(Files[0]); k++){
+		unlink(path(Files[k]));
+	}
+	rmdir(Dir);
+
+	if (fails != 0){
+		printf("FAILED: %d\n", fails);
+		return 1;
+	}
+	return 0;
+}
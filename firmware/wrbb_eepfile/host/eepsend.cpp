@@ -0,0 +1,611 @@
+/*
+ * ローダーのBコマンド(フレーム転送)でファイルを送るホスト側のプログラム
+ *
+ *  eepsend [-z] [-w 窓の数] [-e N] ポート ファイル [ボードでのファイル名]
+ *    -z  ボードで圧縮して保存する
+ *    -w  ACKを待たずに送るフレームの数(1～64, 標準4)
+ *    -e  N回に1回、わざとCRCを壊して送る(再送の確認用)
+ *
+ *  eepsend -g ポート ボードでのファイル名 [保存するファイル]
+ *    Gコマンドでファイルを受け取って、転送速度を表示する
+ *
+ *  eepsend -d [-w 窓の数] [-e N] ポート ファイル [ボードでのファイル名]
+ *    Iコマンドでボードのファイルのブロックごとのハッシュを受け取り、変わったブロックだけをJコマンドで送る
+ *    ボードにファイルが無いときや、書き換えられなかったときは、Bコマンドで全部送る
+ *
+ *  eepsend -p [-w 窓の数] [-e N] ポート マニフェストファイル
+ *    Pコマンドで、マニフェストに書いた削除・書き込み・実行をまとめて1回の転送で行う
+ *    マニフェストの書き方はbuildManifest()を見てください
+ *
+ *  ボードはローダーのコマンド待ち('>')にしておきます
+ *  フレームの形式はeeploader.cppのframefile()を見てください
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/time.h>
+
+#define FRAME_SIZE		256		//フレームのデータの最大バイト数。ボードのUPLOAD_BUF_SIZEと同じ
+#define FRAME_STX		0x02
+#define FRAME_ENQ		0x05
+#define FRAME_ACK		0x06
+#define FRAME_NAK		0x15
+#define FRAME_CAN		0x18
+#define ACK_TIMEOUT		2000	//ACKを待つ時間(msec)。過ぎたら窓の頭から送り直す
+#define MAX_RETRY		10		//続けて送り直す最大回数
+#define DELTA_BLOCK		512		//Iコマンドのハッシュのブロックのバイト数。ボードと同じ
+
+static int Port = -1;
+
+//CRC-16(CCITT)。ボードのcrc16()と同じ
+static unsigned short crc16(unsigned short crc, const unsigned char *p, int len)
+{
+	for (int i = 0; i < len; i++){
+		crc ^= p[i] << 8;
+		for (int b = 0; b < 8; b++){
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static long msec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+//1バイト受信します。msecまでに来なければ-1を返します
+static int getByte(int ms)
+{
+	struct pollfd pfd = { Port, POLLIN, 0 };
+	unsigned char c;
+	if (poll(&pfd, 1, ms) <= 0 || read(Port, &c, 1) != 1){
+		return -1;
+	}
+	return c;
+}
+
+static void putBytes(const void *buf, int len)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+	while (len > 0){
+		int n = write(Port, p, len);
+		if (n <= 0){
+			perror("write");
+			exit(1);
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+//ボードのローダーのコマンド待ち('>')を待って、コマンドを送ります
+//ヘルプの表示の中にも'>'があるので、'>'のあとに出力が止まるまで待ちます
+static int sendCommand(const char *cmd)
+{
+	putBytes("\r", 1);
+	long tm = msec() + 3000;
+	int last = -1;
+	while (true){
+		int c = getByte(20);
+		if (c != -1){
+			last = c;
+		}
+		else if (last == '>'){
+			break;
+		}
+		else if (msec() > tm){
+			return -1;
+		}
+	}
+	putBytes(cmd, strlen(cmd));
+	putBytes("\r", 1);
+	return 0;
+}
+
+//文字列が来るまで読み飛ばします
+static int waitText(const char *text, int ms)
+{
+	long tm = msec() + ms;
+	int n = 0;
+	while (text[n] != 0){
+		int c = getByte(tm - msec());
+		if (c == -1){
+			return -1;
+		}
+		n = (c == text[n]) ? n + 1 : (c == text[0] ? 1 : 0);
+	}
+	return 0;
+}
+
+//Gコマンドでファイルを受け取ります
+static int getFile(const char *name, const char *path)
+{
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "G %s", name);
+	if (sendCommand(cmd) == -1){
+		fprintf(stderr, "no loader prompt\n");
+		return 1;
+	}
+
+	//ボードは入力を待ってからファイルサイズを送り、もう一度入力を待ってからデータを送ります
+	if (waitText("Waiting", 3000) == -1){
+		return 1;
+	}
+	putBytes("\r", 1);
+	if (waitText("\r\n", 3000) == -1){
+		return 1;
+	}
+
+	int size = 0;
+	bool minus = false;
+	int c;
+	while ((c = getByte(3000)) != '\r'){
+		if (c == -1){
+			return 1;
+		}
+		if (c == '-'){
+			minus = true;
+		}
+		else if (c >= '0' && c <= '9'){
+			size = size * 10 + c - '0';
+		}
+	}
+	if (waitText("Waiting", 3000) == -1){
+		return 1;
+	}
+	putBytes("\r", 1);
+	if (waitText("\r\n", 3000) == -1){
+		return 1;
+	}
+
+	//無いファイルはサイズ0のあとに"..Read Error!"が来ます
+	if (minus || (size == 0 && waitText("Read Error", 300) == 0)){
+		fprintf(stderr, "%s: not found\n", name);
+		return 1;
+	}
+
+	static unsigned char data[0x10000];
+	long start = msec();
+	int got = 0;
+	while (got < size && got < (int)sizeof(data)){
+		c = getByte(2000);
+		if (c == -1){
+			fprintf(stderr, "%s: timed out at %d of %d bytes\n", name, got, size);
+			return 1;
+		}
+		data[got++] = c;
+		struct pollfd pfd = { Port, POLLIN, 0 };
+		if (poll(&pfd, 1, 0) > 0){
+			int n = read(Port, &data[got], (size - got < (int)sizeof(data) - got) ? size - got : (int)sizeof(data) - got);
+			if (n > 0){
+				got += n;
+			}
+		}
+	}
+	long ms = msec() - start;
+
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL){
+		perror(path);
+		return 1;
+	}
+	fwrite(data, 1, got, fp);
+	fclose(fp);
+
+	printf("%s: %d bytes, %ld ms (%.1f KB/s)\n", name, got, ms, ms > 0 ? got / (double)ms : 0.0);
+	return 0;
+}
+
+//idx番目のフレームを送ります。データが無ければ終わりのフレームになります
+static void sendFrame(const unsigned char *data, int size, int idx, bool broken)
+{
+	unsigned char fr[FRAME_SIZE + 6];
+	int off = idx * FRAME_SIZE;
+	int len = size - off;
+	if (len > FRAME_SIZE){
+		len = FRAME_SIZE;
+	}
+	if (len < 0){
+		len = 0;
+	}
+
+	fr[0] = FRAME_STX;
+	fr[1] = idx & 0xFF;
+	fr[2] = len & 0xFF;
+	fr[3] = (len >> 8) & 0xFF;
+	memcpy(&fr[4], &data[off], len);
+	unsigned short crc = crc16(0xFFFF, &fr[1], len + 3);
+	if (broken){
+		crc ^= 0x5A5A;
+	}
+	fr[len + 4] = crc & 0xFF;
+	fr[len + 5] = (crc >> 8) & 0xFF;
+	putBytes(fr, len + 6);
+}
+
+//ボードのENQを待って、dataをフレームに分けてGo-Back-Nで送ります
+//送り終えたら0を返し、送り直したフレームの数をresentに入れます
+static int sendFrames(const unsigned char *data, int size, int window, int errEvery, int *resent)
+{
+	//ボードの受信準備(ENQ)を待ちます
+	int c;
+	long tm = msec() + 10000;
+	while ((c = getByte(tm - msec())) != FRAME_ENQ){
+		if (c == -1 || c == FRAME_CAN){
+			fprintf(stderr, "board did not accept the file (%d)\n", c == FRAME_CAN ? getByte(1000) : -1);
+			return -1;
+		}
+	}
+
+	//Go-Back-N: baseからnextの手前までがACK待ち。終わりのフレームはframes番目
+	int frames = (size + FRAME_SIZE - 1) / FRAME_SIZE;
+	int base = 0;
+	int next = 0;
+	int sent = 0;
+	int retry = 0;
+
+	tm = msec() + ACK_TIMEOUT;
+	while (base <= frames){
+		while (next <= frames && next < base + window){
+			bool first = (next >= sent);
+			sendFrame(data, size, next, first && errEvery > 0 && (next % errEvery) == errEvery - 1);
+			if (first){
+				sent = next + 1;
+			}
+			else{
+				(*resent)++;
+			}
+			next++;
+		}
+
+		c = getByte(tm - msec());
+		if (c == -1){
+			//応答が無いときは、窓の頭から送り直します
+			if (++retry > MAX_RETRY){
+				fprintf(stderr, "no response from the board\n");
+				return -1;
+			}
+			next = base;
+			tm = msec() + ACK_TIMEOUT;
+			continue;
+		}
+
+		int arg = (c == FRAME_ACK || c == FRAME_NAK || c == FRAME_CAN) ? getByte(ACK_TIMEOUT) : -1;
+		int idx = base + ((arg - base) & 0xFF);		//通番の下位8ビットから、フレームの番号に戻します
+		if (c == FRAME_CAN){
+			fprintf(stderr, "board cancelled the transfer (%d)\n", arg);
+			return -1;
+		}
+		else if (c == FRAME_ACK && arg != -1 && idx < next){
+			base = idx + 1;
+			retry = 0;
+			tm = msec() + ACK_TIMEOUT;
+		}
+		else if (c == FRAME_NAK && arg != -1 && idx <= next){
+			next = idx;
+			tm = msec() + ACK_TIMEOUT;
+		}
+	}
+
+	return 0;
+}
+
+//Iコマンドでボードのファイルのブロックごとのハッシュを受け取って、変わったブロックだけをJコマンドで送ります
+//送れたら0を、ボードにファイルが無いときや書き換えられなかったときは-1を返します
+static int deltaFile(const unsigned char *data, int size, const char *name, int window, int errEvery)
+{
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "I %s", name);
+	if (sendCommand(cmd) == -1){
+		fprintf(stderr, "no loader prompt\n");
+		return -1;
+	}
+	if (waitText("BLOCKS ", 3000) == -1){
+		return -1;
+	}
+
+	//ファイルサイズと、4桁の16進数のハッシュが並んだ行を読みます
+	int old = 0;
+	bool minus = false;
+	int c;
+	while ((c = getByte(3000)) != '\r'){
+		if (c == -1){
+			return -1;
+		}
+		if (c == '-'){
+			minus = true;
+		}
+		else if (c >= '0' && c <= '9'){
+			old = old * 10 + c - '0';
+		}
+	}
+	if (minus){
+		printf("%s: not on the board\n", name);
+		return -1;
+	}
+
+	static unsigned short hash[0x10000 / DELTA_BLOCK];
+	int oldBlocks = (old + DELTA_BLOCK - 1) / DELTA_BLOCK;
+	char hex[5];
+	getByte(3000);		//'\n'
+	for (int b = 0; b < oldBlocks; b++){
+		for (int i = 0; i < 4; i++){
+			if ((c = getByte(3000)) == -1){
+				return -1;
+			}
+			hex[i] = c;
+		}
+		hex[4] = 0;
+		if (b < (int)(sizeof(hash) / sizeof(hash[0]))){
+			hash[b] = strtoul(hex, NULL, 16);
+		}
+	}
+
+	//変わったブロックを、ブロック番号(2バイト)のあとにデータを付けて並べます
+	static unsigned char buf[0x10000 / DELTA_BLOCK * (DELTA_BLOCK + 2)];
+	int blocks = (size + DELTA_BLOCK - 1) / DELTA_BLOCK;
+	int changed = 0;
+	int len = 0;
+	for (int b = 0; b < blocks; b++){
+		int off = b * DELTA_BLOCK;
+		int n = (size - off < DELTA_BLOCK) ? size - off : DELTA_BLOCK;
+		int on = (old - off < DELTA_BLOCK) ? old - off : DELTA_BLOCK;
+		if (b < oldBlocks && n == on && crc16(0xFFFF, &data[off], n) == hash[b]){
+			continue;
+		}
+		buf[len++] = b & 0xFF;
+		buf[len++] = (b >> 8) & 0xFF;
+		memcpy(&buf[len], &data[off], n);
+		len += n;
+		changed++;
+	}
+	if (changed == 0 && size == old){
+		printf("%s: unchanged (%d blocks)\n", name, blocks);
+		return 0;
+	}
+
+	snprintf(cmd, sizeof(cmd), "J %s %d %04X", name, size, crc16(0xFFFF, data, size));
+	if (sendCommand(cmd) == -1){
+		fprintf(stderr, "no loader prompt\n");
+		return -1;
+	}
+
+	int resent = 0;
+	long start = msec();
+	if (sendFrames(buf, len, window, errEvery, &resent) == -1){
+		return -1;
+	}
+	long ms = msec() - start;
+	printf("%s: %d of %d blocks changed, %d bytes sent, %d resent, %ld ms\n", name, changed, blocks, len, resent, ms);
+	return 0;
+}
+
+//マニフェストファイルからPコマンドで送るデータを作ります
+//  D 名前                        ボードのファイルを削除する
+//  W ファイル [ボードでの名前] [Z]  ファイルを書き込む。Zは圧縮して保存する
+//  R 名前                        全部成功したら、ボードでこのファイルを実行する
+//  #で始まる行と空の行は読み飛ばす
+static int buildManifest(const char *path, unsigned char *buf, int size)
+{
+	FILE *mf = fopen(path, "r");
+	if (mf == NULL){
+		perror(path);
+		return -1;
+	}
+
+	char line[256];
+	int len = 0;
+	while (fgets(line, sizeof(line), mf) != NULL){
+		char op[8], arg1[200], arg2[64], arg3[8];
+		int n = sscanf(line, "%7s %199s %63s %7s", op, arg1, arg2, arg3);
+		if (n <= 0 || op[0] == '#'){
+			continue;
+		}
+		if (n < 2){
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			fclose(mf);
+			return -1;
+		}
+
+		if (strcmp(op, "W") != 0){
+			len += snprintf((char*)&buf[len], size - len, "%s %s\n", op, arg1);
+		}
+		else{
+			//W ファイル Z のときは、ボードでの名前はファイル名にします
+			bool zip = (n > 3 && strcmp(arg3, "Z") == 0) || (n == 3 && strcmp(arg2, "Z") == 0);
+			const char *name = (n > 2 && strcmp(arg2, "Z") != 0) ? arg2 : arg1;
+			if (strrchr(name, '/') != NULL){
+				name = strrchr(name, '/') + 1;
+			}
+
+			FILE *fp = fopen(arg1, "rb");
+			if (fp == NULL){
+				perror(arg1);
+				fclose(mf);
+				return -1;
+			}
+			static unsigned char data[0x8000];
+			int fsize = fread(data, 1, sizeof(data), fp);
+			fclose(fp);
+
+			len += snprintf((char*)&buf[len], size - len, "W %s %d %04X%s\n", name, fsize, crc16(0xFFFF, data, fsize), zip ? " Z" : "");
+			if (len + fsize >= size){
+				len = size;
+			}
+			else{
+				memcpy(&buf[len], data, fsize);
+				len += fsize;
+			}
+		}
+		if (len >= size){
+			fprintf(stderr, "%s: too large\n", path);
+			fclose(mf);
+			return -1;
+		}
+	}
+	fclose(mf);
+	return len;
+}
+
+//Pコマンドでマニフェストを送り、ボードの結果を表示します。全部成功したら0を返します
+static int runManifest(const char *path, int window, int errEvery)
+{
+	static unsigned char data[0x10000];
+	int size = buildManifest(path, data, sizeof(data));
+	if (size == -1){
+		return 1;
+	}
+
+	if (sendCommand("P") == -1){
+		fprintf(stderr, "no loader prompt\n");
+		return 1;
+	}
+
+	int resent = 0;
+	long start = msec();
+	if (sendFrames(data, size, window, errEvery, &resent) == -1){
+		return 1;
+	}
+
+	//結果は1行ずつ"OK|NG 操作 名前 [理由]"で、最後が"END 成功の数 失敗の数"です
+	char line[128];
+	int len = 0;
+	int ok = -1;
+	int ng = -1;
+	while (ok == -1){
+		int c = getByte(3000);
+		if (c == -1){
+			fprintf(stderr, "no report from the board\n");
+			return 1;
+		}
+		if (c == '\r'){
+			continue;
+		}
+		if (c != '\n'){
+			if (len < (int)sizeof(line) - 1){
+				line[len++] = c;
+			}
+			continue;
+		}
+		line[len] = 0;
+		len = 0;
+		if (sscanf(line, "END %d %d", &ok, &ng) != 2){
+			ok = -1;
+			if (line[0] != 0){
+				printf("%s\n", line);
+			}
+		}
+	}
+	long ms = msec() - start;
+	printf("%d ok, %d ng, %d bytes, %d resent, %ld ms\n", ok, ng, size, resent, ms);
+	return ng == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	bool zip = false;
+	bool delta = false;
+	bool get = false;
+	bool manifest = false;
+	int window = 4;
+	int errEvery = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "dgpzw:e:")) != -1){
+		switch (opt){
+		case 'd':	delta = true;	break;
+		case 'g':	get = true;	break;
+		case 'p':	manifest = true;	break;
+		case 'z':	zip = true;	break;
+		case 'w':	window = atoi(optarg);	break;
+		case 'e':	errEvery = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "usage: eepsend [-z] [-w window] [-e N] port file [name]\n       eepsend -d [-w window] [-e N] port file [name]\n       eepsend -g port name [file]\n       eepsend -p [-w window] [-e N] port manifest\n");
+			return 2;
+		}
+	}
+	if (argc - optind < 2 || window < 1 || window > 64){
+		fprintf(stderr, "usage: eepsend [-z] [-w window] [-e N] port file [name]\n       eepsend -d [-w window] [-e N] port file [name]\n       eepsend -g port name [file]\n       eepsend -p [-w window] [-e N] port manifest\n");
+		return 2;
+	}
+	const char *path = argv[optind + 1];
+	const char *name = (argc - optind > 2) ? argv[optind + 2] : path;
+	if (strrchr(name, '/') != NULL){
+		name = strrchr(name, '/') + 1;
+	}
+
+	//ポートを生のモードで開きます
+	Port = open(argv[optind], O_RDWR | O_NOCTTY);
+	if (Port == -1){
+		perror(argv[optind]);
+		return 1;
+	}
+	struct termios tio;
+	if (tcgetattr(Port, &tio) == 0){
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, B115200);
+		tcsetattr(Port, TCSANOW, &tio);
+	}
+
+	if (get){
+		//-gのときは、2つ目がボードのファイル名で、3つ目が保存するファイル
+		return getFile(path, (argc - optind > 2) ? argv[optind + 2] : name);
+	}
+	if (manifest){
+		return runManifest(path, window, errEvery);
+	}
+
+	//送るファイルを読み込みます
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL){
+		perror(path);
+		return 1;
+	}
+	static unsigned char data[0x10000];
+	int size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+	if (size >= (int)sizeof(data)){
+		fprintf(stderr, "%s: too large\n", path);
+		return 1;
+	}
+
+	//-dのときは、変わったブロックだけを送ります。送れなかったときは全部送ります
+	//圧縮ファイルはその場で書き換えられないので、-zのときは全部送ります
+	if (delta && !zip){
+		if (deltaFile(data, size, name, window, errEvery) == 0){
+			return 0;
+		}
+		printf("%s: sending the whole file\n", name);
+	}
+
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "B %s %d%s", name, size, zip ? " Z" : "");
+	if (sendCommand(cmd) == -1){
+		fprintf(stderr, "no loader prompt\n");
+		return 1;
+	}
+
+	int resent = 0;
+	long start = msec();
+	if (sendFrames(data, size, window, errEvery, &resent) == -1){
+		return 1;
+	}
+
+	long ms = msec() - start;
+	printf("%s: %d bytes, %d frames, %d resent, %ld ms (%.1f KB/s)\n",
+		name, size, (size + FRAME_SIZE - 1) / FRAME_SIZE + 1, resent, ms, ms > 0 ? size / (double)ms : 0.0);
+	return 0;
+}
@@ -0,0 +1,390 @@
+/*
+ * RX63Nのデータフラッシュのエミュレータ
+ * r_flash_api_rx600.cの代わりにリンクして、EEPROMClassとEEPFILEをLinuxで動かします
+ *
+ * データフラッシュ(32KB)をDF_ADDRESSにmmapしたメモリで用意するので、
+ * EEPFILEがデータフラッシュのアドレスから直接読み込むところもそのまま動きます
+ *
+ * 実機と同じように
+ *  消去はイレースブロック(32バイト)単位、書き込みはDF_ALIGN(2バイト)単位
+ *  消去した箇所はブランクになり、読み出した値は不定(乱数)になる
+ *  ブランクでない箇所に書き込むのはエラー
+ * としています
+ *
+ * flashsim_cut()で、指定した回数の消去か書き込みのところで電源が切れたことにできます
+ * 切れたときの操作は途中で止まって値は不定になり、それより後の操作はフラッシュを変えません
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include "Arduino.h"
+#include "EEPROM/utility/r_flash_api_rx600.h"
+#include "flashsim.h"
+
+//MAP_FIXED_NOREPLACEが無いときは、アドレスは希望として渡して、その場所に取れたかを調べます
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE	0
+#endif
+
+#define SIM_SIZE	0x8000
+#define SIM_BLOCKS	(SIM_SIZE / DF_ERASE_BLOCK_SIZE)
+
+HardwareSerial Serial;
+FLASHSIM_STAT FlashSim;
+
+static unsigned char *Mem;					//DF_ADDRESSにmmapしたデータフラッシュ
+static bool Blank[SIM_SIZE / DF_ALIGN];		//DF_ALIGN単位のブランク状態
+static unsigned long BlockErase[SIM_BLOCKS];	//イレースブロックごとの消去回数
+static unsigned long Now;					//仮想時計(us)
+static long CutLeft = -1;					//電源が切れるまでの消去と書き込みの回数。-1のときは切れない
+static bool PowerOff;						//電源が切れている
+static bool RealTime;						//millis()とdelay()を実際の時計にする
+
+//******************************************************
+// Serialの読み書き。fdが-1のときは標準出力に出して、入力は無しにします
+//******************************************************
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+	if (fd == -1){
+		return fwrite(buf, 1, len, stdout);
+	}
+	size_t n = 0;
+	while (n < len){
+		ssize_t r = ::write(fd, buf + n, len - n);
+		if (r <= 0){
+			break;
+		}
+		n += r;
+	}
+	return n;
+}
+
+int HardwareSerial::available(void)
+{
+	if (peek != -1){
+		return 1;
+	}
+	if (fd == -1){
+		return 0;
+	}
+
+	struct pollfd p = { fd, POLLIN, 0 };
+	unsigned char c;
+	if (poll(&p, 1, 0) > 0 && ::read(fd, &c, 1) == 1){
+		peek = c;
+		return 1;
+	}
+	return 0;
+}
+
+int HardwareSerial::read(void)
+{
+	if (!available()){
+		return -1;
+	}
+	int c = peek;
+	peek = -1;
+	return c;
+}
+
+//******************************************************
+// 時計。flashsim_realtime()のときは実際の時計を使います
+//******************************************************
+unsigned long micros(void)
+{
+	if (!RealTime){
+		return Now;
+	}
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000UL + t.tv_nsec / 1000;
+}
+
+unsigned long millis(void){	return micros() / 1000;	}
+
+void delay(unsigned long ms)
+{
+	if (RealTime){
+		usleep(ms * 1000);
+	}
+	else{
+		Now += ms * 1000;
+	}
+}
+
+//******************************************************
+// millis()とdelay()を実際の時計にします
+// シリアルの相手が別のプロセスのときに、受信のタイムアウトを実際の時間にするために使います
+//******************************************************
+void flashsim_realtime(bool on)
+{
+	RealTime = on;
+}
+
+//******************************************************
+// 全てブランクにして、回数と時計を0にします
+//******************************************************
+void flashsim_clear(void)
+{
+	for (int i = 0; i < SIM_SIZE; i++){
+		Mem[i] = rand();
+	}
+	for (int i = 0; i < SIM_SIZE / DF_ALIGN; i++){
+		Blank[i] = true;
+	}
+	flashsim_reset_stat();
+	Now = 0;
+}
+
+//******************************************************
+// 回数と、イレースブロックごとの消去回数を0にします
+//******************************************************
+void flashsim_reset_stat(void)
+{
+	memset(&FlashSim, 0, sizeof(FlashSim));
+	CutLeft = -1;
+	PowerOff = false;
+	memset(BlockErase, 0, sizeof(BlockErase));
+}
+
+//******************************************************
+// イレースブロックごとの消去回数の最大値を返します
+//******************************************************
+unsigned long flashsim_hottest(void)
+{
+	unsigned long mx = 0;
+	for (int i = 0; i < SIM_BLOCKS; i++){
+		if (BlockErase[i] > mx){
+			mx = BlockErase[i];
+		}
+	}
+	return mx;
+}
+
+//******************************************************
+// データフラッシュの先頭からaddrバイト目を含むイレースブロックの消去回数を返します
+//******************************************************
+unsigned long flashsim_block_erase(unsigned long addr)
+{
+	if (addr >= SIM_SIZE){
+		return 0;
+	}
+	return BlockErase[addr / DF_ERASE_BLOCK_SIZE];
+}
+
+//******************************************************
+// 消去と書き込み(DF_ALIGN単位)をn回したあと、次の操作の途中で電源が切れたことにします
+// nが-1のときは電源を戻して、切れないようにします
+//******************************************************
+void flashsim_cut(long n)
+{
+	CutLeft = n;
+	PowerOff = false;
+}
+
+//操作の前に呼びます。0:操作する、1:この操作の途中で電源が切れる、2:電源が切れているので何もしない
+static int powerCheck(void)
+{
+	if (PowerOff){
+		return 2;
+	}
+	if (CutLeft < 0){
+		return 0;
+	}
+	if (CutLeft-- == 0){
+		PowerOff = true;
+		return 1;
+	}
+	return 0;
+}
+
+//途中で止まった操作の箇所を、不定の値でブランクでない状態にします
+static void tear(long a, int len)
+{
+	for (int i = 0; i < len; i++){
+		Mem[a + i] = rand();
+	}
+	for (int i = 0; i < len / DF_ALIGN; i++){
+		Blank[a / DF_ALIGN + i] = false;
+	}
+}
+
+//データフラッシュのアドレスからエミュレータの位置を求めます。範囲外のときは-1を返す
+static long simOffset(uint32_t addr)
+{
+	if (addr < DF_ADDRESS || addr >= DF_ADDRESS + SIM_SIZE){
+		return -1;
+	}
+	return addr - DF_ADDRESS;
+}
+
+extern "C" {
+
+//******************************************************
+// データフラッシュをDF_ADDRESSにmmapします
+//******************************************************
+uint8_t flash_Initialize(void)
+{
+	if (Mem != NULL){
+		return FLASH_SUCCESS;
+	}
+
+	void *p = mmap((void*)DF_ADDRESS, SIM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (p != (void*)DF_ADDRESS){
+		fprintf(stderr, "flashsim: cannot map data flash at 0x%X\n", DF_ADDRESS);
+		exit(1);
+	}
+	Mem = (unsigned char*)p;
+	flashsim_clear();
+	return FLASH_SUCCESS;
+}
+
+//******************************************************
+// イレースブロックを消去します。読み出した値は不定になります
+//******************************************************
+uint8_t flash_datarom_EraseBlock(const uint32_t addr)
+{
+	long a = simOffset(addr);
+	if (a < 0){
+		FlashSim.error++;
+		return FLASH_FAILURE;
+	}
+	a &= ~(DF_ERASE_BLOCK_SIZE - 1);
+
+	switch (powerCheck()){
+	case 1:
+		tear(a, DF_ERASE_BLOCK_SIZE);
+		return FLASH_SUCCESS;
+	case 2:
+		return FLASH_SUCCESS;
+	}
+
+	for (int i = 0; i < DF_ERASE_BLOCK_SIZE; i++){
+		Mem[a + i] = rand();
+	}
+	for (int i = 0; i < DF_ERASE_BLOCK_SIZE / DF_ALIGN; i++){
+		Blank[a / DF_ALIGN + i] = true;
+	}
+	FlashSim.erase++;
+	BlockErase[a / DF_ERASE_BLOCK_SIZE]++;
+	Now += FLASHSIM_ERASE_US;
+	return FLASH_SUCCESS;
+}
+
+//******************************************************
+// DF_ALIGN単位で書き込みます。ブランクでない箇所への書き込みはエラーにします
+//******************************************************
+uint8_t flash_datarom_WriteData(const uint32_t addr, void *pData, const uint16_t nDataSize)
+{
+	long a = simOffset(addr);
+	if (a < 0 || a + nDataSize > SIM_SIZE || (a % DF_ALIGN) != 0 || (nDataSize % DF_ALIGN) != 0){
+		FlashSim.error++;
+		return FLASH_FAILURE;
+	}
+
+	const unsigned char *p = (const unsigned char*)pData;
+	for (int i = 0; i < nDataSize; i += DF_ALIGN){
+		switch (powerCheck()){
+		case 1:
+			tear(a + i, DF_ALIGN);
+			return FLASH_SUCCESS;
+		case 2:
+			return FLASH_SUCCESS;
+		}
+
+		if (!Blank[(a + i) / DF_ALIGN]){
+			fprintf(stderr, "flashsim: program non-blank 0x%lX\n", a + i);
+			FlashSim.error++;
+			return FLASH_FAILURE;
+		}
+		memcpy(&Mem[a + i], &p[i], DF_ALIGN);
+		Blank[(a + i) / DF_ALIGN] = false;
+		FlashSim.program++;
+		Now += FLASHSIM_PROGRAM_US;
+	}
+	return FLASH_SUCCESS;
+}
+
+//******************************************************
+// DF_ALIGN単位のブランクチェック
+// ブランクのときは0(false)を返します
+//******************************************************
+bool flash_datarom_blankcheck(const uint32_t addr)
+{
+	long a = simOffset(addr);
+	if (a < 0){
+		FlashSim.error++;
+		return true;
+	}
+	FlashSim.blank++;
+	Now += FLASHSIM_BLANK_US;
+	return !Blank[a / DF_ALIGN];
+}
+
+//コードフラッシュはエミュレートしません
+uint8_t flash_coderom_EraseBlock(const uint32_t){	return FLASH_FAILURE;	}
+uint8_t flash_coderom_WriteData(const uint32_t, void *, const uint16_t){	return FLASH_FAILURE;	}
+
+}
+
+//******************************************************
+// 元のファームウェアのフォーマット(512バイトセクタ、0x100からFATが1面、CRCの無いファイル)
+// 移行のテストで、そのファームウェアで書いたデータフラッシュを用意するために使います
+// 値は書き込み済みとして置くだけで、回数と時計は変えません
+//******************************************************
+#define OLD_SECTOR	512
+#define OLD_FAT		0x100
+
+static void place(long a, const unsigned char *p, int len)
+{
+	for (int i = 0; i < len; i++){
+		Mem[a + i] = p[i];
+	}
+	for (int i = 0; i < (len + DF_ALIGN - 1) / DF_ALIGN; i++){
+		Blank[a / DF_ALIGN + i] = false;
+	}
+}
+
+//全てブランクにして、ファイルが無いFATを置きます
+void flashsim_oldformat(void)
+{
+	unsigned char fat[SIM_SIZE / OLD_SECTOR * 2];
+
+	flash_Initialize();
+	flashsim_clear();
+	memset(fat, 0, sizeof(fat));
+	fat[1] = 2;		//セクタ0は使用中(EEP_USED)
+	place(OLD_FAT, fat, sizeof(fat));
+}
+
+//sectから続けたセクタに、ファイルとFATを置きます
+void flashsim_oldfile(int sect, const char *name, const char *data, int size)
+{
+	static unsigned char buf[SIM_SIZE];
+	int len = strlen(name);
+	int total = len + 3 + size;
+	int n = (total + OLD_SECTOR - 1) / OLD_SECTOR;
+
+	//ファイル名 00終端 | サイズ | 生データ
+	memset(buf, 0xFF, sizeof(buf));
+	memcpy(buf, name, len + 1);
+	buf[len + 1] = size & 0xFF;
+	buf[len + 2] = (size >> 8) & 0xFF;
+	memcpy(buf + len + 3, data, size);
+	place(sect * OLD_SECTOR, buf, (total + 1) & ~1);
+
+	//先頭セクタはEEP_TOP、ほかはEEP_USEDで、最終セクタには自分のセクタ番号を入れます
+	for (int k = 0; k < n; k++){
+		int s = sect + k;
+		int next = (k == n - 1) ? s : s + 1;
+		Mem[OLD_FAT + s * 2] = next;
+		Mem[OLD_FAT + s * 2 + 1] = (k == 0) ? 1 : 2;
+	}
+}
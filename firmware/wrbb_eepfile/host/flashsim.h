@@ -0,0 +1,44 @@
+/*
+ * RX63Nのデータフラッシュのエミュレータ
+ *
+ * Copyright (c) 2016 Wakayama.rb Ruby Board developers
+ *
+ * This software is released under the MIT License.
+ * https://github.com/wakayamarb/wrbb-v2lib-firm/blob/master/MITL
+ *
+ */
+#ifndef _FLASHSIM_H_
+#define _FLASHSIM_H_ 1
+
+//操作ごとにかかる時間(us)。仮想時計をこれだけ進めます
+//ボードで測った値に合わせて変えてください
+#ifndef FLASHSIM_ERASE_US
+#define FLASHSIM_ERASE_US	2000	//1イレースブロック(32バイト)の消去
+#endif
+#ifndef FLASHSIM_PROGRAM_US
+#define FLASHSIM_PROGRAM_US	50		//DF_ALIGN(2バイト)の書き込み
+#endif
+#ifndef FLASHSIM_BLANK_US
+#define FLASHSIM_BLANK_US	20		//DF_ALIGN(2バイト)のブランクチェック
+#endif
+
+//操作の回数
+typedef struct {
+	unsigned long erase;		//消去したイレースブロック数
+	unsigned long program;		//書き込んだDF_ALIGN単位の数
+	unsigned long blank;		//ブランクチェックしたDF_ALIGN単位の数
+	unsigned long error;		//ブランクでない箇所への書き込みなど、実機では壊れる操作の数
+} FLASHSIM_STAT;
+
+extern FLASHSIM_STAT FlashSim;
+
+void flashsim_clear(void);				//全てブランクにして、回数と時計を0にします
+void flashsim_reset_stat(void);			//回数と、イレースブロックごとの消去回数を0にします
+unsigned long flashsim_hottest(void);	//イレースブロックごとの消去回数の最大値を返します
+unsigned long flashsim_block_erase(unsigned long addr);	//先頭からaddrバイト目を含むイレースブロックの消去回数を返します
+void flashsim_cut(long n);				//消去と書き込みをn回したあとで電源が切れたことにします。-1で戻します
+void flashsim_realtime(bool on);		//millis()とdelay()を実際の時計にします
+void flashsim_oldformat(void);			//元のファームウェアのフォーマット(FAT1面、CRC無し)で、ファイルが無い状態にします
+void flashsim_oldfile(int sect, const char *name, const char *data, int size);	//元のファームウェアのフォーマットで、sectからファイルを置きます
+
+#endif // _FLASHSIM_H_
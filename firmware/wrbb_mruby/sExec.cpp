@@ -132,10 +132,21 @@ bool notFinishFlag = true;
 		}
 	}
 
+	//書き込み途中で電源が切れたファイルでないか、CRCを確かめます
+	if(EEP.fverify(fp) == 0){
+		char az[50];
+		sprintf( az,  "%s is broken!!", ExeFilename );
+		Serial.println( az );
+
+		EEP.fclose(fp);
+		mrb_close(mrb);
+		return false;
+	}
+
 	//mrbファイルチェックを行う
 	//int mrbFlag = 0;
 	char he[8];
-	for( int i=0; i<8; i++ ){	he[i] = EEP.fread(fp);	}
+	EEP.fread(fp, he, 8);
 
 	if( !(he[0]=='R' && he[1]=='I'
 	&& he[2]=='T' && he[3]=='E'
@@ -156,34 +167,39 @@ bool notFinishFlag = true;
 		return false;
 	}
 
-	//先頭にする
-	EEP.fseek(fp, 0, EEP_SEEKTOP );
+	//ファイルが連続したセクタに入っていれば、データフラッシュ上のバイトコードをそのまま実行します
+	//mrubyはバイトコードを参照し続けるので、mrb_close()するまでファイルはオープンしたままにします
+	const uint8_t *code = (const uint8_t *)EEP.fmap(fp);
 
-	//ファイルサイズを取得する
-	unsigned long tsize = EEP.ffilesize(ExeFilename);
+	if(code == NULL){
+		//先頭にする
+		EEP.fseek(fp, 0, EEP_SEEKTOP );
 
-	if( tsize>RUBY_CODE_SIZE ){
-		char az[50];
-		sprintf( az,  "%s size is greater than %lu.", ExeFilename, RUBY_CODE_SIZE );
-		Serial.println( az );
-		mrb_close(mrb);
-		return false;
-	}
+		//ファイルサイズを取得する
+		unsigned long tsize = EEP.ffilesize(ExeFilename);
 
-	RubyCode[0] = 0;
-	unsigned long pos = 0;
-	while( !EEP.fEof(fp) ){
-		RubyCode[pos] = EEP.fread(fp);
-		pos++;
+		if( tsize>RUBY_CODE_SIZE ){
+			char az[50];
+			sprintf( az,  "%s size is greater than %lu.", ExeFilename, RUBY_CODE_SIZE );
+			Serial.println( az );
+			EEP.fclose(fp);
+			mrb_close(mrb);
+			return false;
+		}
+
+		RubyCode[0] = 0;
+		EEP.fread(fp, (char*)RubyCode, tsize);
+		EEP.fclose(fp);
+		code = RubyCode;
 	}
-	EEP.fclose(fp);
 
 	DEBUG_PRINT("mruby", "START");
+	DEBUG_PRINT("mruby code", (code == RubyCode) ? "RAM" : "FLASH");
 
 	int arena = mrb_gc_arena_save(mrb);
 
 	//mrubyを実行します
-	mrb_load_irep( mrb, (const uint8_t *)RubyCode);
+	mrb_load_irep( mrb, code);
 
 	if( mrb->exc ){
 		//struct RString *str;
@@ -220,6 +236,11 @@ bool notFinishFlag = true;
 
 	mrb_close(mrb);
 
+	//データフラッシュ上で実行したときは、ここでクローズします
+	if(code != RubyCode){
+		EEP.fclose(fp);
+	}
+
 	DEBUG_PRINT("mruby", "END");
 
 	SdClassFlag = false;
@@ -12,6 +12,8 @@
 
 #include <mruby.h>
 
+#include <eepfile.h>
+
 #include "../wrbb.h"
 
 
@@ -75,7 +77,8 @@ int value;
 	mrb_full_gc(mrb);
 
 	if(value >0 ){
-		delay( value );
+		//待っている間に、フラッシュメモリの空きセクタを消去しておきます
+		EEP.wait( value );
 	}
 
 	return mrb_nil_value();			//戻り値は無しですよ。
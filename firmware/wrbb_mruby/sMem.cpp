@@ -76,29 +76,92 @@ char	*str;
 	return mrb_fixnum_value( ret );
 }
 
+//**************************************************
+// Ring Logにレコードを1つ追記します: MemFile.putrec
+//	MemFile.putrec( number, buf )
+//	number: ファイル番号 0 または 1
+//	buf: 書き込むデータ(28バイトまで)
+// 戻り値
+//	書いたバイト数, 失敗: -1
+//**************************************************
+mrb_value mrb_mem_putrec(mrb_state *mrb, mrb_value self)
+{
+int	num;
+mrb_value value;
+
+	mrb_get_args(mrb, "iS", &num, &value);
+
+	int ret = -1;
+	if( num==0 ){
+		ret = EEP.fputrec(Fp0, RSTRING_PTR(value), RSTRING_LEN(value));
+	}
+	else if( num==1 ){
+		ret = EEP.fputrec(Fp1, RSTRING_PTR(value), RSTRING_LEN(value));
+	}
+
+	return mrb_fixnum_value( ret );
+}
+
+//**************************************************
+// Ring Logからレコードを古い順に1つ読み込みます: MemFile.getrec
+//	MemFile.getrec( number )
+//	number: ファイル番号 0 または 1
+// 戻り値
+//	読み込んだデータ。最後まで読んだらnilが返る
+//**************************************************
+mrb_value mrb_mem_getrec(mrb_state *mrb, mrb_value self)
+{
+int	num;
+char	buf[EEPRING_RECSIZE];
+
+	mrb_get_args(mrb, "i", &num);
+
+	int len = -1;
+	if( num==0 ){
+		len = EEP.fgetrec(Fp0, buf, EEPRING_RECSIZE);
+	}
+	else if( num==1 ){
+		len = EEP.fgetrec(Fp1, buf, EEPRING_RECSIZE);
+	}
+
+	if( len<0 ){
+		return mrb_nil_value();
+	}
+	return mrb_str_new(mrb, buf, len);
+}
+
 //**************************************************
 // ファイルをオープンします: MemFile.open
 //	MemFile.open( number, filename[, mode] )
 //	number: ファイル番号 0 または 1
 //	filename: ファイル名(8.3形式)
-//	mode: 0:Read, 1:Append, 2:New Create
+//	mode: 0:Read, 1:Append, 2:New Create, 3:Ring Log
+//	size: Ring Logのときのリングの大きさ(バイト)。省略時は1024
 // 戻り値
 //	成功: 番号, 失敗: -1
+//
+// Ring Logは、大きさが決まったレコード単位の追記専用ファイルです
+// 無ければ作ります。一杯になると古いレコードから消えます
+// MemFile.putrecで追記し、mode 0でオープンしてMemFile.getrecで古い順に読みます
 //**************************************************
 mrb_value mrb_mem_open(mrb_state *mrb, mrb_value self)
 {
 int	num;
 int mode;
+int size;
 mrb_value value;
 char	*str;
 
-	int n = mrb_get_args(mrb, "iS|i", &num, &value, &mode);
+	int n = mrb_get_args(mrb, "iS|ii", &num, &value, &mode, &size);
 
 	str = RSTRING_PTR(value);
 
 	if( n<3 ){
 		mode = 0;
 	}
+	if( n<4 ){
+		size = 1024;
+	}
 
 	int ret = -1;
 	if( num==0 ){
@@ -112,6 +175,11 @@ char	*str;
 				ret = num;
 			}
 		}
+		else if( mode==3 ){
+			if(EEP.fopen(Fp0, str, EEP_APPEND | EEP_RING, size) != -1){
+				ret = num;
+			}
+		}
 		else{
 			if(EEP.fopen(Fp0, str, EEP_READ) != -1){
 				ret = num;
@@ -129,6 +197,11 @@ char	*str;
 				ret = num;
 			}
 		}
+		else if( mode==3 ){
+			if(EEP.fopen(Fp1, str, EEP_APPEND | EEP_RING, size) != -1){
+				ret = num;
+			}
+		}
 		else{
 			if(EEP.fopen(Fp1, str, EEP_READ) != -1){
 				ret = num;
@@ -276,7 +349,11 @@ void mem_Init(mrb_state *mrb)
 
 	mrb_define_module_function(mrb, memdModule, "write", mrb_mem_write, MRB_ARGS_REQ(3));
 
-	mrb_define_module_function(mrb, memdModule, "open", mrb_mem_open, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1));
+	mrb_define_module_function(mrb, memdModule, "open", mrb_mem_open, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(2));
+
+	mrb_define_module_function(mrb, memdModule, "putrec", mrb_mem_putrec, MRB_ARGS_REQ(2));
+
+	mrb_define_module_function(mrb, memdModule, "getrec", mrb_mem_getrec, MRB_ARGS_REQ(1));
 
 	mrb_define_module_function(mrb, memdModule, "close", mrb_mem_close, MRB_ARGS_REQ(1));
 
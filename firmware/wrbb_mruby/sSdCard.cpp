@@ -508,17 +508,23 @@ int SD_init(char *filename)
 	return 1;
 }
 
+//**************************************************
+// SD2EEPROM()のコピー元。SDカードのファイルからまとめて読み込みます
+//**************************************************
+static int sdSource(void *src, char *buf, int len)
+{
+	return ((File*)src)->read(buf, len);
+}
+
 //**************************************************
 // SDカードのファイルをフラッシュメモリにコピーします
 // 上書きです
+// ファイル全体をメモリに読み込まずに、少しずつコピーします
 // 失敗 0, 成功 1
 //**************************************************
 int SD2EEPROM(const char *sdfile, const char *eepfile)
 {
 File fsrc = SD.open(__null);
-FILEEEP fdstj;
-FILEEEP *fdst = &fdstj;
-int dsize;
 
 	//オープンします
 	if( !(fsrc = SD.open(sdfile, FILE_READ))){
@@ -528,36 +534,14 @@ int dsize;
 	//ファイルサイズを取得します
 	int fsize = fsrc.size();
 
-	//ヒープメモリの確保
-	char *readData = (char*)malloc(fsize);
-	if(readData == NULL){
-		Serial.println("..Out of Memory!");
-		fsrc.close();
-		return 0;
-	}
-	
-	//ファイルがあるかもしれないので、とりあえず削除しておきます。なかったら-1が返ってくるだけ
-	EEP.fdelete(eepfile);
-
-	//EEPをオープンします
-	if(EEP.fopen(fdst, eepfile, EEP_WRITE) == -1){
-		fsrc.close();
-		free( readData );
-		return 0;
-	}
-	
-	//読み込みます
-	dsize = fsrc.read(readData, fsize);
-
-	//書き込みます
-	EEP.fwrite(fdst, readData, &dsize);
+	//コピーします。同じ名前のファイルがあるときは、コピーし終わってから置き換えます
+	int ret = EEP.fimport(eepfile, sdSource, &fsrc, fsize);
 
 	//ファイルを閉じます
-	EEP.fclose(fdst);
 	fsrc.close();
 
-	//メモリを開放します
-	free( readData );
-
+	if(ret == -1){
+		return 0;
+	}
 	return 1;
 }
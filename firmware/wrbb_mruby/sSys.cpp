@@ -8,7 +8,6 @@
  *
  */
 #include <Arduino.h>
-#include <EEPROM.h>
 #include <reboot.h>
 
 #include <mruby.h>
@@ -18,6 +17,7 @@
 #include <mruby/version.h>
 
 #include <eeploader.h>
+#include <eepfile.h>
 
 #include "../wrbb.h"
 
@@ -89,6 +89,7 @@ int tmp;
 //	address: 書き込み開始アドレス(0x0000～0x00ff)
 //  buf: 書き込むデータ
 //  length: 書き込むサイズ
+// データはKVSに保存するので、書き換えても同じ場所を消去し続けません
 // 戻り値
 //  1:成功, 0:失敗
 //**************************************************
@@ -97,61 +98,114 @@ mrb_value mrb_system_push(mrb_state *mrb, mrb_value self)
 int		address;
 mrb_value value;
 int		len;
-char	*str;
 
 	mrb_get_args(mrb, "iSi", &address, &value, &len);
 
-	str = RSTRING_PTR(value);
-
-	if(address > EEPROMADDRESS){
+	if(address < 0 || address > EEPROMADDRESS || len < 0 || len > RSTRING_LEN(value)){
 		return mrb_fixnum_value( 0 );
 	}
 
-	int ret = 1;
-	for(int i=0; i<len; i++){
-		ret = EEPROM.write( (unsigned long)address, (unsigned char)str[i] );
-		if(ret==-1){
-			ret = 0;
-			break;
-		}
-		address++;
+	//領域からはみ出すところは書き込みません
+	if(address + len > EEPROMADDRESS + 1){
+		len = EEPROMADDRESS + 1 - address;
 	}
 
-	return mrb_fixnum_value( ret );
+	if(EEP.kvPush(address, RSTRING_PTR(value), len) == -1){
+		return mrb_fixnum_value( 0 );
+	}
+	return mrb_fixnum_value( 1 );
 }
 
 //**************************************************
 //フラッシュメモリから読み出します
 // System.pop(address, length)
 //	address: 読み込みアドレス(0x0000～0x00ff)
-//  length: 読み込みサイズ(MAX 32バイト)
+//  length: 読み込みサイズ
 // 戻り値
 //  読み込んだデータ
 //**************************************************
 mrb_value mrb_system_pop(mrb_state *mrb, mrb_value self)
 {
-unsigned char str[32];
+char	str[EEPPUSH_SIZE];
 int		address;
 int		len;
 
 	mrb_get_args(mrb, "ii", &address, &len);
 
-	if(len>32){
-		len = 32;
-	}
-
-	if(address > EEPROMADDRESS){
+	if(address < 0 || address > EEPROMADDRESS || len < 0){
 		return mrb_str_new(mrb, (const char *)str, 0);
 	}
 
-	for(int i=0; i<len; i++){
-		str[i] = EEPROM.read( (unsigned long)address );
-		address++;
+	if(address + len > EEPROMADDRESS + 1){
+		len = EEPROMADDRESS + 1 - address;
 	}
 
+	EEP.kvPop(address, str, len);
+
 	return mrb_str_new(mrb, (const char *)str, len);
 }
 
+//**************************************************
+// キーと値を保存します: System.kv_set
+// System.kv_set(key, value)
+//	key: キー(16バイトまで)
+//  value: 値(256バイトまで)
+// 同じキーに同じ値が入っているときは、書き込みません
+// 戻り値
+//  1:成功, 0:失敗
+//**************************************************
+mrb_value mrb_system_kv_set(mrb_state *mrb, mrb_value self)
+{
+mrb_value key, value;
+
+	mrb_get_args(mrb, "SS", &key, &value);
+
+	if(EEP.kvSet(RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(value), RSTRING_LEN(value)) == -1){
+		return mrb_fixnum_value( 0 );
+	}
+	return mrb_fixnum_value( 1 );
+}
+
+//**************************************************
+// キーの値を読み出します: System.kv_get
+// System.kv_get(key)
+//	key: キー
+// 戻り値
+//  値。キーが無いときはnil
+//**************************************************
+mrb_value mrb_system_kv_get(mrb_state *mrb, mrb_value self)
+{
+mrb_value key;
+char	buf[EEPKV_VALSIZE];
+
+	mrb_get_args(mrb, "S", &key);
+
+	int len = EEP.kvGet(RSTRING_PTR(key), RSTRING_LEN(key), buf, EEPKV_VALSIZE);
+	if(len == -1){
+		return mrb_nil_value();
+	}
+	return mrb_str_new(mrb, (const char *)buf, len);
+}
+
+//**************************************************
+// キーを削除します: System.kv_delete
+// System.kv_delete(key)
+//	key: キー
+// 戻り値
+//  1:成功, 0:失敗
+//**************************************************
+mrb_value mrb_system_kv_delete(mrb_state *mrb, mrb_value self)
+{
+mrb_value key;
+
+	mrb_get_args(mrb, "S", &key);
+
+	if(EEP.kvDelete(RSTRING_PTR(key), RSTRING_LEN(key)) == -1){
+		return mrb_fixnum_value( 0 );
+	}
+	return mrb_fixnum_value( 1 );
+}
+
 //**************************************************
 // ファイルローダーを呼び出します
 // System.fileload()
@@ -386,6 +440,9 @@ void sys_Init(mrb_state *mrb)
 
 	mrb_define_module_function(mrb, systemModule, "push", mrb_system_push, MRB_ARGS_REQ(3));
 	mrb_define_module_function(mrb, systemModule, "pop", mrb_system_pop, MRB_ARGS_REQ(2));
+	mrb_define_module_function(mrb, systemModule, "kv_set", mrb_system_kv_set, MRB_ARGS_REQ(2));
+	mrb_define_module_function(mrb, systemModule, "kv_get", mrb_system_kv_get, MRB_ARGS_REQ(1));
+	mrb_define_module_function(mrb, systemModule, "kv_delete", mrb_system_kv_delete, MRB_ARGS_REQ(1));
 
 	mrb_define_module_function(mrb, systemModule, "fileload", mrb_system_fileload, MRB_ARGS_NONE());
 